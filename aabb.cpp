@@ -1,4 +1,6 @@
 #include "aabb.hpp"
+#include "counters.hpp"
+#include "trace.hpp"
 
 
 Aabb surrounding_box(Aabb& box0, Aabb& box1) {
@@ -12,6 +14,7 @@ Aabb surrounding_box(Aabb& box0, Aabb& box1) {
 }
 
 bool Aabb::hit(const Ray& r, float tmin, float tmax) const {
+  COUNT(COUNT_BOX_TESTS);
   for (int a = 0; a < 3; a++) {
     float invD = 1.0f / r.direction()[a];
     float t0 = (min()[a] - r.origin()[a]) * invD;
@@ -45,6 +48,12 @@ vec3 Aabb::min() const { return _min; }
 vec3 Aabb::max() const { return _max; }
 
 BVHNode::BVHNode(Hitable **l, int n, float time0, float time1, unidist& dist) {
+  // Traced once per tree, not for every node
+  static thread_local bool building = false;
+  bool outermost = !building;
+  TraceSpan span(outermost ? "build BVH" : NULL);
+  building = true;
+
   int axis = int(3 * dist.get());
   if (axis == 0)
     qsort(l, n, sizeof(Hitable *), box_x_compare);
@@ -69,6 +78,7 @@ BVHNode::BVHNode(Hitable **l, int n, float time0, float time1, unidist& dist) {
     std::cerr << "No bounding box in BVHNode constructor" << std::endl;
   }
   box = surrounding_box(box_left, box_right);
+  building = !outermost;
 }
 
 int box_x_compare(const void* a, const void* b) {
@@ -112,11 +122,20 @@ bool BVHNode::bounding_box(float t0, float t1, Aabb& b) const {
   return true;
 }
 
-bool BVHNode::hit(const Ray& r, float tmin, float tmax, hit_record& rec) const {
+void BVHNode::collect_emitters(std::vector<Hitable*>& emitters) {
+  left->collect_emitters(emitters);
+  // Single-element nodes point both children at the same hitable
+  if(right != left) {
+    right->collect_emitters(emitters);
+  }
+}
+
+bool BVHNode::hit(const Ray& r, float tmin, float tmax, hit_record& rec, Sampler& sampler) const {
+  COUNT(COUNT_BVH_NODES);
   if (box.hit(r, tmin, tmax)) {
     hit_record left_rec, right_rec;
-    bool hit_left = left->hit(r, tmin, tmax, left_rec);
-    bool hit_right = right->hit(r, tmin, tmax, right_rec);
+    bool hit_left = left->hit(r, tmin, tmax, left_rec, sampler);
+    bool hit_right = right->hit(r, tmin, tmax, right_rec, sampler);
 
     if (hit_left && hit_right) {
       if(left_rec.t < right_rec.t)
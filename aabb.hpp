@@ -36,8 +36,9 @@ public:
   BVHNode() {}
   BVHNode(Hitable **l, int n, float time0, float time1, unidist& dist);
 
-  virtual bool hit(const Ray& r, float tmin, float tmax, hit_record& rec) const;
+  virtual bool hit(const Ray& r, float tmin, float tmax, hit_record& rec, Sampler& sampler) const;
   virtual bool bounding_box(float t0, float t1, Aabb& box) const;
+  virtual void collect_emitters(std::vector<Hitable*>& emitters);
   Hitable *left;
   Hitable *right;
   Aabb box;
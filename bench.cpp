@@ -0,0 +1,408 @@
+// Microbenchmarks of the intersection kernels and of BVH traversal.
+//
+// Every benchmark traces a fixed set of rays, generated from fixed seeds or
+// read from a file written by an earlier run (--save-rays, --load-rays), so two
+// builds can be compared on exactly the same work. Each set is traced once
+// to warm up and then reps times; the median time per ray is reported with
+// the minimum and the median absolute deviation, and the number of hits, so
+// a change that alters results shows up next to one that alters speed.
+//
+// Run on an idle machine, pinned to one CPU (taskset -c N ./bench) for the
+// steadiest numbers.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "ray.hpp"
+#include "hitable.hpp"
+#include "sphere.hpp"
+#include "rect.hpp"
+#include "aabb.hpp"
+#include "camera.hpp"
+#include "triangles.hpp"
+#include "sampler.hpp"
+#include "scenefile.hpp"
+#include "scenebuilder.hpp"
+#include "utils.hpp"
+
+struct RaySet {
+  std::string name;
+  std::vector<Ray> rays;
+};
+
+struct BenchResult {
+  std::string name;
+  long rays;
+  int reps;
+  double median_ns, min_ns, mad_ns;
+  long hits;
+};
+
+// Keeps the compiler from dropping hit() calls whose results are unused
+volatile float sink;
+
+const char RAYS_MAGIC[4] = {'W', 'R', 'R', 'Y'};
+const uint32_t RAYS_VERSION = 1;
+
+void save_rays(const std::string& file_name, const std::vector<RaySet>& sets) {
+  std::ofstream file(file_name, std::ios::binary);
+  file.write(RAYS_MAGIC, 4);
+  file.write((const char*)&RAYS_VERSION, sizeof(RAYS_VERSION));
+  uint32_t num_sets = sets.size();
+  file.write((const char*)&num_sets, sizeof(num_sets));
+  for(const RaySet& set : sets) {
+    uint32_t name_size = set.name.size(), num_rays = set.rays.size();
+    file.write((const char*)&name_size, sizeof(name_size));
+    file.write(set.name.data(), name_size);
+    file.write((const char*)&num_rays, sizeof(num_rays));
+    for(const Ray& r : set.rays) {
+      float v[7] = {r.orig[0], r.orig[1], r.orig[2], r.dir[0], r.dir[1], r.dir[2], r._time};
+      file.write((const char*)v, sizeof(v));
+    }
+  }
+  if(!file) {
+    std::cerr << "Could not write ray file " << file_name << std::endl;
+    exit(-1);
+  }
+  std::cout << "Wrote ray sets to " << file_name << std::endl;
+}
+
+void load_rays(const std::string& file_name, std::vector<RaySet>& sets) {
+  std::ifstream file(file_name, std::ios::binary);
+  char magic[4];
+  uint32_t version, num_sets;
+  file.read(magic, 4);
+  file.read((char*)&version, sizeof(version));
+  file.read((char*)&num_sets, sizeof(num_sets));
+  if(!file || memcmp(magic, RAYS_MAGIC, 4) || version != RAYS_VERSION) {
+    std::cerr << file_name << " is not a ray file" << std::endl;
+    exit(-1);
+  }
+
+  sets.resize(num_sets);
+  for(RaySet& set : sets) {
+    uint32_t name_size, num_rays;
+    file.read((char*)&name_size, sizeof(name_size));
+    set.name.resize(name_size);
+    file.read(&set.name[0], name_size);
+    file.read((char*)&num_rays, sizeof(num_rays));
+    set.rays.resize(num_rays);
+    for(Ray& r : set.rays) {
+      float v[7];
+      file.read((char*)v, sizeof(v));
+      r = Ray(vec3(v[0], v[1], v[2]), vec3(v[3], v[4], v[5]), v[6]);
+    }
+  }
+  if(!file) {
+    std::cerr << "Ray file " << file_name << " is truncated" << std::endl;
+    exit(-1);
+  }
+}
+
+const RaySet& find_set(const std::vector<RaySet>& sets, const std::string& name) {
+  for(const RaySet& set : sets) {
+    if(set.name == name) {
+      return set;
+    }
+  }
+  std::cerr << "No ray set " << name << ", the ray file was made for other benchmarks" << std::endl;
+  exit(-1);
+}
+
+vec3 random_direction(unidist& rng) {
+  float u0 = rng.get();
+  float u1 = rng.get();
+  return sample_on_unit_sphere(falg::Vec2(u0, u1));
+}
+
+// Rays from all around box towards points in it, spread a quarter beyond
+// its sides so that some miss
+std::vector<Ray> aimed_rays(const Aabb& box, int n, unidist& rng) {
+  vec3 center = 0.5f * (box._min + box._max);
+  vec3 extent = box._max - box._min;
+  float radius = 2.0f * extent.norm() + 1.0f;
+
+  std::vector<Ray> rays(n);
+  for(int i = 0; i < n; i++) {
+    vec3 target;
+    for(int c = 0; c < 3; c++) {
+      target[c] = center[c] + (rng.get() - 0.5f) * 1.5f * extent[c];
+    }
+    vec3 origin = center + radius * random_direction(rng);
+    rays[i] = Ray(origin, (target - origin).normalized(), rng.get());
+  }
+  return rays;
+}
+
+// Ray i is aimed at triangle i % number of triangles, at barycentric
+// coordinates a little past its edges
+std::vector<Ray> triangle_rays(const MeshData& mesh, int n, unidist& rng) {
+  int num_triangles = mesh.indices.size() / 3;
+  std::vector<Ray> rays(n);
+  for(int i = 0; i < n; i++) {
+    vec3 v[3];
+    for(int k = 0; k < 3; k++) {
+      const float* p = &mesh.vertices[3 * mesh.indices[3 * (i % num_triangles) + k]];
+      v[k] = vec3(p[0], p[1], p[2]);
+    }
+    float u = rng.get() * 1.2f - 0.1f;
+    float w = rng.get() * (1.1f - u);
+    vec3 target = v[0] + u * (v[1] - v[0]) + w * (v[2] - v[0]);
+    float size = (v[1] - v[0]).norm() + (v[2] - v[0]).norm() + 1e-3f;
+    vec3 origin = target + 4.0f * size * random_direction(rng);
+    rays[i] = Ray(origin, (target - origin).normalized(), rng.get());
+  }
+  return rays;
+}
+
+// One camera ray per pixel, and from every first hit, a ray leaving in a
+// cosine-distributed direction, as the path tracer's diffuse bounces do
+void scene_rays(const SceneDescription& scene, Hitable* world, int width, int height,
+		std::vector<Ray>& primary, std::vector<Ray>& secondary) {
+  const SceneCamera& c = scene.camera;
+  vec3 lookfrom(c.lookfrom[0], c.lookfrom[1], c.lookfrom[2]);
+  vec3 lookat(c.lookat[0], c.lookat[1], c.lookat[2]);
+  float focus_dist = c.focus_dist > 0 ? c.focus_dist : (lookfrom - lookat).norm();
+  Camera cam(lookfrom, lookat, vec3(c.vup[0], c.vup[1], c.vup[2]), c.vfov, float(width) / height,
+	     c.aperture, focus_dist, 0.0f, 1.0f);
+
+  Sampler *sampler = make_sampler(SamplerType::Independent, 1, 0);
+  unidist rng(0.0f, 1.0f, 7);
+  for(int y = 0; y < height; y++) {
+    for(int x = 0; x < width; x++) {
+      sampler->start_pixel_sample(x, y, 0);
+      Ray r = cam.getRay((x + 0.5f) / width, (y + 0.5f) / height, *sampler);
+      primary.push_back(r);
+
+      hit_record rec;
+      if(world->hit(r, 0.001f, MAXFLOAT, rec, *sampler)) {
+	vec3 n = rec.normal.normalized();
+	if(falg::dot(n, r.direction()) > 0) {
+	  n = -n;
+	}
+	vec3 local = sample_cosine_hemisphere(falg::Vec2(rng.get(), rng.get()));
+	vec3 a = std::abs(n[0]) > 0.9f ? vec3(0, 1, 0) : vec3(1, 0, 0);
+	vec3 t = cross(a, n).normalized();
+	vec3 b = cross(n, t);
+	secondary.push_back(Ray(rec.p, local[0] * t + local[1] * b + local[2] * n, r.time()));
+      }
+    }
+  }
+  delete sampler;
+}
+
+// Times trace over the whole set reps times, after one untimed run
+BenchResult run_benchmark(const std::string& name, const std::vector<Ray>& rays, int reps,
+			  const std::function<bool(const Ray& r, int i, hit_record& rec)>& trace) {
+  BenchResult result;
+  result.name = name;
+  result.rays = rays.size();
+  result.reps = reps;
+
+  std::vector<double> ns_per_ray;
+  for(int rep = -1; rep < reps; rep++) {
+    long hits = 0;
+    float t_sum = 0.0f;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for(unsigned int i = 0; i < rays.size(); i++) {
+      hit_record rec;
+      if(trace(rays[i], i, rec)) {
+	hits++;
+	t_sum += rec.t;
+      }
+    }
+    std::chrono::duration<double, std::nano> time = std::chrono::steady_clock::now() - start;
+    sink = t_sum;
+
+    result.hits = hits;
+    if(rep >= 0) {
+      ns_per_ray.push_back(time.count() / rays.size());
+    }
+  }
+
+  std::sort(ns_per_ray.begin(), ns_per_ray.end());
+  result.median_ns = ns_per_ray[ns_per_ray.size() / 2];
+  result.min_ns = ns_per_ray[0];
+  std::vector<double> deviations;
+  for(double ns : ns_per_ray) {
+    deviations.push_back(std::abs(ns - result.median_ns));
+  }
+  std::sort(deviations.begin(), deviations.end());
+  result.mad_ns = deviations[deviations.size() / 2];
+  return result;
+}
+
+void write_json(const std::string& file_name, const std::vector<BenchResult>& results) {
+  std::ofstream file(file_name);
+  file << "{\n  \"benchmarks\": [\n";
+  for(unsigned int i = 0; i < results.size(); i++) {
+    const BenchResult& r = results[i];
+    file << "    {\"name\": \"" << r.name << "\", \"rays\": " << r.rays << ", \"reps\": " << r.reps
+	 << ", \"median_ns_per_ray\": " << r.median_ns << ", \"min_ns_per_ray\": " << r.min_ns
+	 << ", \"mad_ns_per_ray\": " << r.mad_ns << ", \"mrays_per_s\": " << 1e3 / r.median_ns
+	 << ", \"hits\": " << r.hits << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+  }
+  file << "  ]\n}\n";
+  if(!file) {
+    std::cerr << "Could not write " << file_name << std::endl;
+    exit(-1);
+  }
+  std::cout << "Wrote results to " << file_name << std::endl;
+}
+
+void print_usage(const char* program) {
+  std::cout << "Usage: " << program << " [options]" << std::endl << std::endl
+	    << "  --scene FILE      scene file for the traversal benchmarks (scenes/teapot.scene)" << std::endl
+	    << "  --mesh FILE       mesh for the triangle benchmarks (teapot.obj)" << std::endl
+	    << "  --rays N          rays per kernel benchmark (1000000)" << std::endl
+	    << "  --size WxH        camera rays for the traversal benchmarks (320x240)" << std::endl
+	    << "  --reps N          timed runs of each benchmark (15)" << std::endl
+	    << "  --filter TEXT     only run benchmarks whose name contains TEXT" << std::endl
+	    << "  --json FILE       also write the results as JSON" << std::endl
+	    << "  --save-rays FILE  write the generated ray sets" << std::endl
+	    << "  --load-rays FILE  trace the ray sets of an earlier --save-rays" << std::endl;
+}
+
+int main(int argc, char** argv) {
+  std::string scene_file = "scenes/teapot.scene", mesh_file = "teapot.obj";
+  std::string filter, json_file, save_file, load_file;
+  int num_rays = 1000000, width = 320, height = 240, reps = 15;
+
+  for(int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if(arg == "-h" || arg == "--help") {
+      print_usage(argv[0]);
+      return 0;
+    }
+    if(i + 1 >= argc) {
+      std::cerr << "Missing value for " << arg << ", see --help" << std::endl;
+      exit(-1);
+    }
+    std::string value = argv[++i];
+    if(arg == "--scene") {
+      scene_file = value;
+    } else if(arg == "--mesh") {
+      mesh_file = value;
+    } else if(arg == "--rays") {
+      num_rays = std::max(1, atoi(value.c_str()));
+    } else if(arg == "--size") {
+      if(sscanf(value.c_str(), "%dx%d", &width, &height) != 2 || width < 1 || height < 1) {
+	std::cerr << "Invalid size " << value << ", expected WxH" << std::endl;
+	exit(-1);
+      }
+    } else if(arg == "--reps") {
+      reps = std::max(1, atoi(value.c_str()));
+    } else if(arg == "--filter") {
+      filter = value;
+    } else if(arg == "--json") {
+      json_file = value;
+    } else if(arg == "--save-rays") {
+      save_file = value;
+    } else if(arg == "--load-rays") {
+      load_file = value;
+    } else {
+      std::cerr << "Unknown option " << arg << ", see --help" << std::endl;
+      exit(-1);
+    }
+  }
+
+  // The primitives, each around the unit cube, and the mesh and scene
+  Sphere sphere(vec3(0, 0, 0), 1.0f, nullptr);
+  MovingSphere moving_sphere(vec3(0, -0.5f, 0), vec3(0, 0.5f, 0), 0.0f, 1.0f, 0.5f, nullptr);
+  XYRect xy_rect(-1, 1, -1, 1, 0, nullptr);
+  XZRect xz_rect(-1, 1, -1, 1, 0, nullptr);
+  YZRect yz_rect(-1, 1, -1, 1, 0, nullptr);
+  Aabb box(vec3(-1, -1, -1), vec3(1, 1, 1));
+
+  TriangleHitable mesh(mesh_file, nullptr);
+  MeshData mesh_data;
+  mesh.export_mesh(mesh_data);
+  Aabb mesh_box;
+  mesh.bounding_box(0.0f, 1.0f, mesh_box);
+
+  SceneDescription scene;
+  if(is_compiled_scene(scene_file)) {
+    read_compiled_scene(scene_file, scene);
+  } else {
+    parse_scene(scene_file, scene);
+  }
+  if(!scene.camera.set) {
+    std::cerr << "Scene " << scene_file << " has no camera" << std::endl;
+    exit(-1);
+  }
+  unidist scene_dist(0.0f, 1.0f, 0);
+  Hitable *world = build_scene(scene, scene_dist);
+
+  std::vector<RaySet> sets;
+  if(!load_file.empty()) {
+    load_rays(load_file, sets);
+  } else {
+    unidist rng(0.0f, 1.0f, 1);
+    sets.push_back({"unit", aimed_rays(box, num_rays, rng)});
+    sets.push_back({"mesh", aimed_rays(mesh_box, num_rays, rng)});
+    sets.push_back({"triangle", triangle_rays(mesh_data, num_rays, rng)});
+    RaySet primary = {"primary", {}}, secondary = {"secondary", {}};
+    scene_rays(scene, world, width, height, primary.rays, secondary.rays);
+    sets.push_back(primary);
+    sets.push_back(secondary);
+  }
+  if(!save_file.empty()) {
+    save_rays(save_file, sets);
+  }
+
+  Sampler *sampler = make_sampler(SamplerType::Independent, 1, 0);
+  const RaySet& unit = find_set(sets, "unit");
+  const RaySet& mesh_rays = find_set(sets, "mesh");
+  const RaySet& triangle = find_set(sets, "triangle");
+  const RaySet& primary = find_set(sets, "primary");
+  const RaySet& secondary = find_set(sets, "secondary");
+  int num_triangles = mesh_data.indices.size() / 3;
+
+  struct Benchmark {
+    std::string name;
+    const RaySet* rays;
+    std::function<bool(const Ray& r, int i, hit_record& rec)> trace;
+  };
+  std::vector<Benchmark> benchmarks = {
+    {"sphere", &unit, [&](const Ray& r, int i, hit_record& rec) { return sphere.hit(r, 0.001f, MAXFLOAT, rec, *sampler); }},
+    {"moving_sphere", &unit, [&](const Ray& r, int i, hit_record& rec) { return moving_sphere.hit(r, 0.001f, MAXFLOAT, rec, *sampler); }},
+    {"xy_rect", &unit, [&](const Ray& r, int i, hit_record& rec) { return xy_rect.hit(r, 0.001f, MAXFLOAT, rec, *sampler); }},
+    {"xz_rect", &unit, [&](const Ray& r, int i, hit_record& rec) { return xz_rect.hit(r, 0.001f, MAXFLOAT, rec, *sampler); }},
+    {"yz_rect", &unit, [&](const Ray& r, int i, hit_record& rec) { return yz_rect.hit(r, 0.001f, MAXFLOAT, rec, *sampler); }},
+    {"aabb", &unit, [&](const Ray& r, int i, hit_record& rec) { rec.t = 0.0f; return box.hit(r, 0.001f, MAXFLOAT); }},
+    {"triangle", &triangle, [&](const Ray& r, int i, hit_record& rec) { return mesh.hit_triangle(r, 0.001f, MAXFLOAT, rec, i % num_triangles); }},
+    {"mesh_bvh", &mesh_rays, [&](const Ray& r, int i, hit_record& rec) { return mesh.hit(r, 0.001f, MAXFLOAT, rec, *sampler); }},
+    {"scene_primary", &primary, [&](const Ray& r, int i, hit_record& rec) { return world->hit(r, 0.001f, MAXFLOAT, rec, *sampler); }},
+    {"scene_secondary", &secondary, [&](const Ray& r, int i, hit_record& rec) { return world->hit(r, 0.001f, MAXFLOAT, rec, *sampler); }},
+  };
+
+  std::vector<BenchResult> results;
+  std::cout << "benchmark               rays   median ns   min ns    mad ns   Mrays/s        hits" << std::endl;
+  for(const Benchmark& b : benchmarks) {
+    if(b.name.find(filter) == std::string::npos || b.rays->rays.empty()) {
+      continue;
+    }
+    BenchResult r = run_benchmark(b.name, b.rays->rays, reps, b.trace);
+    results.push_back(r);
+    std::cout << std::left << std::setw(18) << r.name << std::right << std::setw(10) << r.rays
+	      << std::fixed << std::setprecision(2) << std::setw(12) << r.median_ns << std::setw(9) << r.min_ns
+	      << std::setw(10) << r.mad_ns << std::setw(10) << 1e3 / r.median_ns << std::defaultfloat
+	      << std::setw(12) << r.hits << std::endl;
+  }
+
+  if(!json_file.empty()) {
+    write_json(json_file, results);
+  }
+
+  delete sampler;
+  return 0;
+}
@@ -1,17 +1,7 @@
 #ifndef INCLUDE_CAMERA_HPP
 #define INCLUDE_CAMERA_HPP
 
-#include "utils.hpp"
-
-vec3 random_in_unit_disk(unidist& dist) {
-  vec3 p;
-  do {
-    float f1 = dist.get();
-    float f2 = dist.get();
-    p = 2.0 * vec3(f1, f2, 0) - vec3(1, 1, 0);
-  } while (falg::dot(p, p) >= 1.0);
-  return p;
-}
+#include "sampler.hpp"
 
 class Camera {
 public:
@@ -33,10 +23,10 @@ public:
     vertical = 2 * half_height * focus_dist * v;
   }
 
-  Ray getRay(float s, float t, unidist& dist) {
-    vec3 rd = lens_radius * random_in_unit_disk(dist);
+  Ray getRay(float s, float t, Sampler& sampler) {
+    vec3 rd = lens_radius * random_in_unit_disk(sampler);
     vec3 offset = u * rd.x() + v * rd.y();
-    float time = time0 + (time1 - time0) * dist.get();
+    float time = time0 + (time1 - time0) * sampler.get_1d();
     return Ray(origin + offset,
 	       lower_left_corner + s * horizontal + t * vertical - origin - offset,
 	       time);
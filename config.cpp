@@ -0,0 +1,273 @@
+#include "config.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+static void bad_value(const std::string& key, const std::string& value, const std::string& expected) {
+  std::cerr << "Invalid value '" << value << "' for " << key << ", expected " << expected << std::endl;
+  exit(-1);
+}
+
+static int parse_int(const std::string& key, const std::string& value, int min) {
+  char* end;
+  long v = strtol(value.c_str(), &end, 10);
+  if(value.empty() || *end || v < min || v > INT_MAX) {
+    bad_value(key, value, "an integer from " + std::to_string(min) + " to " + std::to_string(INT_MAX));
+  }
+  return v;
+}
+
+static uint32_t parse_uint32(const std::string& key, const std::string& value) {
+  char* end;
+  // strtoul would take a minus sign and negate the result
+  unsigned long v = strtoul(value.c_str(), &end, 10);
+  if(value.empty() || value[0] == '-' || *end || v > UINT32_MAX) {
+    bad_value(key, value, "an integer from 0 to " + std::to_string(UINT32_MAX));
+  }
+  return v;
+}
+
+static float parse_float(const std::string& key, const std::string& value) {
+  char* end;
+  float v = strtof(value.c_str(), &end);
+  if(value.empty() || *end) {
+    bad_value(key, value, "a number");
+  }
+  return v;
+}
+
+static bool parse_bool(const std::string& key, const std::string& value) {
+  if(value == "true" || value == "yes" || value == "on" || value == "1") {
+    return true;
+  }
+  if(value == "false" || value == "no" || value == "off" || value == "0") {
+    return false;
+  }
+  bad_value(key, value, "true or false");
+  return false;
+}
+
+static void parse_vec3(const std::string& key, const std::string& value, float v[3]) {
+  std::stringstream ss(value);
+  std::string part;
+  for(int i = 0; i < 3; i++) {
+    if(!std::getline(ss, part, ',')) {
+      bad_value(key, value, "x,y,z");
+    }
+    v[i] = parse_float(key, part);
+  }
+  if(std::getline(ss, part, ',')) {
+    bad_value(key, value, "x,y,z");
+  }
+}
+
+static SamplerType parse_sampler(const std::string& key, const std::string& value) {
+  if(value == "independent") {
+    return SamplerType::Independent;
+  } else if(value == "stratified") {
+    return SamplerType::Stratified;
+  } else if(value == "sobol") {
+    return SamplerType::Sobol;
+  } else if(value == "bluenoise") {
+    return SamplerType::BlueNoise;
+  }
+  bad_value(key, value, "independent, stratified, sobol or bluenoise");
+  return SamplerType::Sobol;
+}
+
+static MISHeuristic parse_heuristic(const std::string& key, const std::string& value) {
+  if(value == "balance") {
+    return MISHeuristic::Balance;
+  } else if(value == "power") {
+    return MISHeuristic::Power;
+  }
+  bad_value(key, value, "balance or power");
+  return MISHeuristic::Power;
+}
+
+static PixelFormat parse_pixel_format(const std::string& key, const std::string& value) {
+  if(value == "float") {
+    return PixelFormat::Float;
+  } else if(value == "half") {
+    return PixelFormat::Half;
+  } else if(value == "rgb9e5") {
+    return PixelFormat::RGB9E5;
+  }
+  bad_value(key, value, "float, half or rgb9e5");
+  return PixelFormat::Float;
+}
+
+static HeatmapCost parse_heatmap(const std::string& key, const std::string& value) {
+  if(value == "none") {
+    return HeatmapCost::None;
+  } else if(value == "nodes") {
+    return HeatmapCost::Nodes;
+  } else if(value == "tests") {
+    return HeatmapCost::Tests;
+  } else if(value == "time") {
+    return HeatmapCost::Time;
+  }
+  bad_value(key, value, "none, nodes, tests or time");
+  return HeatmapCost::None;
+}
+
+struct Option {
+  const char* key;
+  const char* help;
+  std::function<void(RenderConfig&, const std::string& key, const std::string& value)> set;
+};
+
+static const std::vector<Option>& options() {
+  typedef RenderConfig C;
+  typedef const std::string S;
+  static const std::vector<Option> list = {
+    {"threads", "render threads, 0 for every CPU", [](C& c, S& k, S& v) { c.threads = parse_int(k, v, 0); }},
+    {"pin_threads", "bind each thread to its own CPU", [](C& c, S& k, S& v) { c.pin_threads = parse_bool(k, v); }},
+    {"replicate_scene", "copy the scene to every NUMA node", [](C& c, S& k, S& v) { c.replicate_scene = parse_bool(k, v); }},
+    {"width", "image width in pixels", [](C& c, S& k, S& v) { c.width = parse_int(k, v, 1); }},
+    {"height", "image height in pixels", [](C& c, S& k, S& v) { c.height = parse_int(k, v, 1); }},
+    {"samples", "most samples per pixel", [](C& c, S& k, S& v) { c.samples = parse_int(k, v, 1); }},
+    {"min_samples", "samples every pixel gets in the first pass", [](C& c, S& k, S& v) { c.min_samples = parse_int(k, v, 1); }},
+    {"adaptive_batch", "samples added to unconverged pixels per pass", [](C& c, S& k, S& v) { c.adaptive_batch = parse_int(k, v, 1); }},
+    {"adaptive_error", "relative standard error a pixel converges at", [](C& c, S& k, S& v) { c.adaptive_error = parse_float(k, v); }},
+    {"adaptive_min_mean", "mean the error of dark pixels is relative to", [](C& c, S& k, S& v) { c.adaptive_min_mean = parse_float(k, v); }},
+    {"sample_start", "first sample index of this job", [](C& c, S& k, S& v) { c.sample_start = parse_int(k, v, 0); }},
+    {"accumulation", "write sums and sample counts here instead of images", [](C& c, S& k, S& v) { c.accumulation = v; }},
+    {"merge", "comma-separated accumulation files to combine into the images", [](C& c, S& k, S& v) { c.merge = v; }},
+    {"max_depth", "most bounces per path", [](C& c, S& k, S& v) { c.max_depth = parse_int(k, v, 0); }},
+    {"rr_min_depth", "bounces before Russian roulette starts", [](C& c, S& k, S& v) { c.rr_min_depth = parse_int(k, v, 0); }},
+    {"tile_size", "side of the square tiles handed to threads", [](C& c, S& k, S& v) { c.tile_size = parse_int(k, v, 1); }},
+    {"coordinator", "hand tiles to workers connecting to unix:PATH or HOST:PORT", [](C& c, S& k, S& v) { c.coordinator = v; }},
+    {"worker", "render tiles for the coordinator at unix:PATH or HOST:PORT", [](C& c, S& k, S& v) { c.worker = v; }},
+    {"tile_timeout", "seconds before a tile is also given to another worker", [](C& c, S& k, S& v) { c.tile_timeout = parse_int(k, v, 1); }},
+    {"scene", "scene file, or teapot_scene, finale, cornell_box, perlin_spheres, two_spheres or some_scene", [](C& c, S& k, S& v) { c.scene = v; }},
+    {"compile_scene", "compile the scene file to this file and exit", [](C& c, S& k, S& v) { c.compile_scene = v; }},
+    {"lookfrom", "camera position, x,y,z", [](C& c, S& k, S& v) { parse_vec3(k, v, c.lookfrom); c.has_lookfrom = true; }},
+    {"lookat", "point the camera looks at, x,y,z", [](C& c, S& k, S& v) { parse_vec3(k, v, c.lookat); c.has_lookat = true; }},
+    {"vup", "camera up direction, x,y,z", [](C& c, S& k, S& v) { parse_vec3(k, v, c.vup); c.has_vup = true; }},
+    {"vfov", "vertical field of view in degrees", [](C& c, S& k, S& v) { c.vfov = parse_float(k, v); }},
+    {"aperture", "lens diameter", [](C& c, S& k, S& v) { c.aperture = parse_float(k, v); }},
+    {"focus_dist", "distance in focus, 0 for the distance to lookat", [](C& c, S& k, S& v) { c.focus_dist = parse_float(k, v); }},
+    {"frames", "frames in the sequence", [](C& c, S& k, S& v) { c.frames = parse_int(k, v, 1); }},
+    {"first_frame", "first frame to render", [](C& c, S& k, S& v) { c.first_frame = parse_int(k, v, 0); }},
+    {"last_frame", "last frame to render, -1 for the last of the sequence", [](C& c, S& k, S& v) { c.last_frame = parse_int(k, v, -1); }},
+    {"shutter", "exposure as a fraction of the frame interval", [](C& c, S& k, S& v) { c.shutter = parse_float(k, v); }},
+    {"lookfrom_end", "camera position at the end of the sequence, x,y,z", [](C& c, S& k, S& v) { parse_vec3(k, v, c.lookfrom_end); c.has_lookfrom_end = true; }},
+    {"lookat_end", "point looked at at the end of the sequence, x,y,z", [](C& c, S& k, S& v) { parse_vec3(k, v, c.lookat_end); c.has_lookat_end = true; }},
+    {"orbit", "degrees the camera circles lookat over the sequence", [](C& c, S& k, S& v) { c.orbit = parse_float(k, v); }},
+    {"output", "image file", [](C& c, S& k, S& v) { c.output = v; }},
+    {"sample_count_output", "image of samples per pixel", [](C& c, S& k, S& v) { c.sample_count_output = v; }},
+    {"stream_output", "write one-pass renders while they render", [](C& c, S& k, S& v) { c.stream_output = parse_bool(k, v); }},
+    {"framebuffer", "pixel storage: float, half or rgb9e5", [](C& c, S& k, S& v) { c.framebuffer = parse_pixel_format(k, v); }},
+    {"denoise", "filter output with the denoiser", [](C& c, S& k, S& v) { c.denoise = parse_bool(k, v); }},
+    {"noisy_output", "image file for the unfiltered estimate", [](C& c, S& k, S& v) { c.noisy_output = v; }},
+    {"write_aovs", "write the beauty pass and features to aov_output", [](C& c, S& k, S& v) { c.write_aovs = parse_bool(k, v); }},
+    {"aov_output", "multi-channel EXR file", [](C& c, S& k, S& v) { c.aov_output = v; }},
+    {"checkpoint", "checkpoint file", [](C& c, S& k, S& v) { c.checkpoint = v; }},
+    {"checkpoint_interval", "seconds between checkpoints", [](C& c, S& k, S& v) { c.checkpoint_interval = parse_int(k, v, 0); }},
+    {"resume", "continue from a matching checkpoint", [](C& c, S& k, S& v) { c.resume = parse_bool(k, v); }},
+    {"stats_json", "write render statistics to this JSON file", [](C& c, S& k, S& v) { c.stats_json = v; }},
+    {"regress", "render the built-in scenes and compare with this baseline file", [](C& c, S& k, S& v) { c.regress = v; }},
+    {"reference_dir", "directory of reference images for regress", [](C& c, S& k, S& v) { c.reference_dir = v; }},
+    {"regress_runs", "timed renders per scene for regress", [](C& c, S& k, S& v) { c.regress_runs = parse_int(k, v, 1); }},
+    {"regress_tolerance", "fraction of extra time regress accepts", [](C& c, S& k, S& v) { c.regress_tolerance = parse_float(k, v); }},
+    {"trace", "write a Chrome trace of the render phases and tiles to this file", [](C& c, S& k, S& v) { c.trace = v; }},
+    {"heatmap", "render the cost of each pixel instead: none, nodes, tests or time", [](C& c, S& k, S& v) { c.heatmap = parse_heatmap(k, v); }},
+    {"sampler", "independent, stratified, sobol or bluenoise", [](C& c, S& k, S& v) { c.sampler = parse_sampler(k, v); }},
+    {"seed", "seed of every random sequence", [](C& c, S& k, S& v) { c.seed = parse_uint32(k, v); }},
+    {"mis_heuristic", "balance or power", [](C& c, S& k, S& v) { c.mis_heuristic = parse_heuristic(k, v); }},
+  };
+  return list;
+}
+
+void set_option(RenderConfig& config, const std::string& key, const std::string& value) {
+  std::string name = key;
+  std::replace(name.begin(), name.end(), '-', '_');
+  for(const Option& option : options()) {
+    if(name == option.key) {
+      option.set(config, name, value);
+      return;
+    }
+  }
+  std::cerr << "Unknown option " << key << ", see --help" << std::endl;
+  exit(-1);
+}
+
+static std::string trim(const std::string& s) {
+  size_t begin = s.find_first_not_of(" \t\r");
+  if(begin == std::string::npos) {
+    return "";
+  }
+  return s.substr(begin, s.find_last_not_of(" \t\r") + 1 - begin);
+}
+
+void load_config_file(RenderConfig& config, const std::string& file_name) {
+  std::ifstream file(file_name);
+  if(!file) {
+    std::cerr << "Cannot open config file " << file_name << std::endl;
+    exit(-1);
+  }
+
+  std::string line;
+  for(int line_number = 1; std::getline(file, line); line_number++) {
+    line = trim(line.substr(0, line.find('#')));
+    if(line.empty()) {
+      continue;
+    }
+
+    size_t equals = line.find('=');
+    if(equals == std::string::npos) {
+      std::cerr << file_name << ":" << line_number << ": expected key = value" << std::endl;
+      exit(-1);
+    }
+    set_option(config, trim(line.substr(0, equals)), trim(line.substr(equals + 1)));
+  }
+}
+
+static void print_usage(const char* program) {
+  std::cout << "Usage: " << program << " [--config FILE] [--key value | --key=value]..." << std::endl
+	    << std::endl << "Options:" << std::endl;
+  for(const Option& option : options()) {
+    std::cout << "  --" << std::left << std::setw(22) << option.key << option.help << std::endl;
+  }
+}
+
+void parse_command_line(RenderConfig& config, int argc, char** argv) {
+  for(int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if(arg == "-h" || arg == "--help") {
+      print_usage(argv[0]);
+      exit(0);
+    }
+    if(arg.compare(0, 2, "--") != 0) {
+      std::cerr << "Unexpected argument " << arg << ", see --help" << std::endl;
+      exit(-1);
+    }
+
+    std::string key = arg.substr(2), value;
+    size_t equals = key.find('=');
+    if(equals != std::string::npos) {
+      value = key.substr(equals + 1);
+      key = key.substr(0, equals);
+    } else if(i + 1 < argc) {
+      value = argv[++i];
+    } else {
+      std::cerr << "Missing value for " << arg << std::endl;
+      exit(-1);
+    }
+
+    if(key == "config") {
+      load_config_file(config, value);
+    } else {
+      set_option(config, key, value);
+    }
+  }
+}
@@ -0,0 +1,180 @@
+#ifndef INCLUDE_CONFIG_HPP
+#define INCLUDE_CONFIG_HPP
+
+#include <cstdint>
+#include <string>
+
+#include "sampler.hpp"
+
+enum class MISHeuristic {
+  Balance,
+  Power
+};
+
+// How the image's pixels are stored while they render, see Framebuffer in film.hpp
+enum class PixelFormat {
+  Float,
+  Half,
+  RGB9E5
+};
+
+enum class HeatmapCost {
+  None,
+  Nodes,
+  Tests,
+  Time
+};
+
+// Everything that can be chosen for a render without recompiling. The
+// defaults are the settings the renderer used to be compiled with.
+//
+// Settings are given as key = value lines in a config file, or as --key value
+// (or --key=value) on the command line, where dashes may stand in for
+// underscores. --config FILE reads a file at that point of the command line,
+// so later options override it.
+struct RenderConfig {
+  // 0 uses every CPU the process may run on. With pin_threads, each thread
+  // is bound to its own CPU, and with replicate_scene, every NUMA node gets
+  // its own copy of the scene, built by one of its threads so the memory is
+  // allocated on that node
+  int threads = 0;
+  bool pin_threads = false;
+  bool replicate_scene = true;
+
+  int width = 480, height = 360;
+
+  // The image is rendered in passes. The first gives every pixel
+  // min_samples, later ones add adaptive_batch to each pixel that has not
+  // converged, until it has samples. A pixel has converged when the standard
+  // error of its mean luminance is below adaptive_error relative to the mean
+  // (or to adaptive_min_mean, for dark pixels), and so have all its neighbours
+  int samples = 1;
+  int min_samples = 16, adaptive_batch = 16;
+  float adaptive_error = 0.02f, adaptive_min_mean = 0.05f;
+
+  // A frame can be split into jobs that take disjoint ranges of sample
+  // indices, [sample_start, sample_start + samples) each. With accumulation
+  // set, a job writes its unnormalized sums and sample counts there (as a
+  // checkpoint) instead of the images. merge, a comma-separated list of such
+  // files or checkpoints, renders nothing: the files are combined and the
+  // images written from them, and to accumulation if set
+  int sample_start = 0;
+  std::string accumulation;
+  std::string merge;
+
+  // Paths are ended by Russian roulette once they have made rr_min_depth
+  // bounces, and unconditionally at max_depth
+  int max_depth = 64, rr_min_depth = 3;
+
+  // Pixels are handed out to threads in squares of tile_size
+  int tile_size = 16;
+
+  // With coordinator set to an address (unix:PATH or HOST:PORT), this
+  // process renders nothing itself but hands tiles to worker processes
+  // started with worker set to the same address and the same render
+  // settings, and writes the result. A tile out for more than tile_timeout
+  // seconds is also given to an idle worker (see distributed.hpp)
+  std::string coordinator, worker;
+  int tile_timeout = 30;
+
+  // A scene written in code, or a scene file (see scenefile.hpp)
+  std::string scene = "teapot_scene";
+  // If set, the scene file is compiled to this file instead of rendered
+  std::string compile_scene;
+
+  // Camera settings that are not given come from the scene. A focus
+  // distance of 0 focuses on lookat
+  bool has_lookfrom = false, has_lookat = false, has_vup = false;
+  float lookfrom[3], lookat[3], vup[3];
+  float vfov = -1.0f, aperture = -1.0f, focus_dist = -1.0f;
+
+  // A sequence of frames spans scene time 0 to 1, the time moving objects
+  // are defined over, and frame f is exposed from f / frames for shutter of
+  // a frame interval. first_frame to last_frame (-1 for the last one) are
+  // rendered, and every output file gets the frame number before its
+  // extension. The camera moves linearly to lookfrom_end and lookat_end,
+  // where given, and circles lookat by orbit degrees around vup over the
+  // sequence. The scene is built once and kept for every frame
+  int frames = 1, first_frame = 0, last_frame = -1;
+  float shutter = 1.0f;
+  bool has_lookfrom_end = false, has_lookat_end = false;
+  float lookfrom_end[3], lookat_end[3];
+  float orbit = 0.0f;
+
+  std::string output = "perlin.png";
+  // Samples taken per pixel, as a fraction of samples
+  std::string sample_count_output = "samples.png";
+
+  // With denoise, output is filtered by the feature-guided denoiser and the
+  // unfiltered estimate goes to noisy_output
+  bool denoise = true;
+  std::string noisy_output = "noisy.png";
+
+  // With write_aovs, the linear beauty pass is written to aov_output
+  // together with first-hit albedo, normal, depth and material ID, the
+  // number of samples and the variance of each pixel's mean luminance
+  bool write_aovs = true;
+  std::string aov_output = "render.exr";
+
+  // With stream_output, a frame whose pixels all get their samples in one
+  // pass (min_samples at least samples), without denoise or heatmap, is
+  // written band by band as its tiles finish, while the rest renders
+  bool stream_output = true;
+
+  // The storage of every pixel's running estimate: float, or for very large
+  // images, the means in half floats or in shared-exponent RGB9E5. The
+  // bytes per pixel this takes are printed before rendering
+  PixelFormat framebuffer = PixelFormat::Float;
+
+  // After a pass, if checkpoint_interval seconds have passed since the last
+  // checkpoint, the accumulated samples are saved to checkpoint and the
+  // images are written with the current estimate. SIGINT and SIGTERM do the
+  // same at the next pixel boundary and stop the render. With resume, a
+  // matching checkpoint is continued from; it is removed once the render is done
+  std::string checkpoint = "render.ckpt";
+  int checkpoint_interval = 300;
+  bool resume = true;
+
+  // The per-thread timings, ray counts and (if compiled in, see
+  // counters.hpp) traversal counters printed after a render are also
+  // written to stats_json, if set
+  std::string stats_json;
+
+  // With trace set, spans of scene loading and building, of every tile on
+  // every thread and of writing the output are saved to it as a Chrome
+  // trace (see trace.hpp)
+  std::string trace;
+
+  // With heatmap, the images show what each pixel cost to render instead of
+  // what it sees: BVH nodes visited, primitives tested (both need make
+  // COUNTERS=1) or nanoseconds per sample, over every ray of the path, in
+  // false color up to the 99th percentile. Every pixel gets all samples,
+  // and the AOVs hold the raw cost
+  HeatmapCost heatmap = HeatmapCost::None;
+
+  // With regress set to a baseline file, every scene written in code is
+  // rendered at fixed settings instead, timed as the best of regress_runs,
+  // and its error measured against a reference kept in reference_dir
+  // (rendered there the first time). A scene regresses if it needs more
+  // than regress_tolerance more time than the baseline to reach the
+  // baseline's error. A missing baseline file is written with the results
+  std::string regress;
+  std::string reference_dir = "references";
+  int regress_runs = 3;
+  float regress_tolerance = 0.1f;
+
+  SamplerType sampler = SamplerType::Sobol;
+  uint32_t seed = 0;
+  MISHeuristic mis_heuristic = MISHeuristic::Power;
+};
+
+// Applies one setting, exiting with a message if the key or value is not valid
+void set_option(RenderConfig& config, const std::string& key, const std::string& value);
+
+// Applies every key = value line of a file. Text after # is ignored
+void load_config_file(RenderConfig& config, const std::string& file_name);
+
+// Applies the command line, exiting after printing usage for --help
+void parse_command_line(RenderConfig& config, int argc, char** argv);
+
+#endif // INCLUDE_CONFIG_HPP
@@ -0,0 +1,66 @@
+#ifndef INCLUDE_COUNTERS_HPP
+#define INCLUDE_COUNTERS_HPP
+
+// Per-thread counts of the work behind a render, to tell whether a slow
+// render is slow in traversal, in primitive tests or in the number of rays.
+// Counting is only compiled in with -DRENDER_COUNTERS (make COUNTERS=1);
+// otherwise COUNT() is nothing and the counts stay zero.
+//
+// Rays per bounce and how paths end are always counted, by PathStats.
+
+enum Counter {
+  COUNT_SHADOW_RAYS,
+  // BVHNode and mesh BVH nodes entered
+  COUNT_BVH_NODES,
+  COUNT_BOX_TESTS,
+  COUNT_TRIANGLE_TESTS,
+  // hit() calls per primitive type
+  COUNT_SPHERE_HITS,
+  COUNT_MOVING_SPHERE_HITS,
+  COUNT_XY_RECT_HITS,
+  COUNT_XZ_RECT_HITS,
+  COUNT_YZ_RECT_HITS,
+  COUNT_MESH_HITS,
+  COUNT_MEDIUM_HITS,
+  NUM_COUNTERS
+};
+
+const char* const COUNTER_NAMES[NUM_COUNTERS] = {
+  "shadow_rays", "bvh_nodes", "box_tests", "triangle_tests",
+  "sphere_hits", "moving_sphere_hits", "xy_rect_hits", "xz_rect_hits", "yz_rect_hits",
+  "mesh_hits", "medium_hits"
+};
+
+struct RenderCounters {
+  long counts[NUM_COUNTERS];
+
+  void add(const RenderCounters& other) {
+    for(int i = 0; i < NUM_COUNTERS; i++) {
+      this->counts[i] += other.counts[i];
+    }
+  }
+};
+
+#ifdef RENDER_COUNTERS
+const bool COUNTERS_ENABLED = true;
+
+// Zero-initialized, so access needs no initialization check
+inline thread_local RenderCounters render_counters;
+
+#define COUNT(counter) (render_counters.counts[counter]++)
+#else
+const bool COUNTERS_ENABLED = false;
+
+#define COUNT(counter) ((void)0)
+#endif
+
+// The calling thread's counts, zero when counting is compiled out
+inline RenderCounters thread_counters() {
+#ifdef RENDER_COUNTERS
+  return render_counters;
+#else
+  return RenderCounters();
+#endif
+}
+
+#endif // INCLUDE_COUNTERS_HPP
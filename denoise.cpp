@@ -0,0 +1,171 @@
+#include "denoise.hpp"
+
+#include <cmath>
+#include <algorithm>
+#include <vector>
+
+#include "threadpool.hpp"
+
+static const int ITERATIONS = 5;
+static const float SIGMA_LUMINANCE = 4.0f;
+static const float NORMAL_EXPONENT = 128.0f;
+static const float SIGMA_DEPTH = 1.0f;
+// Keeps black albedo (background, absorbers) from dividing by zero
+static const float ALBEDO_EPSILON = 1e-3f;
+
+// B3 spline, applied separably over a 5x5 footprint
+static const float KERNEL[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+
+static float luminance(const float* c) {
+  return 0.2126f * c[0] + 0.7152f * c[1] + 0.0722f * c[2];
+}
+
+struct DenoiseLevel {
+  int width, height;
+  int step;
+
+  const float* normal;
+  const float* depth;
+  const float* depth_gradient;
+
+  const float* in;
+  const float* in_variance;
+  float* out;
+  float* out_variance;
+};
+
+// 3x3 Gaussian of the variance around p. A pixel whose few samples happened
+// to agree would otherwise reject all its neighbours
+static float blurred_variance(const DenoiseLevel& level, int x, int y) {
+  static const float weights[3] = {0.25f, 0.5f, 0.25f};
+  float sum = 0.0f, sum_weight = 0.0f;
+  for(int dy = -1; dy <= 1; dy++) {
+    for(int dx = -1; dx <= 1; dx++) {
+      int qx = x + dx, qy = y + dy;
+      if(qx >= 0 && qx < level.width && qy >= 0 && qy < level.height) {
+	float weight = weights[dx + 1] * weights[dy + 1];
+	sum += weight * level.in_variance[qy * level.width + qx];
+	sum_weight += weight;
+      }
+    }
+  }
+  return sum / sum_weight;
+}
+
+static void filter_row(const DenoiseLevel& level, int y) {
+  int w = level.width;
+  for(int x = 0; x < w; x++) {
+    int p = y * w + x;
+    const float* np = level.normal + 3 * p;
+    float lp = luminance(level.in + 3 * p);
+    float sigma_l = SIGMA_LUMINANCE * sqrt(std::max(0.0f, blurred_variance(level, x, y))) + 1e-6f;
+    float sigma_z = SIGMA_DEPTH * level.depth_gradient[p] * level.step + 1e-3f * level.depth[p] + 1e-6f;
+    bool has_normal = np[0] != 0.0f || np[1] != 0.0f || np[2] != 0.0f;
+
+    float sum[3] = {0.0f, 0.0f, 0.0f};
+    float sum_weight = 0.0f;
+    float sum_variance = 0.0f;
+
+    for(int dy = -2; dy <= 2; dy++) {
+      int qy = y + dy * level.step;
+      if(qy < 0 || qy >= level.height) {
+	continue;
+      }
+      for(int dx = -2; dx <= 2; dx++) {
+	int qx = x + dx * level.step;
+	if(qx < 0 || qx >= w) {
+	  continue;
+	}
+
+	int q = qy * w + qx;
+	const float* nq = level.normal + 3 * q;
+	const float* cq = level.in + 3 * q;
+
+	float weight = KERNEL[dx + 2] * KERNEL[dy + 2];
+	if(q != p) {
+	  float w_n;
+	  if(has_normal) {
+	    w_n = pow(std::max(0.0f, np[0] * nq[0] + np[1] * nq[1] + np[2] * nq[2]), NORMAL_EXPONENT);
+	  } else {
+	    w_n = (nq[0] == 0.0f && nq[1] == 0.0f && nq[2] == 0.0f) ? 1.0f : 0.0f;
+	  }
+
+	  float dist = sqrt(float(dx * dx + dy * dy));
+	  float w_z = exp(-fabs(level.depth[p] - level.depth[q]) / (sigma_z * dist));
+	  float w_l = exp(-fabs(lp - luminance(cq)) / sigma_l);
+	  weight *= w_n * w_z * w_l;
+	}
+
+	for(int c = 0; c < 3; c++) {
+	  sum[c] += weight * cq[c];
+	}
+	sum_weight += weight;
+	sum_variance += weight * weight * level.in_variance[q];
+      }
+    }
+
+    for(int c = 0; c < 3; c++) {
+      level.out[3 * p + c] = sum[c] / sum_weight;
+    }
+    level.out_variance[p] = sum_variance / (sum_weight * sum_weight);
+  }
+}
+
+void denoise(const float* color, const float* albedo, const float* normal,
+	     const float* depth, const float* variance, float* out,
+	     int width, int height) {
+  int num_pixels = width * height;
+
+  // Lighting with the albedo divided out, and the variance scaled to match
+  std::vector<float> illumination(3 * num_pixels), illumination_variance(num_pixels);
+  std::vector<float> unit_normal(3 * num_pixels), depth_gradient(num_pixels);
+  for(int i = 0; i < num_pixels; i++) {
+    for(int c = 0; c < 3; c++) {
+      illumination[3 * i + c] = color[3 * i + c] / (albedo[3 * i + c] + ALBEDO_EPSILON);
+    }
+    float a = luminance(albedo + 3 * i) + ALBEDO_EPSILON;
+    illumination_variance[i] = variance[i] / (a * a);
+
+    const float* n = normal + 3 * i;
+    float length = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+    for(int c = 0; c < 3; c++) {
+      unit_normal[3 * i + c] = length > 0 ? n[c] / length : 0.0f;
+    }
+  }
+
+  // How fast depth changes per pixel, so slanted surfaces are not taken for edges
+  for(int y = 0; y < height; y++) {
+    for(int x = 0; x < width; x++) {
+      int i = y * width + x;
+      float gx = fabs(depth[y * width + std::min(x + 1, width - 1)] - depth[y * width + std::max(x - 1, 0)]);
+      float gy = fabs(depth[std::min(y + 1, height - 1) * width + x] - depth[std::max(y - 1, 0) * width + x]);
+      depth_gradient[i] = 0.5f * std::max(gx, gy);
+    }
+  }
+
+  std::vector<float> buffers[2] = {illumination, std::vector<float>(3 * num_pixels)};
+  std::vector<float> variances[2] = {illumination_variance, std::vector<float>(num_pixels)};
+
+  for(int it = 0; it < ITERATIONS; it++) {
+    DenoiseLevel level;
+    level.width = width;
+    level.height = height;
+    level.step = 1 << it;
+    level.normal = unit_normal.data();
+    level.depth = depth;
+    level.depth_gradient = depth_gradient.data();
+    level.in = buffers[it % 2].data();
+    level.in_variance = variances[it % 2].data();
+    level.out = buffers[(it + 1) % 2].data();
+    level.out_variance = variances[(it + 1) % 2].data();
+
+    thread_pool().parallel_for(height, [&](int y, int) {
+	filter_row(level, y);
+      });
+  }
+
+  const std::vector<float>& filtered = buffers[ITERATIONS % 2];
+  for(int i = 0; i < 3 * num_pixels; i++) {
+    out[i] = filtered[i] * (albedo[i] + ALBEDO_EPSILON);
+  }
+}
@@ -0,0 +1,17 @@
+#ifndef INCLUDE_DENOISE_HPP
+#define INCLUDE_DENOISE_HPP
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al., "Edge-Avoiding
+// A-Trous Wavelet Transform for fast Global Illumination Filtering", 2010),
+// with the variance-guided luminance weight from SVGF (Schied et al., 2017).
+//
+// color, albedo and normal hold width * height RGB / XYZ triples, depth and
+// variance one float per pixel. variance is that of each pixel's mean
+// luminance. Lighting is filtered with the albedo divided out, so texture
+// detail is kept. The filtered color is written to out, which may be color.
+// Rows are filtered on the shared thread pool
+void denoise(const float* color, const float* albedo, const float* normal,
+	     const float* depth, const float* variance, float* out,
+	     int width, int height);
+
+#endif // INCLUDE_DENOISE_HPP
@@ -0,0 +1,512 @@
+#include "distributed.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+enum MessageType : uint32_t {
+  // Worker to coordinator, index is the fingerprint of its settings
+  MESSAGE_HELLO,
+  // Coordinator to worker, followed by the tile's pixels
+  MESSAGE_TILE,
+  // Worker to coordinator, followed by the rendered pixels
+  MESSAGE_RESULT,
+  MESSAGE_DONE,
+  MESSAGE_REJECT
+};
+
+struct MessageHeader {
+  uint32_t type;
+  uint32_t pass;
+  uint32_t index;
+  int32_t x0, y0, x1, y1;
+  // Bytes of data following the header
+  uint32_t size;
+};
+
+// Larger messages are taken to be garbage
+const uint32_t MAX_MESSAGE_SIZE = 1u << 28;
+
+static MessageHeader make_header(uint32_t type, uint32_t pass, uint32_t index, const Tile& tile, uint32_t size) {
+  MessageHeader header;
+  header.type = type;
+  header.pass = pass;
+  header.index = index;
+  header.x0 = tile.x0;
+  header.y0 = tile.y0;
+  header.x1 = tile.x1;
+  header.y1 = tile.y1;
+  header.size = size;
+  return header;
+}
+
+static bool send_all(int fd, const char* data, size_t size) {
+  while(size > 0) {
+    ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+    if(sent < 0 && errno == EINTR) {
+      continue;
+    }
+    if(sent <= 0) {
+      return false;
+    }
+    data += sent;
+    size -= sent;
+  }
+  return true;
+}
+
+static bool send_message(int fd, const MessageHeader& header, const std::vector<char>& data) {
+  return send_all(fd, (const char*)&header, sizeof(header)) &&
+    (data.empty() || send_all(fd, data.data(), data.size()));
+}
+
+static bool recv_all(int fd, char* data, size_t size) {
+  while(size > 0) {
+    ssize_t received = recv(fd, data, size, 0);
+    if(received < 0 && errno == EINTR) {
+      continue;
+    }
+    if(received <= 0) {
+      return false;
+    }
+    data += received;
+    size -= received;
+  }
+  return true;
+}
+
+// Splits unix:PATH or HOST:PORT
+static bool is_unix_address(const std::string& address, std::string& path) {
+  if(address.compare(0, 5, "unix:") == 0) {
+    path = address.substr(5);
+    return true;
+  }
+  return false;
+}
+
+static void split_host_port(const std::string& address, std::string& host, std::string& port) {
+  size_t colon = address.rfind(':');
+  if(colon == std::string::npos || colon + 1 == address.size()) {
+    std::cerr << "Invalid address " << address << ", expected unix:PATH or HOST:PORT" << std::endl;
+    exit(-1);
+  }
+  host = address.substr(0, colon);
+  port = address.substr(colon + 1);
+}
+
+static sockaddr_un unix_socket_address(const std::string& path) {
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(path.empty() || path.size() >= sizeof(addr.sun_path)) {
+    std::cerr << "Invalid socket path " << path << std::endl;
+    exit(-1);
+  }
+  strcpy(addr.sun_path, path.c_str());
+  return addr;
+}
+
+static addrinfo* resolve(const std::string& address, bool passive) {
+  std::string host, port;
+  split_host_port(address, host, port);
+
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = passive ? AI_PASSIVE : 0;
+
+  addrinfo* result;
+  int error = getaddrinfo(host.empty() || host == "*" ? NULL : host.c_str(), port.c_str(), &hints, &result);
+  if(error) {
+    std::cerr << "Cannot resolve " << address << ": " << gai_strerror(error) << std::endl;
+    exit(-1);
+  }
+  return result;
+}
+
+// Tiles are small messages answered by small messages, don't let them wait for more
+static void set_no_delay(int fd) {
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+Coordinator::Coordinator(const std::string& address, uint32_t fingerprint, double tile_timeout) {
+  this->fingerprint = fingerprint;
+  this->tile_timeout = tile_timeout;
+  this->total_connections = 0;
+  this->reissued = 0;
+  this->pass = 0;
+  this->remaining = 0;
+  this->fill = nullptr;
+  this->store = nullptr;
+
+  std::string path;
+  if(is_unix_address(address, path)) {
+    sockaddr_un addr = unix_socket_address(path);
+    this->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    // Left behind by an earlier run
+    unlink(path.c_str());
+    if(this->listen_fd < 0 || bind(this->listen_fd, (sockaddr*)&addr, sizeof(addr))) {
+      std::cerr << "Cannot listen on " << address << ": " << strerror(errno) << std::endl;
+      exit(-1);
+    }
+    this->unix_path = path;
+  } else {
+    addrinfo* addresses = resolve(address, true);
+    this->listen_fd = -1;
+    for(addrinfo* a = addresses; a && this->listen_fd < 0; a = a->ai_next) {
+      this->listen_fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+      if(this->listen_fd < 0) {
+	continue;
+      }
+      int one = 1;
+      setsockopt(this->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+      if(bind(this->listen_fd, a->ai_addr, a->ai_addrlen)) {
+	close(this->listen_fd);
+	this->listen_fd = -1;
+      }
+    }
+    freeaddrinfo(addresses);
+    if(this->listen_fd < 0) {
+      std::cerr << "Cannot listen on " << address << ": " << strerror(errno) << std::endl;
+      exit(-1);
+    }
+  }
+
+  if(listen(this->listen_fd, 64)) {
+    std::cerr << "Cannot listen on " << address << ": " << strerror(errno) << std::endl;
+    exit(-1);
+  }
+  std::cout << "Waiting for workers on " << address << std::endl;
+}
+
+Coordinator::~Coordinator() {
+  for(Connection& c : this->connections) {
+    close(c.fd);
+  }
+  close(this->listen_fd);
+  if(!this->unix_path.empty()) {
+    unlink(this->unix_path.c_str());
+  }
+}
+
+bool Coordinator::run_pass(const std::vector<Tile>& tiles,
+			   const std::function<void(const Tile& tile, std::vector<char>& data)>& fill,
+			   const std::function<void(const Tile& tile, const std::vector<char>& data)>& store,
+			   const std::atomic_bool& stop) {
+  // Results still out from the last pass carry its number, and are dropped
+  this->pass++;
+  this->tiles.resize(tiles.size());
+  this->queue.clear();
+  for(unsigned int i = 0; i < tiles.size(); i++) {
+    this->tiles[i].tile = tiles[i];
+    this->tiles[i].done = false;
+    this->queue.push_back(i);
+  }
+  this->remaining = tiles.size();
+  this->fill = &fill;
+  this->store = &store;
+  for(Connection& c : this->connections) {
+    c.tile = -1;
+  }
+
+  std::vector<pollfd> fds;
+  while(this->remaining > 0) {
+    if(stop) {
+      return false;
+    }
+
+    this->serve_waiting();
+
+    fds.resize(this->connections.size() + 1);
+    fds[0].fd = this->listen_fd;
+    fds[0].events = POLLIN;
+    for(unsigned int i = 0; i < this->connections.size(); i++) {
+      fds[i + 1].fd = this->connections[i].fd;
+      fds[i + 1].events = POLLIN;
+    }
+    // Wakes up now and then to look at stop and timed out tiles
+    if(poll(fds.data(), fds.size(), 200) <= 0) {
+      continue;
+    }
+
+    for(unsigned int i = 0; i < this->connections.size(); i++) {
+      if(fds[i + 1].revents && !this->read_messages(this->connections[i])) {
+	this->close_connection(this->connections[i]);
+      }
+    }
+    this->connections.erase(std::remove_if(this->connections.begin(), this->connections.end(),
+					   [](const Connection& c) { return c.fd < 0; }),
+			    this->connections.end());
+
+    if(fds[0].revents) {
+      this->accept_connections();
+    }
+  }
+  return true;
+}
+
+void Coordinator::finish() {
+  std::vector<char> none;
+  for(Connection& c : this->connections) {
+    if(c.accepted) {
+      send_message(c.fd, make_header(MESSAGE_DONE, this->pass, 0, Tile(), 0), none);
+    }
+    close(c.fd);
+  }
+  this->connections.clear();
+}
+
+void Coordinator::accept_connections() {
+  int fd = accept(this->listen_fd, NULL, NULL);
+  if(fd < 0) {
+    return;
+  }
+  set_no_delay(fd);
+
+  Connection c;
+  c.fd = fd;
+  c.accepted = false;
+  c.waiting = false;
+  c.tile = -1;
+  this->connections.push_back(c);
+}
+
+bool Coordinator::read_messages(Connection& c) {
+  char buffer[65536];
+  while(true) {
+    ssize_t received = recv(c.fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if(received > 0) {
+      c.in.insert(c.in.end(), buffer, buffer + received);
+    } else if(received < 0 && errno == EINTR) {
+      continue;
+    } else if(received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    } else {
+      return false;
+    }
+  }
+
+  size_t used = 0;
+  while(c.in.size() - used >= sizeof(MessageHeader)) {
+    MessageHeader header;
+    memcpy(&header, c.in.data() + used, sizeof(header));
+    if(header.size > MAX_MESSAGE_SIZE) {
+      return false;
+    }
+    if(c.in.size() - used < sizeof(header) + header.size) {
+      break;
+    }
+    if(!this->handle_message(c, c.in.data() + used)) {
+      return false;
+    }
+    used += sizeof(header) + header.size;
+  }
+  c.in.erase(c.in.begin(), c.in.begin() + used);
+  return true;
+}
+
+bool Coordinator::handle_message(Connection& c, const char* message) {
+  MessageHeader header;
+  memcpy(&header, message, sizeof(header));
+
+  if(header.type == MESSAGE_HELLO) {
+    if(header.index != this->fingerprint) {
+      std::cerr << "Turned away a worker with other render settings" << std::endl;
+      send_message(c.fd, make_header(MESSAGE_REJECT, 0, 0, Tile(), 0), std::vector<char>());
+      return false;
+    }
+    c.accepted = true;
+    c.waiting = true;
+    this->total_connections++;
+    return true;
+  }
+
+  if(header.type != MESSAGE_RESULT || !c.accepted) {
+    return false;
+  }
+
+  // A tile given to two workers is taken from whichever is first
+  if(header.pass == this->pass && header.index < this->tiles.size() && !this->tiles[header.index].done) {
+    TileState& state = this->tiles[header.index];
+    std::vector<char> data(message + sizeof(header), message + sizeof(header) + header.size);
+    (*this->store)(state.tile, data);
+    state.done = true;
+    this->remaining--;
+  }
+  if(int(header.index) == c.tile) {
+    c.tile = -1;
+  }
+  c.waiting = true;
+  return true;
+}
+
+void Coordinator::close_connection(Connection& c) {
+  close(c.fd);
+  c.fd = -1;
+
+  if(c.tile < 0 || this->tiles[c.tile].done) {
+    return;
+  }
+  for(const Connection& other : this->connections) {
+    if(other.fd >= 0 && other.tile == c.tile) {
+      return;
+    }
+  }
+  // Next in line, it may be all that is holding up the pass
+  this->queue.push_front(c.tile);
+}
+
+void Coordinator::serve_waiting() {
+  std::vector<char> data;
+  for(Connection& c : this->connections) {
+    if(!c.accepted || !c.waiting) {
+      continue;
+    }
+    int index = this->pick_tile();
+    if(index < 0) {
+      return;
+    }
+
+    TileState& state = this->tiles[index];
+    (*this->fill)(state.tile, data);
+    state.issued = std::chrono::steady_clock::now();
+    c.waiting = false;
+    c.tile = index;
+    if(!send_message(c.fd, make_header(MESSAGE_TILE, this->pass, index, state.tile, data.size()), data)) {
+      this->close_connection(c);
+    }
+  }
+  this->connections.erase(std::remove_if(this->connections.begin(), this->connections.end(),
+					 [](const Connection& c) { return c.fd < 0; }),
+			  this->connections.end());
+}
+
+int Coordinator::pick_tile() {
+  while(!this->queue.empty()) {
+    int index = this->queue.front();
+    this->queue.pop_front();
+    if(!this->tiles[index].done) {
+      return index;
+    }
+  }
+
+  // Nothing new to hand out, so help with the tile that has been out the longest
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  int oldest = -1;
+  for(unsigned int i = 0; i < this->tiles.size(); i++) {
+    if(!this->tiles[i].done && (oldest < 0 || this->tiles[i].issued < this->tiles[oldest].issued)) {
+      oldest = i;
+    }
+  }
+  if(oldest < 0 ||
+     std::chrono::duration<double>(now - this->tiles[oldest].issued).count() < this->tile_timeout) {
+    return -1;
+  }
+  this->reissued++;
+  return oldest;
+}
+
+WorkerConnection::WorkerConnection(const std::string& address, uint32_t fingerprint) {
+  this->fd = -1;
+  this->pass = this->index = 0;
+  this->has_result = false;
+
+  std::string path;
+  bool is_unix = is_unix_address(address, path);
+  // The coordinator may still be starting up
+  for(int attempt = 0; attempt < 30 && this->fd < 0; attempt++) {
+    if(attempt > 0) {
+      sleep(1);
+    }
+
+    if(is_unix) {
+      sockaddr_un addr = unix_socket_address(path);
+      this->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if(this->fd >= 0 && connect(this->fd, (sockaddr*)&addr, sizeof(addr))) {
+	close(this->fd);
+	this->fd = -1;
+      }
+    } else {
+      addrinfo* addresses = resolve(address, false);
+      for(addrinfo* a = addresses; a && this->fd < 0; a = a->ai_next) {
+	this->fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+	if(this->fd >= 0 && connect(this->fd, a->ai_addr, a->ai_addrlen)) {
+	  close(this->fd);
+	  this->fd = -1;
+	}
+      }
+      freeaddrinfo(addresses);
+      if(this->fd >= 0) {
+	set_no_delay(this->fd);
+      }
+    }
+  }
+
+  if(this->fd < 0) {
+    std::cerr << "Cannot connect to coordinator at " << address << ": " << strerror(errno) << std::endl;
+    exit(-1);
+  }
+
+  if(!send_message(this->fd, make_header(MESSAGE_HELLO, 0, fingerprint, Tile(), 0), std::vector<char>())) {
+    std::cerr << "Lost the connection to the coordinator at " << address << std::endl;
+    exit(-1);
+  }
+}
+
+WorkerConnection::~WorkerConnection() {
+  close(this->fd);
+}
+
+bool WorkerConnection::next_tile(Tile& tile, std::vector<char>& data) {
+  if(this->has_result) {
+    this->has_result = false;
+    // A coordinator that is done may already have hung up
+    if(!send_message(this->fd, make_header(MESSAGE_RESULT, this->pass, this->index, this->tile, this->result.size()),
+		     this->result)) {
+      return false;
+    }
+  }
+
+  MessageHeader header;
+  if(!recv_all(this->fd, (char*)&header, sizeof(header)) || header.type == MESSAGE_DONE) {
+    return false;
+  }
+  if(header.type == MESSAGE_REJECT) {
+    std::cerr << "The coordinator renders with other settings, give the worker the same ones" << std::endl;
+    exit(-1);
+  }
+  if(header.type != MESSAGE_TILE || header.size > MAX_MESSAGE_SIZE) {
+    std::cerr << "Unexpected message from the coordinator" << std::endl;
+    exit(-1);
+  }
+
+  data.resize(header.size);
+  if(!recv_all(this->fd, data.data(), data.size())) {
+    return false;
+  }
+  this->pass = header.pass;
+  this->index = header.index;
+  this->tile.x0 = header.x0;
+  this->tile.y0 = header.y0;
+  this->tile.x1 = header.x1;
+  this->tile.y1 = header.y1;
+  tile = this->tile;
+  return true;
+}
+
+void WorkerConnection::set_result(const std::vector<char>& data) {
+  this->result = data;
+  this->has_result = true;
+}
@@ -0,0 +1,117 @@
+#ifndef INCLUDE_DISTRIBUTED_HPP
+#define INCLUDE_DISTRIBUTED_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "scheduler.hpp"
+
+// Rendering split over processes. A coordinator listens on an address and
+// hands out tiles; each render thread of a worker process connects on its
+// own and asks for one tile at a time. A tile is sent together with the
+// current state of its pixels, which the worker adds samples to and sends
+// back, so any worker can take any tile in any pass.
+//
+// Addresses are unix:PATH for a Unix socket, or HOST:PORT for TCP (the
+// coordinator may use * as host to listen on every interface). Pixel data
+// is sent as it is laid out in memory, so all machines must agree on that.
+//
+// A tile whose worker disconnects goes back in the queue. When the queue
+// is empty, idle workers are also given the tile that has been out the
+// longest, once that is over tile_timeout seconds; whichever copy comes
+// back first is used.
+
+class Coordinator {
+public:
+  // fingerprint identifies the render settings, workers with others are turned away
+  Coordinator(const std::string& address, uint32_t fingerprint, double tile_timeout);
+  ~Coordinator();
+
+  // Hands out tiles until a result has come back for each of them. fill()
+  // gives the data to send with a tile, and store() takes a result. Returns
+  // false if stop was set first
+  bool run_pass(const std::vector<Tile>& tiles,
+		const std::function<void(const Tile& tile, std::vector<char>& data)>& fill,
+		const std::function<void(const Tile& tile, const std::vector<char>& data)>& store,
+		const std::atomic_bool& stop);
+
+  // Tells every connected worker that the render is done
+  void finish();
+
+  int num_connections() const {
+    return this->total_connections;
+  }
+
+  int num_reissued() const {
+    return this->reissued;
+  }
+
+private:
+  struct Connection {
+    int fd;
+    std::vector<char> in;
+    bool accepted;
+    bool waiting;
+    // Tile of the current pass this worker has, -1 if none
+    int tile;
+  };
+
+  struct TileState {
+    Tile tile;
+    bool done;
+    std::chrono::steady_clock::time_point issued;
+  };
+
+  void accept_connections();
+  // Both return false if the connection is to be closed
+  bool read_messages(Connection& c);
+  bool handle_message(Connection& c, const char* message);
+  // Puts back the connection's tile, if no one else has it
+  void close_connection(Connection& c);
+  void serve_waiting();
+  int pick_tile();
+
+  int listen_fd;
+  std::string unix_path;
+  uint32_t fingerprint;
+  double tile_timeout;
+
+  std::vector<Connection> connections;
+  int total_connections;
+  int reissued;
+
+  // State of the pass being run
+  uint32_t pass;
+  std::vector<TileState> tiles;
+  std::deque<int> queue;
+  int remaining;
+  const std::function<void(const Tile&, std::vector<char>&)>* fill;
+  const std::function<void(const Tile&, const std::vector<char>&)>* store;
+};
+
+// One worker thread's link to the coordinator
+class WorkerConnection {
+public:
+  // Retries for a while if the coordinator is not up yet, then exits
+  WorkerConnection(const std::string& address, uint32_t fingerprint);
+  ~WorkerConnection();
+
+  // Asks for a tile (sending the result of the previous one, if any).
+  // Returns false when the render is done
+  bool next_tile(Tile& tile, std::vector<char>& data);
+  void set_result(const std::vector<char>& data);
+
+private:
+  int fd;
+  uint32_t pass, index;
+  Tile tile;
+  std::vector<char> result;
+  bool has_result;
+};
+
+#endif // INCLUDE_DISTRIBUTED_HPP
@@ -0,0 +1,524 @@
+#ifndef INCLUDE_FILM_HPP
+#define INCLUDE_FILM_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "ray.hpp"
+#include "config.hpp"
+
+float luminance(const vec3& c) {
+  return 0.2126f * c[0] + 0.7152f * c[1] + 0.0722f * c[2];
+}
+
+// Surface properties seen by a camera sample, guiding the denoiser
+struct SampleFeatures {
+  vec3 albedo;
+  vec3 normal;
+  float depth;
+  int material_id;
+};
+
+// Running sum of a pixel's samples, with the mean and sum of squared
+// deviations of their luminance (Welford's algorithm), and the summed
+// features of the samples. IDs cannot be averaged, the pixel keeps the one
+// its first sample saw
+struct PixelEstimate {
+  vec3 sum;
+  int samples;
+  float mean;
+  float m2;
+  bool active;
+
+  vec3 albedo;
+  vec3 normal;
+  float depth;
+  int material_id;
+};
+
+void clear_pixels(PixelEstimate *pixels, int num_pixels) {
+  for(int i = 0; i < num_pixels; i++) {
+    pixels[i].sum = vec3(0.0f, 0.0f, 0.0f);
+    pixels[i].samples = 0;
+    pixels[i].mean = pixels[i].m2 = 0.0f;
+    pixels[i].active = true;
+    pixels[i].albedo = pixels[i].normal = vec3(0.0f, 0.0f, 0.0f);
+    pixels[i].depth = 0.0f;
+    pixels[i].material_id = 0;
+  }
+}
+
+void add_sample(PixelEstimate& px, const vec3& sample, const SampleFeatures& features) {
+  if(px.samples == 0) {
+    px.material_id = features.material_id;
+  }
+
+  px.sum += sample;
+  px.samples++;
+
+  px.albedo += features.albedo;
+  px.normal += features.normal;
+  px.depth += features.depth;
+
+  float lum = luminance(sample);
+  float delta = lum - px.mean;
+  px.mean += delta / px.samples;
+  px.m2 += delta * (lum - px.mean);
+}
+
+// Merges the samples of from into into (Chan et al.'s pairwise update of the
+// luminance statistics). The material ID of into is kept if it has samples
+void merge_pixel(PixelEstimate& into, const PixelEstimate& from) {
+  if(from.samples == 0) {
+    return;
+  }
+  if(into.samples == 0) {
+    into.material_id = from.material_id;
+  }
+
+  int samples = into.samples + from.samples;
+  float delta = from.mean - into.mean;
+  into.mean += delta * from.samples / samples;
+  into.m2 += from.m2 + delta * delta * (float(into.samples) * from.samples / samples);
+  into.samples = samples;
+
+  into.sum += from.sum;
+  into.albedo += from.albedo;
+  into.normal += from.normal;
+  into.depth += from.depth;
+}
+
+// IEEE half floats, rounded to nearest even. Finite values beyond the range
+// are clamped to the largest half, so an estimate never turns infinite
+uint16_t float_to_half(float f) {
+  uint32_t x;
+  memcpy(&x, &f, sizeof(x));
+  uint16_t sign = (x >> 16) & 0x8000;
+  int exponent = int((x >> 23) & 0xff) - 127 + 15;
+  uint32_t mantissa = x & 0x7fffff;
+
+  if(((x >> 23) & 0xff) == 0xff) {
+    return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+  }
+  if(exponent <= 0) {
+    // Subnormal, or too small for anything but zero
+    if(exponent < -10) {
+      return sign;
+    }
+    mantissa |= 0x800000;
+    int shift = 14 - exponent;
+    uint32_t h = mantissa >> shift;
+    uint32_t rest = mantissa & ((1u << shift) - 1), half_way = 1u << (shift - 1);
+    if(rest > half_way || (rest == half_way && (h & 1))) {
+      h++;
+    }
+    return sign | h;
+  }
+
+  uint32_t h = (exponent << 10) | (mantissa >> 13);
+  uint32_t rest = mantissa & 0x1fff;
+  if(rest > 0x1000 || (rest == 0x1000 && (h & 1))) {
+    // A carry out of the mantissa correctly moves on to the next exponent
+    h++;
+  }
+  return sign | std::min(h, 0x7bffu);
+}
+
+float half_to_float(uint16_t h) {
+  uint32_t sign = uint32_t(h & 0x8000) << 16;
+  int exponent = (h >> 10) & 0x1f;
+  uint32_t mantissa = h & 0x3ff;
+  uint32_t x;
+  if(exponent == 0x1f) {
+    x = sign | 0x7f800000 | (mantissa << 13);
+  } else if(exponent != 0) {
+    x = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+  } else if(mantissa == 0) {
+    x = sign;
+  } else {
+    // Subnormal, normalized for the wider exponent
+    exponent = 1;
+    while(!(mantissa & 0x400)) {
+      mantissa <<= 1;
+      exponent--;
+    }
+    x = sign | ((exponent - 15 + 127) << 23) | ((mantissa & 0x3ff) << 13);
+  }
+  float f;
+  memcpy(&f, &x, sizeof(f));
+  return f;
+}
+
+// Three non-negative values sharing one exponent, with 9 bit mantissas (the
+// RGB9E5 format of OpenGL), up to 65408. Larger values are clamped, and
+// negative values and NaN are stored as 0
+const int RGB9E5_BIAS = 15, RGB9E5_MANTISSA_BITS = 9;
+const float RGB9E5_MAX = 65408.0f;
+
+uint32_t float3_to_rgb9e5(const float *v) {
+  float c[3];
+  for(int i = 0; i < 3; i++) {
+    c[i] = v[i] > 0.0f ? std::min(v[i], RGB9E5_MAX) : 0.0f;
+  }
+  float largest = std::max(c[0], std::max(c[1], c[2]));
+
+  // largest = m * 2^e with m in [0.5, 1), so e - 1 is floor(log2(largest))
+  int e;
+  frexp(largest, &e);
+  int exponent = std::max(-RGB9E5_BIAS, e) + RGB9E5_BIAS;
+  float scale = ldexp(1.0f, RGB9E5_BIAS + RGB9E5_MANTISSA_BITS - exponent);
+  if(int(largest * scale + 0.5f) == 1 << RGB9E5_MANTISSA_BITS) {
+    // Rounded up out of the mantissa
+    exponent++;
+    scale *= 0.5f;
+  }
+
+  uint32_t packed = uint32_t(exponent) << 27;
+  for(int i = 0; i < 3; i++) {
+    packed |= uint32_t(c[i] * scale + 0.5f) << (RGB9E5_MANTISSA_BITS * i);
+  }
+  return packed;
+}
+
+void rgb9e5_to_float3(uint32_t packed, float *v) {
+  float scale = ldexp(1.0f, int(packed >> 27) - RGB9E5_BIAS - RGB9E5_MANTISSA_BITS);
+  for(int i = 0; i < 3; i++) {
+    v[i] = ((packed >> (RGB9E5_MANTISSA_BITS * i)) & 0x1ff) * scale;
+  }
+}
+
+// The means of a pixel's samples in half floats. The luminance statistics,
+// which decide when the pixel has converged, and the counts stay exact
+struct HalfPixel {
+  uint16_t color[3], albedo[3], normal[3], depth;
+  float mean, m2;
+  int32_t samples, material_id;
+};
+
+// Color and albedo in RGB9E5, the signed normal and the depth in half floats
+struct RGB9E5Pixel {
+  uint32_t color, albedo;
+  uint16_t normal[3], depth;
+  float mean, m2;
+  int32_t samples, material_id;
+};
+
+// The pixels of the image, stored as PixelEstimates or in a compact format.
+// Tiles are rendered into PixelEstimates of their own and stored back when
+// done, so compact formats round a pixel's means once per tile and pass,
+// never single samples. They keep the active flags in a byte per pixel,
+// so threads storing different pixels never write to the same byte
+class Framebuffer {
+public:
+  Framebuffer(int num_pixels, PixelFormat format) : num_pixels(num_pixels), pixel_format(format) {
+    if(format == PixelFormat::Float) {
+      this->full.resize(num_pixels);
+    } else if(format == PixelFormat::Half) {
+      this->half.resize(num_pixels);
+    } else {
+      this->shared.resize(num_pixels);
+    }
+    if(format != PixelFormat::Float) {
+      this->active.resize(num_pixels);
+    }
+    this->clear();
+  }
+
+  int size() const {
+    return this->num_pixels;
+  }
+
+  // Bytes of storage for each pixel, its active flag included
+  double bytes_per_pixel() const {
+    if(this->pixel_format == PixelFormat::Float) {
+      return sizeof(PixelEstimate);
+    }
+    return (this->pixel_format == PixelFormat::Half ? sizeof(HalfPixel) : sizeof(RGB9E5Pixel)) + sizeof(uint8_t);
+  }
+
+  // Leaves every pixel without samples, and active
+  void clear() {
+    PixelEstimate empty;
+    clear_pixels(&empty, 1);
+    for(int i = 0; i < this->num_pixels; i++) {
+      this->set(i, empty);
+    }
+  }
+
+  void get(int i, PixelEstimate& px) const {
+    if(this->pixel_format == PixelFormat::Float) {
+      px = this->full[i];
+      return;
+    }
+
+    float color[3], albedo[3], normal[3], depth;
+    int samples;
+    if(this->pixel_format == PixelFormat::Half) {
+      const HalfPixel& p = this->half[i];
+      for(int c = 0; c < 3; c++) {
+	color[c] = half_to_float(p.color[c]);
+	albedo[c] = half_to_float(p.albedo[c]);
+	normal[c] = half_to_float(p.normal[c]);
+      }
+      depth = half_to_float(p.depth);
+      samples = p.samples;
+      px.mean = p.mean;
+      px.m2 = p.m2;
+      px.material_id = p.material_id;
+    } else {
+      const RGB9E5Pixel& p = this->shared[i];
+      rgb9e5_to_float3(p.color, color);
+      rgb9e5_to_float3(p.albedo, albedo);
+      for(int c = 0; c < 3; c++) {
+	normal[c] = half_to_float(p.normal[c]);
+      }
+      depth = half_to_float(p.depth);
+      samples = p.samples;
+      px.mean = p.mean;
+      px.m2 = p.m2;
+      px.material_id = p.material_id;
+    }
+
+    px.samples = samples;
+    px.sum = vec3(color[0], color[1], color[2]) * float(samples);
+    px.albedo = vec3(albedo[0], albedo[1], albedo[2]) * float(samples);
+    px.normal = vec3(normal[0], normal[1], normal[2]) * float(samples);
+    px.depth = depth * samples;
+    px.active = this->active[i];
+  }
+
+  void set(int i, const PixelEstimate& px) {
+    if(this->pixel_format == PixelFormat::Float) {
+      this->full[i] = px;
+      return;
+    }
+
+    float inv_samples = px.samples > 0 ? 1.0f / px.samples : 0.0f;
+    float color[3], albedo[3], normal[3];
+    for(int c = 0; c < 3; c++) {
+      color[c] = px.sum[c] * inv_samples;
+      albedo[c] = px.albedo[c] * inv_samples;
+      normal[c] = px.normal[c] * inv_samples;
+    }
+
+    if(this->pixel_format == PixelFormat::Half) {
+      HalfPixel& p = this->half[i];
+      for(int c = 0; c < 3; c++) {
+	p.color[c] = float_to_half(color[c]);
+	p.albedo[c] = float_to_half(albedo[c]);
+	p.normal[c] = float_to_half(normal[c]);
+      }
+      p.depth = float_to_half(px.depth * inv_samples);
+      p.mean = px.mean;
+      p.m2 = px.m2;
+      p.samples = px.samples;
+      p.material_id = px.material_id;
+    } else {
+      RGB9E5Pixel& p = this->shared[i];
+      p.color = float3_to_rgb9e5(color);
+      p.albedo = float3_to_rgb9e5(albedo);
+      for(int c = 0; c < 3; c++) {
+	p.normal[c] = float_to_half(normal[c]);
+      }
+      p.depth = float_to_half(px.depth * inv_samples);
+      p.mean = px.mean;
+      p.m2 = px.m2;
+      p.samples = px.samples;
+      p.material_id = px.material_id;
+    }
+    this->active[i] = px.active;
+  }
+
+  void set_active(int i, bool active) {
+    if(this->pixel_format == PixelFormat::Float) {
+      this->full[i].active = active;
+    } else {
+      this->active[i] = active;
+    }
+  }
+
+private:
+  int num_pixels;
+  PixelFormat pixel_format;
+  std::vector<PixelEstimate> full;
+  std::vector<HalfPixel> half;
+  std::vector<RGB9E5Pixel> shared;
+  std::vector<uint8_t> active;
+};
+
+// Checkpoints hold the linear (HDR) sums and statistics of every pixel, so a
+// render can continue where it stopped. The same files serve as the
+// accumulation buffers of renders split by sample range, which are merged
+// into one image. The header guards against mixing resolutions, random
+// sequences, or scenes and cameras
+const char CHECKPOINT_MAGIC[4] = {'W', 'R', 'C', 'K'};
+const uint32_t CHECKPOINT_VERSION = 6;
+
+struct CheckpointHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t width, height;
+  uint32_t seed;
+  uint32_t sampler_type;
+  // Sample indices [first_sample, first_sample + sample_budget) are the render's to take
+  uint32_t first_sample, sample_budget;
+  // Hash of the scene, camera and path settings, see scene_fingerprint() in main.cpp
+  uint32_t scene;
+  uint32_t passes;
+};
+
+struct CheckpointPixel {
+  float sum[3];
+  int32_t samples;
+  float mean;
+  float m2;
+  float albedo[3];
+  float normal[3];
+  float depth;
+  int32_t material_id;
+  // Whether the pixel still needs samples in the saved pass
+  int32_t active;
+};
+
+CheckpointHeader make_checkpoint_header(int width, int height, uint32_t seed, uint32_t sampler_type,
+					uint32_t first_sample, uint32_t sample_budget, uint32_t scene, int passes) {
+  CheckpointHeader header;
+  memcpy(header.magic, CHECKPOINT_MAGIC, 4);
+  header.version = CHECKPOINT_VERSION;
+  header.width = width;
+  header.height = height;
+  header.seed = seed;
+  header.sampler_type = sampler_type;
+  header.first_sample = first_sample;
+  header.sample_budget = sample_budget;
+  header.scene = scene;
+  header.passes = passes;
+  return header;
+}
+
+// Written to a temporary file that then replaces the old checkpoint, so an
+// interruption while writing leaves the previous one intact
+bool save_checkpoint(const char* name, const Framebuffer& pixels, const CheckpointHeader& header) {
+  std::string tmp_name = std::string(name) + ".tmp";
+  std::ofstream file(tmp_name, std::ios::binary);
+  if(!file) {
+    std::cerr << "Cannot open checkpoint file " << tmp_name << std::endl;
+    return false;
+  }
+
+  file.write((const char*)&header, sizeof(header));
+
+  for(uint32_t i = 0; i < header.width * header.height; i++) {
+    PixelEstimate px;
+    pixels.get(i, px);
+    CheckpointPixel cp;
+    for(int c = 0; c < 3; c++) {
+      cp.sum[c] = px.sum[c];
+      cp.albedo[c] = px.albedo[c];
+      cp.normal[c] = px.normal[c];
+    }
+    cp.depth = px.depth;
+    cp.material_id = px.material_id;
+    cp.samples = px.samples;
+    cp.mean = px.mean;
+    cp.m2 = px.m2;
+    cp.active = px.active;
+    file.write((const char*)&cp, sizeof(cp));
+  }
+
+  file.close();
+  if(!file) {
+    std::cerr << "Could not write checkpoint file " << tmp_name << std::endl;
+    return false;
+  }
+
+  if(rename(tmp_name.c_str(), name)) {
+    std::cerr << "Could not replace checkpoint file " << name << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Opens a checkpoint and reads its header, leaving file at the first pixel.
+// Returns false, with a message, if the file cannot be read, is not a
+// checkpoint or is too short for its resolution
+bool open_checkpoint(const char* name, std::ifstream& file, CheckpointHeader& header) {
+  file.open(name, std::ios::binary);
+  if(!file) {
+    std::cerr << "Cannot open checkpoint file " << name << std::endl;
+    return false;
+  }
+
+  file.read((char*)&header, sizeof(header));
+  if(!file || memcmp(header.magic, CHECKPOINT_MAGIC, 4) || header.version != CHECKPOINT_VERSION) {
+    std::cerr << name << " is not a checkpoint" << std::endl;
+    return false;
+  }
+
+  file.seekg(0, std::ios::end);
+  std::streamoff size = file.tellg();
+  file.seekg(sizeof(header));
+  if(size < std::streamoff(sizeof(header) + sizeof(CheckpointPixel) * header.width * header.height)) {
+    std::cerr << "Checkpoint " << name << " is truncated" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// The next pixel of an opened checkpoint
+PixelEstimate read_checkpoint_pixel(std::ifstream& file) {
+  CheckpointPixel cp;
+  file.read((char*)&cp, sizeof(cp));
+
+  PixelEstimate px;
+  px.sum = vec3(cp.sum[0], cp.sum[1], cp.sum[2]);
+  px.samples = cp.samples;
+  px.mean = cp.mean;
+  px.m2 = cp.m2;
+  px.active = cp.active;
+  px.albedo = vec3(cp.albedo[0], cp.albedo[1], cp.albedo[2]);
+  px.normal = vec3(cp.normal[0], cp.normal[1], cp.normal[2]);
+  px.depth = cp.depth;
+  px.material_id = cp.material_id;
+  return px;
+}
+
+// Returns false, leaving pixels untouched, if there is no checkpoint made
+// with the settings of expected. Pixels are read one at a time, so the
+// checkpoint is never held in memory. Active pixels are those the saved
+// pass had not finished, passes is the pass to go on with
+bool load_checkpoint(const char* name, Framebuffer& pixels, const CheckpointHeader& expected, int& passes) {
+  if(!std::ifstream(name)) {
+    return false;
+  }
+
+  std::ifstream file;
+  CheckpointHeader header;
+  if(!open_checkpoint(name, file, header)) {
+    std::cerr << "Ignoring " << name << std::endl;
+    return false;
+  }
+  // A stratified sampler divides the budget into strata, which another budget would split differently
+  if(header.width != expected.width || header.height != expected.height ||
+     header.seed != expected.seed || header.sampler_type != expected.sampler_type ||
+     header.first_sample != expected.first_sample || header.sample_budget != expected.sample_budget ||
+     header.scene != expected.scene) {
+    std::cerr << "Checkpoint " << name << " was made with other settings, ignoring it" << std::endl;
+    return false;
+  }
+
+  for(int i = 0; i < pixels.size(); i++) {
+    pixels.set(i, read_checkpoint_pixel(file));
+  }
+  passes = header.passes;
+  return true;
+}
+
+#endif // INCLUDE_FILM_HPP
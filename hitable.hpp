@@ -1,12 +1,21 @@
 #ifndef INCLUDE_HITABLE_HPP
 #define INCLUDE_HITABLE_HPP
 
+#include <vector>
+#include <cmath>
+
 #include "ray.hpp"
 
 class Aabb;
 // #include "aabb.hpp"
 
 class Material;
+class Sampler;
+class Hitable;
+
+// Defined in material.hpp, so that primitives compiled on their own
+// (triangles.cpp) can ask without pulling in the material headers
+bool is_emissive(const Material* mat);
 
 struct hit_record {
   float t;
@@ -14,13 +23,60 @@ struct hit_record {
   vec3 p;
   vec3 normal;
   Material *mat_ptr;
+  // The primitive that was hit, so LightList can tell which emitter a ray reached
+  const Hitable *hitable;
 };
 
+// A point sampled on an emitter, as seen from some reference point. u, v and
+// mat_ptr are what a hit_record at that point would hold
+struct light_sample {
+  vec3 p;
+  vec3 normal;
+  float u, v;
+  Material *mat_ptr;
+  float pdf; // Solid angle density at the reference point
+};
 
+// Converts a density over the area of a surface to one over solid angle at origin
+inline float area_to_solid_angle_pdf(float area_pdf, const vec3& origin, const vec3& p, const vec3& normal) {
+  vec3 d = p - origin;
+  float dist2 = d.sqNorm();
+  float cosine = std::abs(falg::dot(d, normal)) / sqrt(dist2);
+  if(cosine < 1e-6f) {
+    return 0.0f;
+  }
+  return area_pdf * dist2 / cosine;
+}
+
+
+// The Sampler passed to hit() belongs to the calling render thread, so
+// stochastic primitives (e.g. participating media) never share generator state
 class Hitable {
 public:
-  virtual bool hit(const Ray& r, float t_min, float t_max, hit_record& rec) const = 0;
+  virtual bool hit(const Ray& r, float t_min, float t_max, hit_record& rec, Sampler& sampler) const = 0;
   virtual bool bounding_box(float t0, float t1, Aabb& box) const = 0;
+
+  // Light sampling for next-event estimation. Containers and transforms pass
+  // collect_emitters() on to their children, and primitives with an emissive
+  // material add themselves
+  virtual void collect_emitters(std::vector<Hitable*>& emitters) { }
+
+  // Samples a point on this emitter as seen from origin
+  virtual bool sample_light(const vec3& origin, float time, Sampler& sampler, light_sample& ls) const {
+    return false;
+  }
+
+  // The density sample_light() has of producing the direction of r, from
+  // r's origin. Zero if r does not reach this emitter before t_max
+  virtual float light_pdf(const Ray& r, float t_max, Sampler& sampler) const {
+    return 0.0f;
+  }
+
+  // The primitive whose hits land on this emitter, as recorded in
+  // hit_record::hitable. Transforms answer for what they wrap
+  virtual const Hitable* emitter_primitive() const {
+    return this;
+  }
 };
 
 #endif // ndef INCLUDE_HITABLE_HPP
@@ -7,18 +7,23 @@ class HitableList : public Hitable {
 public:
   HitableList() {}
   HitableList(Hitable **l, int n) { list = l; list_size = n; }
-  virtual bool hit(const Ray& r, float tmin, float tmax, hit_record& rec) const;
+  virtual bool hit(const Ray& r, float tmin, float tmax, hit_record& rec, Sampler& sampler) const;
   virtual bool bounding_box(float t0, float t1, Aabb& box) const;
+  virtual void collect_emitters(std::vector<Hitable*>& emitters) {
+    for(int i = 0; i < list_size; i++) {
+      list[i]->collect_emitters(emitters);
+    }
+  }
   Hitable **list;
   int list_size;
 };
 
-bool HitableList::hit(const Ray& r, float tmin, float tmax, hit_record& rec) const {
+bool HitableList::hit(const Ray& r, float tmin, float tmax, hit_record& rec, Sampler& sampler) const {
   hit_record temp_rec;
   bool hit_anything = false;
   double closest_so_far = tmax;
   for(int i = 0; i < list_size; i++) {
-    if(list[i]->hit(r, tmin, closest_so_far, temp_rec)) {
+    if(list[i]->hit(r, tmin, closest_so_far, temp_rec, sampler)) {
       hit_anything = true;
       closest_so_far = temp_rec.t;
       rec = temp_rec;
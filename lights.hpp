@@ -0,0 +1,98 @@
+#ifndef INCLUDE_LIGHTS_HPP
+#define INCLUDE_LIGHTS_HPP
+
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+
+#include "hitable.hpp"
+#include "aabb.hpp"
+#include "sampler.hpp"
+
+// Every emissive primitive in a scene, for next-event estimation. Lights are
+// picked uniformly, and the returned pdf includes the selection probability
+class LightList {
+public:
+  LightList(Hitable *world) {
+    world->collect_emitters(emitters);
+
+    // A primitive placed in the scene more than once cannot tell which of
+    // its emitters a hit was on, and is left to the search in pdf()
+    for(unsigned int i = 0; i < emitters.size(); i++) {
+      const Hitable *primitive = emitters[i]->emitter_primitive();
+      index[primitive] = index.count(primitive) ? -1 : int(i);
+    }
+
+    // Emitters whose bounds meet may be hit at the same point as another
+    // one, and are searched too
+    std::vector<Aabb> boxes(emitters.size());
+    std::vector<bool> bounded(emitters.size());
+    for(unsigned int i = 0; i < emitters.size(); i++) {
+      bounded[i] = emitters[i]->bounding_box(0.0f, 1.0f, boxes[i]);
+    }
+    overlapping.assign(emitters.size(), false);
+    for(unsigned int i = 0; i < emitters.size(); i++) {
+      for(unsigned int j = i + 1; j < emitters.size(); j++) {
+	// Emitters without bounds could meet anything
+	bool meet = true;
+	if(bounded[i] && bounded[j]) {
+	  for(int a = 0; a < 3; a++) {
+	    meet = meet && boxes[i].min()[a] <= boxes[j].max()[a] && boxes[j].min()[a] <= boxes[i].max()[a];
+	  }
+	}
+	if(meet) {
+	  overlapping[i] = overlapping[j] = true;
+	}
+      }
+    }
+  }
+
+  bool empty() const {
+    return emitters.empty();
+  }
+
+  bool sample(const vec3& origin, float time, Sampler& sampler, light_sample& ls) const {
+    if(emitters.empty()) {
+      return false;
+    }
+
+    int n = emitters.size();
+    int i = std::min(int(sampler.get_1d() * n), n - 1);
+    if(!emitters[i]->sample_light(origin, time, sampler, ls)) {
+      return false;
+    }
+    ls.pdf /= n;
+    return true;
+  }
+
+  // Density sample() has of producing the point r hit, as rec. Only the
+  // emitter that was hit is asked, unless another could be at the same
+  // point. Then every emitter is, but those further along the ray would be
+  // in shadow and do not count
+  float pdf(const Ray& r, const hit_record& rec, Sampler& sampler) const {
+    if(emitters.empty()) {
+      return 0.0f;
+    }
+
+    auto found = index.find(rec.hitable);
+    if(found != index.end() && found->second >= 0 && !overlapping[found->second]) {
+      return emitters[found->second]->light_pdf(r, rec.t * 1.0001f, sampler) / emitters.size();
+    }
+
+    float t_hit = rec.t;
+    float sum = 0.0f;
+    for(Hitable* e : emitters) {
+      sum += e->light_pdf(r, t_hit * 1.0001f, sampler);
+    }
+    return sum / emitters.size();
+  }
+
+  std::vector<Hitable*> emitters;
+
+private:
+  // Emitter of each primitive, -1 for those in more than one
+  std::unordered_map<const Hitable*, int> index;
+  std::vector<bool> overlapping;
+};
+
+#endif // INCLUDE_LIGHTS_HPP
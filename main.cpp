@@ -1,8 +1,23 @@
+#include <algorithm>
 #include <iostream>
 #include <random>
 #include <atomic>
+#include <iomanip>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
 
-#include <pthread.h>
 #include <OpenImageIO/imageio.h>
 
 #include <FlatAlg.hpp>
@@ -18,7 +33,18 @@
 #include "transforms.hpp"
 #include "volume.hpp"
 #include "triangles.hpp"
+#include "lights.hpp"
+#include "film.hpp"
+#include "denoise.hpp"
+#include "scheduler.hpp"
+#include "threadpool.hpp"
+#include "distributed.hpp"
+#include "config.hpp"
+#include "scenebuilder.hpp"
+#include "sampler.hpp"
 #include "utils.hpp"
+#include "counters.hpp"
+#include "trace.hpp"
 
 // Simple experiment with WIDTH = 400, HEIGHT = 225, NUM_SAMPLES = 100 and DEPTH_LIM = 50 showed
 // 1 thread -> 56.882 s
@@ -30,35 +56,217 @@
 // Same as above, again, but using Bounding Volume Hierarchy (BVH): 2.601 s (33.128 s without, maybe due to motion blur)
 
 
-const int NUM_THREADS = 7;
-const int WIDTH = 480, HEIGHT = 360, NUM_SAMPLES = 1, DEPTH_LIM = 5;
-// const int WIDTH = 1920, HEIGHT = 1080, NUM_SAMPLES = 256, DEPTH_LIM = 10;
+// Set from the command line before anything else runs
+RenderConfig config;
 
-const int MAX_CACHELINE_SIZE = 256;
-const int NUM_ELEMENTS_IN_PADDED_ROW = ((WIDTH * sizeof(int) * 3 + MAX_CACHELINE_SIZE - 1) / MAX_CACHELINE_SIZE) * MAX_CACHELINE_SIZE / sizeof(int);
-
-const char* IMAGE_NAME = "perlin.png";
+// Lobes whose sampled density exceeds this (a diffuse lobe peaks at 1 / pi)
+// count as mirrors when choosing where the denoiser's features come from
+const float FEATURE_GLOSSY_PDF = 10.0f;
 
 vec3 elementwise_mult(const vec3& v1, const vec3& v2) {
   return vec3(v1[0] * v2[0], v1[1] * v2[1], v1[2] * v2[2]);
 }
 
-falg::Vec3 color(const Ray& r, Hitable *world, int depth, unidist& dist) {
-  hit_record rec;
-  if (world->hit(r, 0.001, MAXFLOAT, rec)) {
-    Ray scattered;
-    vec3 attenuation;
+// Weight for a sample drawn with density pdf_a, when it could also have been drawn with pdf_b
+template<MISHeuristic H>
+float mis_weight(float pdf_a, float pdf_b) {
+  if(H == MISHeuristic::Power) {
+    pdf_a *= pdf_a;
+    pdf_b *= pdf_b;
+  }
+  return pdf_a / (pdf_a + pdf_b);
+}
+
+// Light reaching rec.p from one point sampled on the emitters, if the shadow ray gets through
+template<MISHeuristic H>
+vec3 sample_direct(const Ray& r, const hit_record& rec, Hitable *world, const LightList& lights, Sampler& sampler) {
+  light_sample ls;
+  if(!lights.sample(rec.p, r.time(), sampler, ls)) {
+    return vec3(0.0f, 0.0f, 0.0f);
+  }
+
+  vec3 to_light = ls.p - rec.p;
+  float dist = to_light.norm();
+  vec3 wi = to_light / dist;
+  vec3 f = rec.mat_ptr->eval(r, rec, wi);
+  if(f.sqNorm() == 0) {
+    return vec3(0.0f, 0.0f, 0.0f);
+  }
+
+  hit_record shadow_rec;
+  COUNT(COUNT_SHADOW_RAYS);
+  if(world->hit(Ray(rec.p, wi, r.time()), 0.001, dist * 0.999f, shadow_rec, sampler)) {
+    return vec3(0.0f, 0.0f, 0.0f);
+  }
+
+  float weight = mis_weight<H>(ls.pdf, rec.mat_ptr->pdf(r, rec, wi));
+  return (weight / ls.pdf) * elementwise_mult(f, ls.mat_ptr->emitted(ls.u, ls.v, ls.p));
+}
+
+// How far camera paths got, and why they ended, summed over a thread's pixels
+struct PathStats {
+  PathStats(int max_depth) : reached(max_depth + 1), escaped(max_depth + 1),
+			     absorbed(max_depth + 1), roulette(max_depth + 1), capped(0) { }
+
+  void add(const PathStats& other) {
+    for(unsigned int i = 0; i < reached.size(); i++) {
+      reached[i] += other.reached[i];
+      escaped[i] += other.escaped[i];
+      absorbed[i] += other.absorbed[i];
+      roulette[i] += other.roulette[i];
+    }
+    capped += other.capped;
+  }
+
+  void print(std::ostream& out) const;
+
+  // Indexed by bounce, counting the camera ray as bounce 0
+  std::vector<long> reached;
+  std::vector<long> escaped;
+  std::vector<long> absorbed;
+  std::vector<long> roulette;
+  long capped;
+};
+
+void PathStats::print(std::ostream& out) const {
+  if(reached[0] == 0) {
+    return;
+  }
+
+  out << "bounce      reached      escaped     absorbed     roulette" << std::endl;
+  long segments = 0;
+  int last = 0;
+  int max_depth = reached.size() - 1;
+  for(int i = 0; i <= max_depth; i++) {
+    segments += reached[i];
+    if(reached[i] > 0) {
+      last = i;
+    }
+  }
+  for(int i = 0; i <= last; i++) {
+    out << std::setw(6) << i << std::setw(13) << reached[i] << std::setw(13) << escaped[i]
+	<< std::setw(13) << absorbed[i] << std::setw(13) << roulette[i] << std::endl;
+  }
+
+  // Paths killed by roulette would otherwise have continued like the ones
+  // that survived it: at each bounce, on average as far as the fraction not
+  // escaping or being absorbed there suggests. A path killed at bounce i
+  // would first have reached bounce i + 1, then gone on from there
+  double remaining = 0.0;
+  double saved = 0.0;
+  for(int i = max_depth; i >= 0; i--) {
+    saved += roulette[i] * (1.0 + remaining);
+    if(reached[i] > 0) {
+      double cont = double(reached[i] - escaped[i] - absorbed[i]) / reached[i];
+      remaining = cont * (1.0 + remaining);
+    }
+  }
+
+  out << "Average path length " << double(segments) / reached[0]
+      << ", roulette saved an estimated " << saved / reached[0] << " bounces per path, "
+      << capped << " paths hit max_depth" << std::endl;
+}
+
+// Iterative path tracer. Emitters reached by a BSDF-sampled ray could also
+// have been found by light sampling at the previous vertex, and are weighted
+// against it using prev_pdf. After specular bounces and from the camera only
+// the BSDF could have found them, so prev_specular gives them full weight.
+// Paths are continued with probability equal to their largest throughput
+// component, so dim paths end early and glass paths are rarely cut short.
+// The denoiser's features are taken at the first hit, except that albedo
+// and normal are taken from what is seen through mirrors and glass.
+// Specialized on the settings that are tested at every vertex; without
+// FEATURES, features is left zeroed
+template<MISHeuristic H, bool FEATURES>
+falg::Vec3 color(const Ray& camera_ray, Hitable *world, const LightList& lights, Sampler& sampler,
+		 PathStats& stats, SampleFeatures& features) {
+  vec3 radiance(0.0f, 0.0f, 0.0f);
+  vec3 throughput(1.0f, 1.0f, 1.0f);
+  float prev_pdf = 0.0f;
+  bool prev_specular = true;
+  Ray r = camera_ray;
+
+  features.albedo = features.normal = vec3(0.0f, 0.0f, 0.0f);
+  features.depth = 0.0f;
+  features.material_id = 0;
+  bool found_features = false;
+
+  for(int depth = 0; ; depth++) {
+    stats.reached[depth]++;
+
+    hit_record rec;
+    // Bounce 0 is the camera's own set of dimensions
+    sampler.start_bounce(depth + 1);
+    if(!world->hit(r, 0.001, MAXFLOAT, rec, sampler)) {
+      stats.escaped[depth]++;
+      break;
+    }
+
+    if(FEATURES && depth == 0) {
+      features.depth = rec.t * r.direction().norm();
+      features.material_id = rec.mat_ptr->id;
+    }
+
     vec3 emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
-    if(depth < DEPTH_LIM && rec.mat_ptr->scatter(r, rec, attenuation, scattered, dist)) {
-      return emitted + elementwise_mult(attenuation, color(scattered, world, depth + 1, dist));
-    } else {
-      return emitted;
+    if(!prev_specular && emitted.sqNorm() > 0) {
+      emitted *= mis_weight<H>(prev_pdf, lights.pdf(r, rec, sampler));
     }
+    radiance += elementwise_mult(throughput, emitted);
+
+    if(depth >= config.max_depth) {
+      stats.capped++;
+      break;
+    }
+
+    scatter_record srec;
+    bool scattered = rec.mat_ptr->sample(r, rec, sampler, srec);
+
+    // Kept from the last specular hit if the path ends before reaching anything else.
+    // Sharp glossy lobes show a blurred mirror image, and are looked through too
+    if(FEATURES && !found_features) {
+      features.albedo = rec.mat_ptr->base_color(rec);
+      features.normal = facing_normal(r, rec);
+      found_features = !(scattered && (srec.is_specular || srec.pdf > FEATURE_GLOSSY_PDF));
+    }
+
+    // Done even if the sampled direction was absorbed, the estimator needs both
+    if(!srec.is_specular) {
+      radiance += elementwise_mult(throughput, sample_direct<H>(r, rec, world, lights, sampler));
+    }
+
+    if(!scattered) {
+      stats.absorbed[depth]++;
+      break;
+    }
+
+    throughput = elementwise_mult(throughput, srec.weight);
+    if(depth + 1 >= config.rr_min_depth) {
+      float survive = std::min(1.0f, std::max(throughput[0], std::max(throughput[1], throughput[2])));
+      if(sampler.get_1d() >= survive) {
+	stats.roulette[depth]++;
+	break;
+      }
+      throughput /= survive;
+    }
+
+    prev_pdf = srec.pdf;
+    prev_specular = srec.is_specular;
+    r = Ray(rec.p, srec.direction, r.time());
   }
-  else {
-    float t = 0.5f * (r.direction().y() + 1.0f);
-    // return (1.0 - t) * vec3(1.0f, 1.0f, 1.0f) + t * vec3(0.5, 0.7, 1.0);
-    return vec3(0.0f, 0.0f, 0.0f);
+
+  return radiance;
+}
+
+typedef falg::Vec3 (*TracePath)(const Ray& camera_ray, Hitable *world, const LightList& lights, Sampler& sampler,
+				PathStats& stats, SampleFeatures& features);
+
+// The color() specialization for config
+TracePath select_trace() {
+  bool features = config.denoise || config.write_aovs;
+  if(config.mis_heuristic == MISHeuristic::Power) {
+    return features ? color<MISHeuristic::Power, true> : color<MISHeuristic::Power, false>;
+  } else {
+    return features ? color<MISHeuristic::Balance, true> : color<MISHeuristic::Balance, false>;
   }
 }
 
@@ -133,10 +341,10 @@ Hitable* finale(unidist& dist) {
 
   Hitable *boundary = new Sphere(vec3(360, 150, 145), 70, new Dielectric(1.5));
   list[l++] = boundary;
-  list[l++] = new ConstantMedium(boundary, 0.2, new ConstantTexture(vec3(1.0, 1.0, 1.0)), dist);
+  list[l++] = new ConstantMedium(boundary, 0.2, new ConstantTexture(vec3(1.0, 1.0, 1.0)));
 
   boundary = new Sphere(vec3(0, 0, 0), 5000, new Dielectric(1.5));
-  list[l++] = new ConstantMedium(boundary, 0.0001, new ConstantTexture(vec3(1.0, 1.0, 1.0)), dist);
+  list[l++] = new ConstantMedium(boundary, 0.0001, new ConstantTexture(vec3(1.0, 1.0, 1.0)));
 
   Material *emat = new Lambertian(new ImageTexture("earth.jpeg"));
   list[l++] = new Sphere(vec3(400, 200, 400), 100, emat);
@@ -175,8 +383,8 @@ Hitable* cornell_box(unidist& dist) {
 					 vec3(0, 15, 0)),
 			      vec3(265, 0, 295));
 
-  list[i++] = new ConstantMedium(b1, 0.01, new ConstantTexture(vec3(1.0, 1.0, 1.0)), dist);
-  list[i++] = new ConstantMedium(b2, 0.01, new ConstantTexture(vec3(0.0, 0.0, 0.0)), dist);
+  list[i++] = new ConstantMedium(b1, 0.01, new ConstantTexture(vec3(1.0, 1.0, 1.0)));
+  list[i++] = new ConstantMedium(b2, 0.01, new ConstantTexture(vec3(0.0, 0.0, 0.0)));
 
   return new HitableList(list, i);
 }
@@ -246,132 +454,1424 @@ Hitable* some_scene(unidist& dist) {
   // return new HitableList(list, i);
 }
 
+// Standard error of the pixel's mean luminance over the tolerated error.
+// Isolated rare paths (small lights seen in glossy reflections) can leave a
+// pixel looking converged, so each pixel is judged by the worst of its 3x3
+// neighbourhood. Returns the number of pixels that still need samples
+int update_active(Framebuffer& pixels) {
+  std::vector<float> error(config.width * config.height);
+  for(int i = 0; i < config.width * config.height; i++) {
+    PixelEstimate px;
+    pixels.get(i, px);
+    if(px.samples < 2) {
+      error[i] = MAXFLOAT;
+    } else {
+      float std_error = sqrt(px.m2 / ((px.samples - 1) * float(px.samples)));
+      error[i] = std_error / (config.adaptive_error * std::max(px.mean, config.adaptive_min_mean));
+    }
+  }
+
+  int num_active = 0;
+  for(int y = 0; y < config.height; y++) {
+    for(int x = 0; x < config.width; x++) {
+      float worst = 0.0f;
+      for(int ny = std::max(0, y - 1); ny <= std::min(config.height - 1, y + 1); ny++) {
+	for(int nx = std::max(0, x - 1); nx <= std::min(config.width - 1, x + 1); nx++) {
+	  worst = std::max(worst, error[ny * config.width + nx]);
+	}
+      }
+
+      PixelEstimate px;
+      pixels.get(y * config.width + x, px);
+      bool active = px.samples < config.samples && worst > 1.0f;
+      pixels.set_active(y * config.width + x, active);
+      num_active += active;
+    }
+  }
+  return num_active;
+}
+
+// Time a render thread spent on tiles, over all passes
+struct ThreadTiming {
+  double busy;
+  long tiles;
+  long stolen;
+};
+
+class StreamedFrame;
+
 struct thread_info {
-  std::atomic_int* g_rowcount;
+  int thread_index;
+  TileScheduler *scheduler;
+  std::atomic_int *tiles_done;
+  ThreadTiming *timing;
   Hitable *world;
-  float *out_array;
+  LightList *lights;
+  Framebuffer *pixels;
   Camera *cam;
+  PathStats *stats;
+  TracePath trace;
+  // Told of every finished tile, if the frame is written while it renders
+  StreamedFrame *stream;
+};
+
+// An image written a row at a time from the top down, so it is never held
+// whole. Rows are given as they are in memory, where row 0 is the bottom
+// one. Without channel names, the channels are called R, G, B and A
+class ImageStream {
+public:
+  ImageStream(const std::string& name, int channels,
+	      const std::vector<std::string>& channel_names = std::vector<std::string>())
+    : name(name), next_row(config.height - 1) {
+    this->outfile = OpenImageIO::ImageOutput::create(name);
+    if(!this->outfile) {
+      // This may be a writer thread, exit() would tear down what the render is using
+      std::cerr << "Cannot open output file " << name << ", exiting" << std::endl;
+      std::cout.flush();
+      std::_Exit(-1);
+    }
+
+    OpenImageIO::ImageSpec spec(config.width, config.height, channels, OpenImageIO::TypeDesc::FLOAT);
+    if(!channel_names.empty()) {
+      spec.channelnames = channel_names;
+      for(int i = 0; i < channels; i++) {
+	if(channel_names[i] == "Z") {
+	  spec.z_channel = i;
+	}
+      }
+    }
+    this->outfile->open(name, spec);
+  }
+
+  ~ImageStream() {
+    this->outfile->close();
+    if(this->next_row < 0) {
+      std::cout << "Wrote image to " << this->name << std::endl;
+    }
+  }
+
+  // Writes the row below the last one written
+  void write_row(const float* row) {
+    this->outfile->write_scanline(config.height - 1 - this->next_row, 0, OpenImageIO::TypeDesc::FLOAT, row);
+    this->next_row--;
+  }
+
+private:
+  std::string name;
+  std::unique_ptr<OpenImageIO::ImageOutput> outfile;
+  int next_row;
+};
+
+std::atomic_bool stop_requested(false);
+
+void request_stop(int signum) {
+  if(stop_requested) {
+    // Second interrupt, give up on saving
+    std::_Exit(1);
+  }
+  stop_requested = true;
+}
+
+// A single sample says nothing about the spread, assume it is as large as the value
+float pixel_variance(const PixelEstimate& px) {
+  return px.samples > 1 ? px.m2 / ((px.samples - 1) * float(px.samples)) : px.mean * px.mean;
+}
+
+// Returns the scale that maps mean costs per sample to heatmap_color(),
+// printing what it covers. Costs above the 99th percentile are white, so a
+// few stalled pixels do not flatten the rest of the map
+float heatmap_scale(const Framebuffer& pixels) {
+  std::vector<float> sorted(config.width * config.height);
+  double total = 0.0;
+  for(int i = 0; i < config.width * config.height; i++) {
+    PixelEstimate px;
+    pixels.get(i, px);
+    sorted[i] = px.samples > 0 ? px.sum[0] / px.samples : 0.0f;
+    total += sorted[i];
+  }
+  int top = std::min(int(sorted.size()) - 1, int(0.99 * sorted.size()));
+  std::nth_element(sorted.begin(), sorted.begin() + top, sorted.end());
+
+  const char* units[] = {"", "nodes", "tests", "ns"};
+  std::cout << "Heatmap of " << units[int(config.heatmap)] << " per sample: mean " << total / sorted.size()
+	    << ", white from " << sorted[top] << std::endl;
+  return sorted[top] > 0.0f ? 1.0f / sorted[top] : 0.0f;
+}
+
+// False color for a scaled cost t, from black at 0 through blue, green,
+// yellow and red at 1, and white above
+void heatmap_color(float t, float *rgb) {
+  const float stops[5][3] = {{0.0f, 0.0f, 0.0f}, {0.0f, 0.0f, 1.0f}, {0.0f, 1.0f, 0.0f},
+			     {1.0f, 1.0f, 0.0f}, {1.0f, 0.0f, 0.0f}};
+  if(t > 1.0f) {
+    rgb[0] = rgb[1] = rgb[2] = 1.0f;
+    return;
+  }
+  int stop = std::min(3, int(t * 4.0f));
+  float f = t * 4.0f - stop;
+  for(int c = 0; c < 3; c++) {
+    rgb[c] = (1.0f - f) * stops[stop][c] + f * stops[stop + 1][c];
+  }
+}
+
+// Traces a path, returning what it cost by config.heatmap
+float trace_cost(const thread_info& info, const Ray& r, Sampler& sampler, SampleFeatures& features) {
+  RenderCounters before = thread_counters();
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  info.trace(r, info.world, *info.lights, sampler, *info.stats, features);
+  if(config.heatmap == HeatmapCost::Time) {
+    return std::chrono::duration<float, std::nano>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  RenderCounters after = thread_counters();
+  if(config.heatmap == HeatmapCost::Nodes) {
+    return after.counts[COUNT_BVH_NODES] - before.counts[COUNT_BVH_NODES];
+  }
+  long tests = 0;
+  for(Counter c : {COUNT_TRIANGLE_TESTS, COUNT_SPHERE_HITS, COUNT_MOVING_SPHERE_HITS, COUNT_XY_RECT_HITS,
+		   COUNT_XZ_RECT_HITS, COUNT_YZ_RECT_HITS, COUNT_MEDIUM_HITS}) {
+    tests += after.counts[c] - before.counts[c];
+  }
+  return tests;
+}
+
+// Adds samples to the active pixels of tile, held in tile_pixels row by row.
+// Each is left inactive once it has its samples for the pass, so a pass
+// interrupted partway knows which pixels it still owes
+void render_tile(const thread_info& info, Sampler& sampler, const Tile& tile, PixelEstimate *tile_pixels) {
+  int tile_width = tile.x1 - tile.x0;
+  for(int y = tile.y0; y < tile.y1 && !stop_requested; y++) {
+    for(int x = tile.x0; x < tile.x1 && !stop_requested; x++) {
+      PixelEstimate& px = tile_pixels[(y - tile.y0) * tile_width + x - tile.x0];
+      if(!px.active) {
+	continue;
+      }
+
+      int target = std::min(config.samples, px.samples == 0 ? config.min_samples : px.samples + config.adaptive_batch);
+      while(px.samples < target) {
+	sampler.start_pixel_sample(x, y, config.sample_start + px.samples);
+	falg::Vec2 jitter = sampler.get_2d();
+	float u = (float(x) + jitter[0]) / float(config.width);
+	float v = (float(y) + jitter[1]) / float(config.height);
+	Ray r = info.cam->getRay(u, v, sampler);
+
+	SampleFeatures features;
+	if(config.heatmap != HeatmapCost::None) {
+	  float cost = trace_cost(info, r, sampler, features);
+	  add_sample(px, vec3(cost, cost, cost), features);
+	  continue;
+	}
+	vec3 sample = info.trace(r, info.world, *info.lights, sampler, *info.stats, features);
+	add_sample(px, sample, features);
+      }
+      px.active = false;
+    }
+  }
+}
+
+// Copies a tile's pixels out of the image, row by row, and back
+void read_tile(const Framebuffer& pixels, const Tile& tile, PixelEstimate *tile_pixels) {
+  int tile_width = tile.x1 - tile.x0;
+  for(int y = tile.y0; y < tile.y1; y++) {
+    for(int x = tile.x0; x < tile.x1; x++) {
+      pixels.get(y * config.width + x, tile_pixels[(y - tile.y0) * tile_width + x - tile.x0]);
+    }
+  }
+}
+
+void write_tile(Framebuffer& pixels, const Tile& tile, const PixelEstimate *tile_pixels) {
+  int tile_width = tile.x1 - tile.x0;
+  for(int y = tile.y0; y < tile.y1; y++) {
+    for(int x = tile.x0; x < tile.x1; x++) {
+      pixels.set(y * config.width + x, tile_pixels[(y - tile.y0) * tile_width + x - tile.x0]);
+    }
+  }
+}
+
+// One row of the image, as a tile the width of it
+void read_row(const Framebuffer& pixels, int y, PixelEstimate *row) {
+  read_tile(pixels, {0, y, config.width, y + 1}, row);
+}
+
+// name with the frame number before its extension, when rendering a sequence
+std::string frame_file(const std::string& name, int frame) {
+  if(config.frames == 1) {
+    return name;
+  }
+
+  char number[16];
+  snprintf(number, sizeof(number), ".%04d", frame);
+  size_t dot = name.rfind('.');
+  if(dot == std::string::npos || (name.rfind('/') != std::string::npos && dot < name.rfind('/'))) {
+    return name + number;
+  }
+  return name.substr(0, dot) + number + name.substr(dot);
+}
+
+// The images of a frame, written a row at a time from the top down: the
+// gamma corrected estimate (or heatmap), the samples taken per pixel as a
+// fraction of samples, and with write_aovs, the linear beauty pass together
+// with first-hit albedo, normal, depth and material ID, the number of
+// samples and the variance of each pixel's mean luminance. With denoise,
+// output gets the denoised image and noisy_output the estimate
+class FrameOutput {
+public:
+  // heat_scale is heatmap_scale() of the frame, for heatmaps
+  FrameOutput(int frame, float heat_scale) : total_samples(0), heat_scale(heat_scale) {
+    this->beauty.reset(new ImageStream(frame_file(config.output, frame), 3));
+    if(config.denoise) {
+      this->noisy.reset(new ImageStream(frame_file(config.noisy_output, frame), 3));
+    }
+    this->sample_counts.reset(new ImageStream(frame_file(config.sample_count_output, frame), 1));
+
+    if(config.write_aovs) {
+      // Linear beauty first, so viewers show it by default
+      std::vector<std::string> names = {"R", "G", "B"};
+      if(config.denoise) {
+	names.insert(names.end(), {"denoised.R", "denoised.G", "denoised.B"});
+      }
+      names.insert(names.end(), {"albedo.R", "albedo.G", "albedo.B", "N.X", "N.Y", "N.Z",
+				 "Z", "materialID", "samples", "variance"});
+      this->aov_channels = names.size();
+      this->aovs.reset(new ImageStream(frame_file(config.aov_output, frame), this->aov_channels, names));
+    }
+
+    this->beauty_row.resize(3 * config.width);
+    this->noisy_row.resize(3 * config.width);
+    this->sample_count_row.resize(config.width);
+    this->aov_row.resize(this->aov_channels * config.width);
+  }
+
+  // Writes the row of pixels below the last one written. With denoise,
+  // denoised holds the row's denoised RGB
+  void write_row(const PixelEstimate *row, const float *denoised) {
+    for(int x = 0; x < config.width; x++) {
+      const PixelEstimate& px = row[x];
+      float inv_samples = px.samples > 0 ? 1.0f / px.samples : 0.0f;
+      float linear[3], albedo[3], normal[3];
+      for(int c = 0; c < 3; c++) {
+	linear[c] = px.sum[c] * inv_samples;
+	albedo[c] = px.albedo[c] * inv_samples;
+	normal[c] = px.normal[c] * inv_samples;
+      }
+
+      float *out = &this->beauty_row[3 * x];
+      if(config.heatmap != HeatmapCost::None) {
+	heatmap_color(linear[0] * this->heat_scale, out);
+      } else {
+	const float *shown = denoised ? denoised + 3 * x : linear;
+	for(int c = 0; c < 3; c++) {
+	  out[c] = sqrt(shown[c]);
+	  this->noisy_row[3 * x + c] = sqrt(linear[c]);
+	}
+      }
+      this->sample_count_row[x] = float(px.samples) / config.samples;
+      this->total_samples += px.samples;
+
+      if(!this->aovs) {
+	continue;
+      }
+      float *aov = &this->aov_row[this->aov_channels * x];
+      aov = std::copy(linear, linear + 3, aov);
+      if(denoised) {
+	aov = std::copy(denoised + 3 * x, denoised + 3 * x + 3, aov);
+      }
+      aov = std::copy(albedo, albedo + 3, aov);
+      aov = std::copy(normal, normal + 3, aov);
+      *(aov++) = px.depth * inv_samples;
+      *(aov++) = px.material_id;
+      *(aov++) = px.samples;
+      *(aov++) = pixel_variance(px);
+    }
+
+    this->beauty->write_row(this->beauty_row.data());
+    if(this->noisy) {
+      this->noisy->write_row(this->noisy_row.data());
+    }
+    this->sample_counts->write_row(this->sample_count_row.data());
+    if(this->aovs) {
+      this->aovs->write_row(this->aov_row.data());
+    }
+  }
+
+  long total_samples;
+
+private:
+  float heat_scale;
+  int aov_channels = 0;
+  std::unique_ptr<ImageStream> beauty, noisy, sample_counts, aovs;
+  std::vector<float> beauty_row, noisy_row, sample_count_row, aov_row;
+};
+
+// Writes the current estimate and sample counts of frame, returning the
+// total number of samples. Only the denoiser and heatmaps need the whole
+// image at once, otherwise each row is made as it is written
+long write_outputs(const Framebuffer& pixels, int frame) {
+  int num_pixels = config.width * config.height;
+  std::vector<float> denoised;
+  if(config.denoise) {
+    std::vector<float> linear(3 * num_pixels), albedo(3 * num_pixels), normal(3 * num_pixels);
+    std::vector<float> depth(num_pixels), variance(num_pixels);
+    for(int i = 0; i < num_pixels; i++) {
+      PixelEstimate px;
+      pixels.get(i, px);
+      float inv_samples = px.samples > 0 ? 1.0f / px.samples : 0.0f;
+      for(int c = 0; c < 3; c++) {
+	linear[3 * i + c] = px.sum[c] * inv_samples;
+	albedo[3 * i + c] = px.albedo[c] * inv_samples;
+	normal[3 * i + c] = px.normal[c] * inv_samples;
+      }
+      depth[i] = px.depth * inv_samples;
+      variance[i] = pixel_variance(px);
+    }
+
+    denoised.resize(3 * num_pixels);
+    TraceSpan span("denoise");
+    denoise(linear.data(), albedo.data(), normal.data(), depth.data(), variance.data(), denoised.data(),
+	    config.width, config.height);
+  }
+
+  TraceSpan span("write images");
+  FrameOutput output(frame, config.heatmap != HeatmapCost::None ? heatmap_scale(pixels) : 0.0f);
+  std::vector<PixelEstimate> row(config.width);
+  for(int y = config.height - 1; y >= 0; y--) {
+    read_row(pixels, y, row.data());
+    output.write_row(row.data(), config.denoise ? denoised.data() + 3 * config.width * y : NULL);
+  }
+  return output.total_samples;
+}
+
+// Writes a frame's images while it renders, for a pass after which every
+// pixel it renders is final. A thread of its own writes each band of tile
+// rows, from the top down, as soon as all its tiles are done, so writing
+// is hidden behind the render and the images are never held whole
+class StreamedFrame {
+public:
+  StreamedFrame(const Framebuffer& pixels, const std::vector<Tile>& tiles, int frame)
+    : pixels(pixels), remaining((config.height + config.tile_size - 1) / config.tile_size, 0),
+      abandoned(false), output(frame, 0.0f) {
+    for(const Tile& tile : tiles) {
+      this->remaining[tile.y0 / config.tile_size]++;
+    }
+    this->writer = std::thread([this]() {
+	this->write_bands();
+      });
+  }
+
+  // Called by render threads once a tile's pixels are in place
+  void tile_done(const Tile& tile) {
+    std::lock_guard<std::mutex> guard(this->lock);
+    if(--this->remaining[tile.y0 / config.tile_size] == 0) {
+      this->band_ready.notify_one();
+    }
+  }
+
+  // Waits for the rest of the image to be written, or with abandon, only
+  // for the band being written. Returns the total number of samples written
+  long finish(bool abandon) {
+    {
+      std::lock_guard<std::mutex> guard(this->lock);
+      this->abandoned = abandon;
+    }
+    this->band_ready.notify_one();
+    this->writer.join();
+    return this->output.total_samples;
+  }
+
+private:
+  void write_bands() {
+    std::vector<PixelEstimate> row(config.width);
+    for(int band = this->remaining.size() - 1; band >= 0; band--) {
+      {
+	std::unique_lock<std::mutex> guard(this->lock);
+	this->band_ready.wait(guard, [&]() {
+	    return this->remaining[band] == 0 || this->abandoned;
+	  });
+	if(this->remaining[band] > 0) {
+	  return;
+	}
+      }
+
+      TraceSpan span("write rows", 0, band * config.tile_size);
+      int y0 = band * config.tile_size, y1 = std::min(config.height, y0 + config.tile_size);
+      for(int y = y1 - 1; y >= y0; y--) {
+	read_row(this->pixels, y, row.data());
+	this->output.write_row(row.data(), NULL);
+      }
+    }
+  }
+
+  const Framebuffer& pixels;
+  std::mutex lock;
+  std::condition_variable band_ready;
+  std::vector<int> remaining;
+  bool abandoned;
+  FrameOutput output;
+  std::thread writer;
 };
 
 void* draw_stuff(void* data) {
 
-  unidist dist;
+  Sampler *sampler = make_sampler(config.sampler, config.samples, config.seed);
 
   thread_info info = *(thread_info*)data;
 
-  int curr = info.g_rowcount->fetch_add(1);
+  // Tiles are rendered into a private copy, so threads never write to cache
+  // lines shared with a neighbouring tile
+  std::vector<PixelEstimate> tile_pixels(config.tile_size * config.tile_size);
+
+  Tile tile;
+  bool stolen;
+  while(!stop_requested && info.scheduler->next(info.thread_index, tile, stolen)) {
+    TraceSpan span("tile", tile.x0, tile.y0);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    read_tile(*info.pixels, tile, tile_pixels.data());
+    render_tile(info, *sampler, tile, tile_pixels.data());
+    // Also when interrupted, every pixel is left between samples
+    write_tile(*info.pixels, tile, tile_pixels.data());
+    if(info.stream) {
+      info.stream->tile_done(tile);
+    }
+
+    std::chrono::duration<double> busy = std::chrono::steady_clock::now() - start;
+    info.timing->busy += busy.count();
+    info.timing->tiles++;
+    info.timing->stolen += stolen;
+
+    int done = info.tiles_done->fetch_add(1) + 1;
+    std::cerr << "Processed tile " << done << " out of " << info.scheduler->num_tiles() << std::endl;
+  }
+
+  delete sampler;
+
+  return NULL;
+}
+
+// Renders the tiles a coordinator hands out over a connection of its own,
+// until the coordinator is done. Pixels travel as they are in memory
+void work_for_coordinator(const thread_info& info, uint32_t fingerprint) {
+  WorkerConnection connection(config.worker, fingerprint);
+  Sampler *sampler = make_sampler(config.sampler, config.samples, config.seed);
+  std::vector<PixelEstimate> tile_pixels;
+  std::vector<char> data;
+
+  Tile tile;
+  while(connection.next_tile(tile, data)) {
+    TraceSpan span("tile", tile.x0, tile.y0);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    int num_pixels = (tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+    if(num_pixels <= 0 || data.size() != num_pixels * sizeof(PixelEstimate)) {
+      std::cerr << "The coordinator sent a tile of the wrong size" << std::endl;
+      exit(-1);
+    }
+    tile_pixels.resize(num_pixels);
+    memcpy(tile_pixels.data(), data.data(), data.size());
+
+    render_tile(info, *sampler, tile, tile_pixels.data());
+
+    memcpy(data.data(), tile_pixels.data(), data.size());
+    connection.set_result(data);
+
+    std::chrono::duration<double> busy = std::chrono::steady_clock::now() - start;
+    info.timing->busy += busy.count();
+    info.timing->tiles++;
+  }
+
+  delete sampler;
+}
+
+uint32_t hash_bytes(const void* data, size_t size, uint32_t hash = 0) {
+  for(size_t i = 0; i < size; i++) {
+    hash = hash_combine(hash, ((const uint8_t*)data)[i]);
+  }
+  return hash;
+}
+
+uint32_t hash_string(const std::string& s, uint32_t hash = 0) {
+  return hash_bytes(s.data(), s.size(), hash);
+}
+
+template<typename T>
+uint32_t hash_array(const std::vector<T>& v, uint32_t hash) {
+  return hash_bytes(v.data(), v.size() * sizeof(T), hash_combine(hash, v.size()));
+}
+
+// Hash of what a scene file describes, so a file edited between runs is
+// not taken for the same scene. The items and meshes are plain data
+uint32_t hash_scene(const SceneDescription& scene) {
+  uint32_t hash = hash_array(scene.items, 0);
+  hash = hash_array(scene.children, hash);
+  hash = hash_array(scene.strings, hash);
+  for(const MeshData& mesh : scene.meshes) {
+    hash = hash_array(mesh.vertices, hash);
+    hash = hash_array(mesh.normals, hash);
+    hash = hash_array(mesh.uvs, hash);
+    hash = hash_array(mesh.indices, hash);
+    hash = hash_array(mesh.nodes, hash);
+    hash = hash_array(mesh.leaf_inds, hash);
+  }
+  return hash_combine(hash, scene.world);
+}
+
+// A scene and the camera it is meant to be seen from. Scenes read from a
+// file have no build function, and are built from their description
+struct SceneChoice {
+  std::string name;
+  Hitable* (*build)(unidist& dist);
+  SceneCamera camera;
+  SceneDescription description;
+  uint32_t contents = 0; // hash_scene() of the description
+};
+
+const std::vector<SceneChoice>& scenes() {
+  static const std::vector<SceneChoice> list = {
+    // Focused well in front of the teapot
+    {"teapot_scene", teapot_scene, {true, {200, 60, 200}, {0, 1, 0}, {0, 1, 0}, 35.0f, 0.05f, vec3(10, 2, 10).norm()}},
+    {"finale", finale, {true, {500, 278, -800}, {278, 278, 0}, {0, 1, 0}, 30.0f, 0.0f, 10.0f}},
+    {"cornell_box", cornell_box, {true, {278, 278, -800}, {278, 278, 0}, {0, 1, 0}, 40.0f, 0.0f, 10.0f}},
+    {"perlin_spheres", perlin_spheres, {true, {13, 2, 3}, {0, 2, 0}, {0, 1, 0}, 40.0f, 0.0f, 10.0f}},
+    {"two_spheres", two_spheres, {true, {13, 2, 3}, {0, 2, 0}, {0, 1, 0}, 40.0f, 0.0f, 10.0f}},
+    {"some_scene", some_scene, {true, {13, 2, 3}, {0, 2, 0}, {0, 1, 0}, 40.0f, 0.0f, 10.0f}},
+  };
+  return list;
+}
+
+// One of the scenes above, or a scene file (compiled or not) of that name
+SceneChoice load_scene(const std::string& name) {
+  for(const SceneChoice& scene : scenes()) {
+    if(name == scene.name) {
+      return scene;
+    }
+  }
+
+  if(!std::ifstream(name)) {
+    std::cerr << "Unknown scene " << name << ", give a scene file or one of";
+    for(const SceneChoice& scene : scenes()) {
+      std::cerr << " " << scene.name;
+    }
+    std::cerr << std::endl;
+    exit(-1);
+  }
+
+  SceneChoice scene;
+  scene.name = name;
+  scene.build = nullptr;
+  if(is_compiled_scene(name)) {
+    read_compiled_scene(name, scene.description);
+  } else {
+    parse_scene(name, scene.description);
+  }
+  scene.camera = scene.description.camera;
+  scene.contents = hash_scene(scene.description);
+  return scene;
+}
+
+// Identifies the settings that decide what image a render converges to:
+// the scene, camera, resolution and how paths are traced. Checkpoints and
+// accumulation files record it, so samples of different images never mix
+uint32_t scene_fingerprint(const SceneChoice& scene) {
+  std::ostringstream settings;
+  settings << scene.name << " " << scene.contents << " " << config.width << " " << config.height << " " << config.max_depth << " "
+	   << config.rr_min_depth << " " << int(config.mis_heuristic) << " " << int(config.heatmap) << " "
+	   << config.vfov << " " << config.aperture << " " << config.focus_dist << " "
+	   << config.frames << " " << config.shutter;
+  for(int i = 0; i < 3; i++) {
+    settings << " " << (config.has_lookfrom ? config.lookfrom[i] : 0.0f)
+	     << " " << (config.has_lookat ? config.lookat[i] : 0.0f)
+	     << " " << (config.has_vup ? config.vup[i] : 0.0f)
+	     << " " << scene.camera.lookfrom[i] << " " << scene.camera.lookat[i] << " " << scene.camera.vup[i];
+  }
+  settings << " " << scene.camera.set << " " << scene.camera.vfov << " " << scene.camera.aperture
+	   << " " << scene.camera.focus_dist;
+  return hash_string(settings.str());
+}
+
+// Identifies the settings that decide what a worker renders, the samples
+// it takes as well as the image
+uint32_t render_fingerprint(const SceneChoice& scene) {
+  std::ostringstream settings;
+  settings << config.samples << " " << config.sample_start << " " << config.min_samples << " "
+	   << config.adaptive_batch << " " << config.seed << " " << int(config.sampler);
+  return hash_string(settings.str(), scene_fingerprint(scene));
+}
+
+// Builds the scene from scratch, the same every time it is called
+Hitable* make_world(const SceneChoice& scene) {
+  TraceSpan span("build scene");
+  Material::next_id = 1;
+  unidist dist(0.0f, 1.0f, config.seed);
+  if(scene.build) {
+    return scene.build(dist);
+  }
+  return build_scene(scene.description, dist);
+}
 
-  while(curr < HEIGHT) {
-    float *out_array = info.out_array + (NUM_ELEMENTS_IN_PADDED_ROW * curr);
+// The scene's camera at frame, with what the config sets replaced
+Camera make_camera(const SceneCamera& camera, int frame) {
+  if(!camera.set && !(config.has_lookfrom && config.has_lookat)) {
+    std::cerr << "The scene has no camera, give at least lookfrom and lookat" << std::endl;
+    exit(-1);
+  }
+
+  const float* from = config.has_lookfrom ? config.lookfrom : camera.lookfrom;
+  const float* at = config.has_lookat ? config.lookat : camera.lookat;
+  const float* up = config.has_vup ? config.vup : camera.vup;
+  vec3 lookfrom(from[0], from[1], from[2]);
+  vec3 lookat(at[0], at[1], at[2]);
+  vec3 vup(up[0], up[1], up[2]);
+
+  float time = float(frame) / config.frames;
+  if(config.has_lookfrom_end) {
+    lookfrom = lookfrom + time * (vec3(config.lookfrom_end[0], config.lookfrom_end[1], config.lookfrom_end[2]) - lookfrom);
+  }
+  if(config.has_lookat_end) {
+    lookat = lookat + time * (vec3(config.lookat_end[0], config.lookat_end[1], config.lookat_end[2]) - lookat);
+  }
+  if(config.orbit != 0.0f) {
+    // Rodrigues' rotation of the offset from lookat around vup
+    vec3 axis = vup.normalized();
+    vec3 offset = lookfrom - lookat;
+    float angle = config.orbit * time * M_PI / 180.0f;
+    offset = cos(angle) * offset + sin(angle) * cross(axis, offset)
+      + (1.0f - cos(angle)) * falg::dot(axis, offset) * axis;
+    lookfrom = lookat + offset;
+  }
+
+  float vfov = config.vfov > 0 ? config.vfov : camera.vfov;
+  float aperture = config.aperture >= 0 ? config.aperture : camera.aperture;
+  float focus_dist = config.focus_dist >= 0 ? config.focus_dist : camera.focus_dist;
+  if(focus_dist == 0) {
+    focus_dist = (lookfrom - lookat).norm();
+  }
+
+  return Camera(lookfrom, lookat, vup, vfov, float(config.width) / float(config.height),
+		aperture, focus_dist, time, (frame + config.shutter) / config.frames);
+}
+
+// Prints what each thread did in render_time seconds of rendering, with the
+// rays traced and the counters, and writes it all to config.stats_json
+void report_render(ThreadPool& pool, const std::vector<thread_info*>& infos,
+		   const std::vector<ThreadTiming>& timings, double render_time) {
+  int num_threads = infos.size();
+  std::vector<RenderCounters> counters(num_threads);
+  pool.run([&](int thread) {
+      counters[thread] = thread_counters();
+    });
+
+  PathStats stats(config.max_depth);
+  RenderCounters total_counters = RenderCounters();
+  std::vector<long> rays(num_threads);
+  for(int i = 0; i < num_threads; i++) {
+    stats.add(*infos[i]->stats);
+    total_counters.add(counters[i]);
+    rays[i] = counters[i].counts[COUNT_SHADOW_RAYS];
+    for(long reached : infos[i]->stats->reached) {
+      rays[i] += reached;
+    }
+  }
+
+  long primary = stats.reached[0], secondary = -primary;
+  for(long reached : stats.reached) {
+    secondary += reached;
+  }
+  long shadow = total_counters.counts[COUNT_SHADOW_RAYS];
+  long total_rays = primary + secondary + shadow;
+
+  // Idle is time spent waiting for other threads to finish a pass
+  std::cout << "thread   busy (s)   idle (s)   tiles  stolen        rays   Mrays/s" << std::endl;
+  for(int i = 0; i < num_threads; i++) {
+    std::cout << std::setw(6) << i << std::fixed << std::setprecision(3)
+	      << std::setw(11) << timings[i].busy << std::setw(11) << render_time - timings[i].busy
+	      << std::defaultfloat << std::setw(8) << timings[i].tiles << std::setw(8) << timings[i].stolen
+	      << std::setw(12) << rays[i] << std::fixed << std::setprecision(2)
+	      << std::setw(10) << (timings[i].busy > 0 ? rays[i] / timings[i].busy * 1e-6 : 0.0)
+	      << std::defaultfloat << std::endl;
+  }
+  stats.print(std::cout);
+
+  std::cout << "Traced " << total_rays << " rays (" << primary << " primary, " << secondary << " secondary";
+  if(COUNTERS_ENABLED) {
+    std::cout << ", " << shadow << " shadow";
+  }
+  std::cout << ") in " << render_time << " s, " << total_rays / render_time * 1e-6 << " Mrays/s" << std::endl;
+  if(COUNTERS_ENABLED && total_rays > 0) {
+    std::cout << "counter                    total     per ray" << std::endl;
+    for(int c = 0; c < NUM_COUNTERS; c++) {
+      std::cout << std::left << std::setw(20) << COUNTER_NAMES[c] << std::right << std::setw(12) << total_counters.counts[c]
+		<< std::fixed << std::setprecision(3) << std::setw(12) << double(total_counters.counts[c]) / total_rays
+		<< std::defaultfloat << std::endl;
+    }
+  }
+
+  if(config.stats_json.empty()) {
+    return;
+  }
+  std::ofstream json(config.stats_json);
+  json << "{\n  \"render_time\": " << render_time << ",\n  \"rays\": " << total_rays
+       << ",\n  \"primary_rays\": " << primary << ",\n  \"secondary_rays\": " << secondary
+       << ",\n  \"mrays_per_s\": " << total_rays / render_time * 1e-6
+       << ",\n  \"counters_enabled\": " << (COUNTERS_ENABLED ? "true" : "false") << ",\n  \"counters\": {";
+  for(int c = 0; c < NUM_COUNTERS; c++) {
+    json << (c ? ", " : "") << "\"" << COUNTER_NAMES[c] << "\": " << total_counters.counts[c];
+  }
+  json << "},\n  \"threads\": [\n";
+  for(int i = 0; i < num_threads; i++) {
+    json << "    {\"busy\": " << timings[i].busy << ", \"tiles\": " << timings[i].tiles
+	 << ", \"stolen\": " << timings[i].stolen << ", \"rays\": " << rays[i]
+	 << ", \"mrays_per_s\": " << (timings[i].busy > 0 ? rays[i] / timings[i].busy * 1e-6 : 0.0);
+    for(int c = 0; c < NUM_COUNTERS; c++) {
+      json << ", \"" << COUNTER_NAMES[c] << "\": " << counters[i].counts[c];
+    }
+    json << "}" << (i + 1 < num_threads ? "," : "") << "\n";
+  }
+  json << "  ],\n  \"bounces\": [\n";
+  for(unsigned int b = 0; b < stats.reached.size() && stats.reached[b] > 0; b++) {
+    json << (b ? ",\n" : "") << "    {\"reached\": " << stats.reached[b] << ", \"escaped\": " << stats.escaped[b]
+	 << ", \"absorbed\": " << stats.absorbed[b] << ", \"roulette\": " << stats.roulette[b] << "}";
+  }
+  json << "\n  ],\n  \"max_depth_reached\": " << stats.capped << "\n}\n";
+  if(!json) {
+    std::cerr << "Could not write " << config.stats_json << std::endl;
+    return;
+  }
+  std::cout << "Wrote statistics to " << config.stats_json << std::endl;
+}
+
+// scene is the scene_fingerprint() of what is rendered
+CheckpointHeader checkpoint_header(uint32_t scene, int passes) {
+  return make_checkpoint_header(config.width, config.height, config.seed, uint32_t(config.sampler),
+				config.sample_start, config.samples, scene, passes);
+}
+
+// Writes a finished frame's images, unless streamed while it rendered, or
+// its accumulation file, marked with the scene's fingerprint, and removes
+// its checkpoint
+void finish_frame(const Framebuffer& pixels, int frame, bool streamed, uint32_t scene) {
+  TraceSpan span("finish frame");
+  long total_samples = 0;
+  if(config.accumulation.empty() && !streamed) {
+    total_samples = write_outputs(pixels, frame);
+  } else {
+    for(int i = 0; i < config.width * config.height; i++) {
+      PixelEstimate px;
+      pixels.get(i, px);
+      total_samples += px.samples;
+    }
+  }
+
+  if(!config.accumulation.empty()) {
+    // Left for a merge to normalize and write the images
+    std::string name = frame_file(config.accumulation, frame);
+    if(!save_checkpoint(name.c_str(), pixels, checkpoint_header(scene, 0))) {
+      std::cout.flush();
+      std::_Exit(-1);
+    }
+    std::cout << "Wrote samples " << config.sample_start << " to " << config.sample_start + config.samples - 1
+	      << " to " << name << std::endl;
+  }
+  std::cout << "Average samples per pixel: " << double(total_samples) / (config.width * config.height)
+	    << " (budget " << config.samples << ")" << std::endl;
+  remove(frame_file(config.checkpoint, frame).c_str());
+}
+
+// Combines the accumulation files listed in config.merge and writes the
+// images from them. The files must share resolution and random sequence,
+// and their sample ranges may not overlap
+void merge_accumulations() {
+  std::vector<std::string> names;
+  std::stringstream list(config.merge);
+  std::string name;
+  while(std::getline(list, name, ',')) {
+    if(!name.empty()) {
+      names.push_back(name);
+    }
+  }
+
+  if(names.empty()) {
+    std::cerr << "No files to merge" << std::endl;
+    exit(-1);
+  }
 
-    for(int j = 0; j < WIDTH; j++) {
-      vec3 col(0.0, 0.0, 0.0);
-      for(int s = 0; s < NUM_SAMPLES; s++) {
-	float u = (float(j) + dist.get()) / float(WIDTH);
-	float v = (float(curr) + dist.get()) / float(HEIGHT);
-	Ray r = info.cam->getRay(u, v, dist);
+  // The files are read a pixel at a time into merged, so only it is held in memory
+  Framebuffer *merged = NULL;
+  std::vector<CheckpointHeader> headers(names.size());
+  for(unsigned int i = 0; i < names.size(); i++) {
+    CheckpointHeader& header = headers[i];
+    std::ifstream file;
+    if(!open_checkpoint(names[i].c_str(), file, header)) {
+      exit(-1);
+    }
 
-	col += color(r, info.world, 0, dist);
+    if(i == 0) {
+      merged = new Framebuffer(header.width * header.height, config.framebuffer);
+      for(int p = 0; p < merged->size(); p++) {
+	merged->set(p, read_checkpoint_pixel(file));
+      }
+      continue;
+    }
+    if(header.width != headers[0].width || header.height != headers[0].height ||
+       header.seed != headers[0].seed || header.sampler_type != headers[0].sampler_type) {
+      std::cerr << names[i] << " was rendered with other settings than " << names[0] << std::endl;
+      exit(-1);
+    }
+    if(header.scene != headers[0].scene) {
+      std::cerr << names[i] << " was rendered with another scene, camera or path settings than " << names[0] << std::endl;
+      exit(-1);
+    }
+    for(unsigned int j = 0; j < i; j++) {
+      if(header.first_sample < headers[j].first_sample + headers[j].sample_budget &&
+	 headers[j].first_sample < header.first_sample + header.sample_budget) {
+	std::cerr << "The sample ranges of " << names[j] << " and " << names[i]
+		  << " overlap, their samples would be counted twice" << std::endl;
+	exit(-1);
       }
+    }
+    for(int p = 0; p < merged->size(); p++) {
+      PixelEstimate px;
+      merged->get(p, px);
+      merge_pixel(px, read_checkpoint_pixel(file));
+      merged->set(p, px);
+    }
+  }
 
-      col /= NUM_SAMPLES;
-      col = vec3(sqrt(col[0]), sqrt(col[1]), sqrt(col[2]));
+  // The images are written at the resolution of the files, with sample
+  // counts relative to the budget of all of them together
+  config.width = headers[0].width;
+  config.height = headers[0].height;
+  uint32_t first_sample = headers[0].first_sample, end_sample = 0;
+  config.samples = 0;
+  for(const CheckpointHeader& header : headers) {
+    first_sample = std::min(first_sample, header.first_sample);
+    end_sample = std::max(end_sample, header.first_sample + header.sample_budget);
+    config.samples += header.sample_budget;
+  }
+  std::cout << "Merged " << names.size() << " files" << std::endl;
+
+  long total_samples = write_outputs(*merged, config.first_frame);
+  std::cout << "Average samples per pixel: " << double(total_samples) / (config.width * config.height)
+	    << " (budget " << config.samples << ")" << std::endl;
+
+  if(!config.accumulation.empty()) {
+    // Covers every range merged, so it cannot be merged with any of them again
+    config.sample_start = first_sample;
+    config.samples = end_sample - first_sample;
+    if(save_checkpoint(config.accumulation.c_str(), *merged, checkpoint_header(headers[0].scene, 0))) {
+      std::cout << "Wrote merged samples to " << config.accumulation << std::endl;
+    }
+  }
+  delete merged;
+}
 
-      *(out_array++) = col[0]; // std::max(0, std::min(255, int(255.99 * col[0])));
-      *(out_array++) = col[1]; // std::max(0, std::min(255, int(255.99 * col[1])));
-      *(out_array++) = col[2]; // std::max(0, std::min(255, int(255.99 * col[2])));
+// Settings of the regression renders. References use another seed, so
+// their own noise is independent of the error being measured
+const int REGRESS_WIDTH = 160, REGRESS_HEIGHT = 120;
+const int REGRESS_SAMPLES = 16, REFERENCE_SAMPLES = 1024;
+const uint32_t REGRESS_SEED = 0, REFERENCE_SEED = 1;
+
+struct RegressResult {
+  double time;
+  long rays;
+  double rmse;
+  // Pixels with an infinite or NaN value, left out of rmse
+  int nonfinite;
+};
+
+// RMS difference over every channel of two images' means, leaving out
+// pixels that are not finite in either. Those not finite in pixels are counted in nonfinite
+double image_rmse(const Framebuffer& pixels, const Framebuffer& reference, int& nonfinite) {
+  double sum = 0.0;
+  int counted = 0;
+  nonfinite = 0;
+  for(int i = 0; i < config.width * config.height; i++) {
+    PixelEstimate px, ref;
+    pixels.get(i, px);
+    reference.get(i, ref);
+    vec3 value = px.sum * (1.0f / std::max(1, px.samples));
+    vec3 expected = ref.sum * (1.0f / std::max(1, ref.samples));
+    bool finite = std::isfinite(value[0]) && std::isfinite(value[1]) && std::isfinite(value[2]);
+    nonfinite += !finite;
+    if(!finite || !std::isfinite(expected[0]) || !std::isfinite(expected[1]) || !std::isfinite(expected[2])) {
+      continue;
+    }
+    for(int c = 0; c < 3; c++) {
+      sum += (value[c] - expected[c]) * (value[c] - expected[c]);
     }
+    counted++;
+  }
+  return counted > 0 ? sqrt(sum / (3 * counted)) : 0.0;
+}
 
-    std::cerr << "Processed row " << curr << " out of " << HEIGHT << std::endl;
+// Renders the scenes written in code as config.regress describes, and
+// returns the exit status, 1 if any scene regressed. Since the error of a
+// Monte Carlo estimate falls with the square root of the samples, a render
+// with error e in time t would need t * (e / e_baseline)^2 to match the
+// baseline, which weighs speed and error changes against each other. Scenes
+// without lights render black, and are compared by time alone. More
+// non-finite pixels than the baseline is a regression too
+int run_regression() {
+  config.width = REGRESS_WIDTH;
+  config.height = REGRESS_HEIGHT;
+  config.sample_start = 0;
+  config.sampler = SamplerType::Sobol;
+  config.heatmap = HeatmapCost::None;
+  config.denoise = false;
+
+  std::map<std::string, RegressResult> baseline;
+  std::ifstream baseline_file(config.regress);
+  std::string line;
+  while(std::getline(baseline_file, line)) {
+    std::istringstream fields(line);
+    std::string name;
+    RegressResult result;
+    if(line.empty() || line[0] == '#') {
+      continue;
+    }
+    if(!(fields >> name >> result.time >> result.rays >> result.rmse >> result.nonfinite)) {
+      std::cerr << "Cannot parse \"" << line << "\" in " << config.regress << std::endl;
+      exit(-1);
+    }
+    baseline[name] = result;
+  }
+  bool recording = baseline.empty();
+  mkdir(config.reference_dir.c_str(), 0755);
+
+  ThreadPool& pool = thread_pool(config.threads, config.pin_threads);
+  int num_threads = pool.size();
+  std::vector<Tile> tiles = make_tiles(config.width, config.height, config.tile_size);
+  TileScheduler scheduler(num_threads);
+  std::atomic_int tiles_done(0);
+  std::vector<ThreadTiming> timings(num_threads);
+  std::vector<PathStats> stats(num_threads, PathStats(config.max_depth));
+  std::vector<thread_info> infos(num_threads);
+  // References are kept in full precision, whatever the framebuffer timed
+  Framebuffer pixels(config.width * config.height, config.framebuffer);
+  Framebuffer reference(config.width * config.height, PixelFormat::Float);
+  TracePath trace = select_trace();
+
+  // Every pixel gets all samples in one pass, in seconds returned
+  auto render = [&](Framebuffer *target, int samples, uint32_t seed) {
+    config.samples = config.min_samples = samples;
+    config.seed = seed;
+    target->clear();
+    for(int i = 0; i < num_threads; i++) {
+      infos[i].pixels = target;
+      stats[i] = PathStats(config.max_depth);
+    }
+    scheduler.reset(tiles);
+    tiles_done = 0;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    pool.run([&](int thread) {
+	draw_stuff(&infos[thread]);
+      });
+    std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+    return time.count();
+  };
+
+  std::map<std::string, RegressResult> results;
+  std::vector<std::string> names;
+  for(const SceneChoice& scene : scenes()) {
+    Hitable *world = make_world(scene);
+    LightList lights(world);
+    Camera cam = make_camera(scene.camera, 0);
+    for(int i = 0; i < num_threads; i++) {
+      infos[i] = {i, &scheduler, &tiles_done, &timings[i], world, &lights, NULL, &cam, &stats[i], trace, NULL};
+    }
 
-    curr = info.g_rowcount->fetch_add(1);
+    std::string reference_name = config.reference_dir + "/" + scene.name + ".ref";
+    int passes;
+    config.seed = REFERENCE_SEED;
+    config.samples = REFERENCE_SAMPLES;
+    if(!load_checkpoint(reference_name.c_str(), reference, checkpoint_header(scene_fingerprint(scene), 0), passes)) {
+      std::cout << "Rendering reference " << reference_name << std::endl;
+      render(&reference, REFERENCE_SAMPLES, REFERENCE_SEED);
+      if(!save_checkpoint(reference_name.c_str(), reference, checkpoint_header(scene_fingerprint(scene), 1))) {
+	exit(-1);
+      }
+    }
+
+    RegressResult result;
+    result.time = MAXFLOAT;
+    for(int run = 0; run < config.regress_runs; run++) {
+      result.time = std::min(result.time, render(&pixels, REGRESS_SAMPLES, REGRESS_SEED));
+    }
+    result.rays = 0;
+    for(int i = 0; i < num_threads; i++) {
+      for(long reached : stats[i].reached) {
+	result.rays += reached;
+      }
+    }
+    result.rmse = image_rmse(pixels, reference, result.nonfinite);
+    results[scene.name] = result;
+    names.push_back(scene.name);
   }
 
+  int regressions = 0;
+  std::cout << "scene             time (s)  Mrays/s        RMSE  non-finite  equal error (s)  baseline (s)" << std::endl;
+  for(const std::string& name : names) {
+    const RegressResult& result = results[name];
+    std::cout << std::left << std::setw(16) << name << std::right << std::fixed << std::setprecision(3)
+	      << std::setw(10) << result.time << std::setprecision(2) << std::setw(9) << result.rays / result.time * 1e-6
+	      << std::defaultfloat << std::setprecision(4) << std::setw(12) << result.rmse << std::setw(12) << result.nonfinite;
+    if(baseline.count(name)) {
+      const RegressResult& base = baseline[name];
+      double equal_error_time = base.rmse > 0.0 ? result.time * (result.rmse / base.rmse) * (result.rmse / base.rmse) : result.time;
+      bool regressed = equal_error_time > base.time * (1.0 + config.regress_tolerance) || result.nonfinite > base.nonfinite;
+      regressions += regressed;
+      std::cout << std::fixed << std::setprecision(3) << std::setw(17) << equal_error_time << std::setw(14) << base.time
+		<< std::defaultfloat << (regressed ? "  REGRESSED" : "");
+    }
+    std::cout << std::endl;
+  }
 
-  return NULL;
+  if(recording) {
+    std::ofstream out(config.regress);
+    out << "# scene time_s rays rmse nonfinite, at " << REGRESS_WIDTH << "x" << REGRESS_HEIGHT << " and "
+	<< REGRESS_SAMPLES << " samples per pixel" << std::endl;
+    for(const std::string& name : names) {
+      out << name << " " << results[name].time << " " << results[name].rays << " " << results[name].rmse << " " << results[name].nonfinite << std::endl;
+    }
+    if(!out) {
+      std::cerr << "Could not write " << config.regress << std::endl;
+      exit(-1);
+    }
+    std::cout << "Wrote baseline to " << config.regress << std::endl;
+    return 0;
+  }
+
+  std::cout << regressions << " of " << names.size() << " scenes regressed" << std::endl;
+  return regressions > 0 ? 1 : 0;
 }
 
+int main(int argc, char** argv) {
+  parse_command_line(config, argc, argv);
+  if(!config.trace.empty()) {
+    start_trace();
+  }
+  if(config.heatmap != HeatmapCost::None) {
+    // Costs are not noise to filter or converge on, and their checkpoints
+    // must not be resumed by a render of the same settings. Nanoseconds per
+    // sample can exceed what half floats and RGB9E5 hold
+    config.denoise = false;
+    config.min_samples = config.samples;
+    config.checkpoint += ".heatmap";
+    config.framebuffer = PixelFormat::Float;
+  }
+  if(!config.merge.empty()) {
+    merge_accumulations();
+    return 0;
+  }
+  if(!config.regress.empty()) {
+    return run_regression();
+  }
 
-int main() {
-  unidist dist;
+  SceneChoice scene = load_scene(config.scene);
 
-  // Hitable *world = some_scene(dist);
-  // Hitable *world = two_spheres(dist);
-  // Hitable *world = perlin_spheres(dist);
-  // Hitable *world = cornell_box(dist);
-  // Hitable *world = finale(dist);
-  Hitable *world = teapot_scene(dist);
+  if(!config.compile_scene.empty()) {
+    if(scene.build) {
+      std::cerr << scene.name << " is written in code, only scene files can be compiled" << std::endl;
+      exit(-1);
+    }
+    if(scene.description.meshes.empty()) {
+      load_meshes(scene.description);
+    }
+    write_compiled_scene(config.compile_scene, scene.description);
+    std::cout << "Compiled " << scene.name << " to " << config.compile_scene << std::endl;
+    return 0;
+  }
 
-  vec3 lookfrom(10, 3, 10);
-  vec3 lookat(0, 1, 0);
-  float dist_to_focus = (lookfrom-lookat).norm();
-  float aperture = 0.05;
+  if(config.heatmap != HeatmapCost::None && config.heatmap != HeatmapCost::Time && !COUNTERS_ENABLED) {
+    std::cerr << "Heatmaps of nodes and tests need the counters, build with make COUNTERS=1" << std::endl;
+    exit(-1);
+  }
 
-  Camera cam(lookfrom * 20.0, lookat, vec3(0, 1, 0), 35, float(WIDTH) / float(HEIGHT),
-	     aperture, dist_to_focus,
-	     0.0f, 1.0f);
-  /* Camera cam(vec3(13, 2, 3),
-	     vec3(0, 2, 0),
-	     vec3(0, 1, 0),
-	     40,
-	     float(WIDTH) / float(HEIGHT),
-	     0.0,
-	     10.0, 0.0f, 1.0f); */
-  /* Camera cam(vec3(500, 278, -800), vec3(278, 278, 0),
-	     vec3(0, 1, 0), 30.0, float(WIDTH) / float(HEIGHT),
-	     0.0, 10.0, 0.0, 1.0); */
+  if(!config.coordinator.empty() && !config.worker.empty()) {
+    std::cerr << "Give either coordinator or worker, not both" << std::endl;
+    exit(-1);
+  }
+  // The coordinator only hands out tiles, and has no use for the scene
+  bool coordinating = !config.coordinator.empty();
+
+  ThreadPool& pool = thread_pool(config.threads, config.pin_threads);
+
+  // One scene and light list per NUMA node. Replicas are built one at a
+  // time, as building draws material ids from a shared counter
+  int num_replicas = config.replicate_scene ? pool.num_nodes() : 1;
+  std::vector<Hitable*> worlds(num_replicas, nullptr);
+  std::vector<LightList*> light_lists(num_replicas, nullptr);
+  if(!coordinating) {
+    std::cout << "Using " << pool.size() << " threads on " << pool.num_nodes() << " NUMA nodes" << std::endl;
+
+    std::chrono::steady_clock::time_point build_start = std::chrono::steady_clock::now();
+    if(num_replicas == 1) {
+      worlds[0] = make_world(scene);
+      TraceSpan span("collect lights");
+      light_lists[0] = new LightList(worlds[0]);
+    } else {
+      for(int node = 0; node < num_replicas; node++) {
+	std::atomic_bool built(false);
+	pool.run([&](int thread) {
+	    if(pool.node_of(thread) == node && !built.exchange(true)) {
+	      worlds[node] = make_world(scene);
+	      TraceSpan span("collect lights");
+	      light_lists[node] = new LightList(worlds[node]);
+	    }
+	  });
+      }
+    }
+    std::chrono::duration<double> build_time = std::chrono::steady_clock::now() - build_start;
+    std::cout << "Built " << scene.name << " in " << build_time.count() << " s" << std::endl;
+    std::cout << "Collected " << light_lists[0]->emitters.size() << " emitters for light sampling" << std::endl;
+  }
 
+  if(config.last_frame < 0 || config.last_frame >= config.frames) {
+    config.last_frame = config.frames - 1;
+  }
+  if(config.frames > 1 && (!config.coordinator.empty() || !config.worker.empty())) {
+    std::cerr << "Sequences are rendered by one process, split them between machines with first_frame and last_frame" << std::endl;
+    exit(-1);
+  }
+
+  Camera cam = make_camera(scene.camera, config.first_frame);
+  TracePath trace = select_trace();
 
-  pthread_t threads[NUM_THREADS]; // First never initialized
-  thread_info *infos[NUM_THREADS];
-  float *result_rows = new float[HEIGHT * NUM_ELEMENTS_IN_PADDED_ROW];
-  std::atomic_int global_counter(0);
+  int num_threads = pool.size();
+  std::vector<thread_info*> infos(num_threads);
+  Framebuffer pixels(config.width * config.height, config.framebuffer);
+  std::vector<Tile> all_tiles = make_tiles(config.width, config.height, config.tile_size);
+  TileScheduler scheduler(num_threads);
+  std::atomic_int tiles_done(0);
+  std::vector<ThreadTiming> timings(num_threads);
 
-  for(int i = 0; i < NUM_THREADS; i++) {
+  for(int i = 0; i < num_threads; i++) {
     infos[i] = new thread_info;
-    infos[i]->world = world;
+    infos[i]->thread_index = i;
+    infos[i]->scheduler = &scheduler;
+    infos[i]->tiles_done = &tiles_done;
+    timings[i].busy = 0.0;
+    timings[i].tiles = timings[i].stolen = 0;
+    infos[i]->timing = &timings[i];
+    infos[i]->world = worlds[pool.node_of(i) % num_replicas];
+    infos[i]->lights = light_lists[pool.node_of(i) % num_replicas];
     infos[i]->cam = &cam;
+    infos[i]->stats = new PathStats(config.max_depth);
+    infos[i]->trace = trace;
+    infos[i]->stream = NULL;
 
-    infos[i]->out_array = result_rows;
-    infos[i]->g_rowcount = &global_counter;
+    infos[i]->pixels = &pixels;
   }
 
-  for(int i = 1; i < NUM_THREADS; i++) {
-    if(pthread_create(threads + i, NULL, draw_stuff, infos[i])) {
-      std::cerr << "Could not create thread for some reason\n" << std::endl;
-      return 0;
+  if(!config.worker.empty()) {
+    uint32_t fingerprint = render_fingerprint(scene);
+    std::chrono::steady_clock::time_point work_start = std::chrono::steady_clock::now();
+    pool.run([&](int thread) {
+	work_for_coordinator(*infos[thread], fingerprint);
+      });
+    std::chrono::duration<double> work_time = std::chrono::steady_clock::now() - work_start;
+
+    long tiles = 0;
+    for(int i = 0; i < num_threads; i++) {
+      tiles += timings[i].tiles;
     }
+    std::cout << "Rendered " << tiles << " tiles for " << config.worker << std::endl;
+    report_render(pool, infos, timings, work_time.count());
+    if(!config.trace.empty()) {
+      write_trace(config.trace);
+    }
+    return 0;
   }
 
-  draw_stuff(infos[0]);
-
-  for(int i = 1; i < NUM_THREADS; i++) {
-    pthread_join(threads[i], NULL);
+  Coordinator *coordinator = NULL;
+  if(coordinating) {
+    coordinator = new Coordinator(config.coordinator, render_fingerprint(scene), config.tile_timeout);
   }
 
-  std::unique_ptr<OpenImageIO::ImageOutput> outfile = OpenImageIO::ImageOutput::create(IMAGE_NAME);
-  if(!outfile) {
-    std::cerr << "Cannot open output file, exiting" << std::endl;
-    exit(-1);
+  const char* format_names[] = {"float", "half", "rgb9e5"};
+  std::cout << "Framebuffer: " << pixels.bytes_per_pixel() << " bytes per pixel as "
+	    << format_names[int(config.framebuffer)] << ", "
+	    << pixels.bytes_per_pixel() * pixels.size() / (1 << 20) << " MB at " << config.width << "x" << config.height;
+  if(config.denoise) {
+    // The denoiser's inputs and result, in write_outputs()
+    std::cout << ", and " << 14 * sizeof(float) << " more while denoising";
   }
+  std::cout << std::endl;
+
+  signal(SIGINT, request_stop);
+  signal(SIGTERM, request_stop);
+
+  // A finished frame is written by this thread while the next one renders.
+  // It denoises on its own, leaving the pool to the render
+  std::thread writer;
+  double render_time = 0.0;
+  // A frame is written while it renders if one pass takes every pixel to
+  // its final sample count, and nothing needs the whole image first
+  bool can_stream = config.stream_output && config.min_samples >= config.samples && !config.denoise &&
+    config.heatmap == HeatmapCost::None && config.accumulation.empty() && !coordinating;
+  uint32_t scene_hash = scene_fingerprint(scene);
+  for(int frame = config.first_frame; frame <= config.last_frame; frame++) {
+    if(config.frames > 1) {
+      // Moving objects are functions of time, only the camera changes between frames
+      cam = make_camera(scene.camera, frame);
+      std::cout << "Rendering frame " << frame << " of " << config.frames << std::endl;
+    }
+    std::string checkpoint = frame_file(config.checkpoint, frame);
+
+    pixels.clear();
+    int first_pass = 0;
+    int num_active = config.width * config.height;
+    if(config.resume && load_checkpoint(checkpoint.c_str(), pixels, checkpoint_header(scene_hash, 0), first_pass)) {
+      // The saved pass is finished first, with the pixels it had not got
+      // to, so the render goes on as if it had never stopped
+      num_active = 0;
+      for(int i = 0; i < pixels.size(); i++) {
+	PixelEstimate px;
+	pixels.get(i, px);
+	num_active += px.active;
+      }
+      if(num_active == 0) {
+	num_active = update_active(pixels);
+	first_pass++;
+      }
+      std::cout << "Resuming from " << checkpoint << " at pass " << first_pass
+		<< ", " << num_active << " pixels not converged" << std::endl;
+    }
+
+    std::chrono::steady_clock::time_point last_checkpoint = std::chrono::steady_clock::now();
+    bool streamed = false;
+    for(int pass = first_pass; num_active > 0; pass++) {
+      // Tiles whose pixels have all converged are left out
+      std::vector<Tile> tiles;
+      for(const Tile& tile : all_tiles) {
+	bool active = false;
+	for(int y = tile.y0; y < tile.y1 && !active; y++) {
+	  for(int x = tile.x0; x < tile.x1 && !active; x++) {
+	    PixelEstimate px;
+	    pixels.get(y * config.width + x, px);
+	    active = px.active;
+	  }
+	}
+	if(active) {
+	  tiles.push_back(tile);
+	}
+      }
+
+      // If a resumed frame still needs more passes, it is written again at the end
+      StreamedFrame *stream = NULL;
+      if(can_stream && pass == first_pass) {
+	// In file order, dealt out in turn so the threads move down the image together
+	std::sort(tiles.begin(), tiles.end(), [](const Tile& a, const Tile& b) {
+	    return a.y0 != b.y0 ? a.y0 > b.y0 : a.x0 < b.x0;
+	  });
+	stream = new StreamedFrame(pixels, tiles, frame);
+      }
+      for(int i = 0; i < num_threads; i++) {
+	infos[i]->stream = stream;
+      }
+      scheduler.reset(tiles, stream != NULL);
+      tiles_done = 0;
+
+      TraceSpan pass_span("pass");
+      std::chrono::steady_clock::time_point pass_start = std::chrono::steady_clock::now();
+
+      if(coordinating) {
+	// Results are sent in full, but only active pixels get samples
+	coordinator->run_pass(tiles,
+			      [&](const Tile& tile, std::vector<char>& data) {
+				data.resize((tile.x1 - tile.x0) * (tile.y1 - tile.y0) * sizeof(PixelEstimate));
+				read_tile(pixels, tile, (PixelEstimate*)data.data());
+			      },
+			      [&](const Tile& tile, const std::vector<char>& data) {
+				if(data.size() == (tile.x1 - tile.x0) * (tile.y1 - tile.y0) * sizeof(PixelEstimate)) {
+				  write_tile(pixels, tile, (const PixelEstimate*)data.data());
+				}
+			      },
+			      stop_requested);
+      } else {
+	pool.run([&](int thread) {
+	    draw_stuff(infos[thread]);
+	  });
+      }
 
-  OpenImageIO::ImageSpec spec(WIDTH, HEIGHT, 3, OpenImageIO::TypeDesc::FLOAT);
-  outfile->open(IMAGE_NAME, spec);
+      std::chrono::duration<double> pass_time = std::chrono::steady_clock::now() - pass_start;
+      render_time += pass_time.count();
 
-  // We want to turn image upside down:
-  outfile->write_image(OpenImageIO::TypeDesc::FLOAT, result_rows + NUM_ELEMENTS_IN_PADDED_ROW * (HEIGHT - 1),
-		       OpenImageIO::AutoStride,
-		       - NUM_ELEMENTS_IN_PADDED_ROW * sizeof(float));
-  outfile->close();
+      if(stream) {
+	// When interrupted, the images are written whole below
+	stream->finish(stop_requested);
+	delete stream;
+      }
 
-  for(int i = 0; i < NUM_THREADS; i++) {
-    delete infos[i];
+      if(stop_requested) {
+	if(writer.joinable()) {
+	  writer.join();
+	}
+	// Pixels the pass did not get to stay active, and get their samples on resume
+	save_checkpoint(checkpoint.c_str(), pixels, checkpoint_header(scene_hash, pass));
+	if(config.accumulation.empty()) {
+	  write_outputs(pixels, frame);
+	}
+	std::cout << "Interrupted during pass " << pass << ", saved " << checkpoint << std::endl;
+	if(!config.trace.empty()) {
+	  // The pass itself is still open, its tiles show how far it got
+	  write_trace(config.trace);
+	}
+	exit(1);
+      }
+
+      num_active = update_active(pixels);
+      streamed = stream && num_active == 0;
+      std::cout << "Finished pass " << pass << ", " << num_active << " pixels not converged" << std::endl;
+
+      std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+      if(num_active > 0 &&
+	 std::chrono::duration_cast<std::chrono::seconds>(now - last_checkpoint).count() >= config.checkpoint_interval) {
+	save_checkpoint(checkpoint.c_str(), pixels, checkpoint_header(scene_hash, pass + 1));
+	if(config.accumulation.empty()) {
+	  write_outputs(pixels, frame);
+	}
+	last_checkpoint = now;
+      }
+    }
+
+    if(writer.joinable()) {
+      writer.join();
+    }
+    if(frame == config.last_frame || streamed) {
+      if(coordinating) {
+	coordinator->finish();
+      }
+      // Nothing left to overlap with, so the pool may help
+      finish_frame(pixels, frame, streamed, scene_hash);
+    } else {
+      // Copied once, straight into the thread, so at most two framebuffers are held
+      writer = std::thread([finished = Framebuffer(pixels), frame, scene_hash]() {
+	  ThreadPool::set_serial(true);
+	  finish_frame(finished, frame, false, scene_hash);
+	});
+    }
   }
 
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
 
-  std::cout << "Wrote image to " << IMAGE_NAME << std::endl;
+  if(coordinating) {
+    // Timings and path statistics are printed by the workers
+    std::cout << coordinator->num_connections() << " worker threads connected, "
+	      << coordinator->num_reissued() << " tiles were given out again" << std::endl;
+    delete coordinator;
+  } else {
+    report_render(pool, infos, timings, render_time);
+  }
+  if(!config.trace.empty()) {
+    write_trace(config.trace);
+  }
 
-  delete[] result_rows;
+  for(int i = 0; i < num_threads; i++) {
+    delete infos[i]->stats;
+    delete infos[i];
+  }
 
   return 0;
 }
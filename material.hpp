@@ -5,25 +5,112 @@
 
 #include "ray.hpp"
 #include "texture.hpp"
-#include "utils.hpp"
+#include "sampler.hpp"
+
+// Result of sampling a material. weight is f * cos / pdf, i.e. the factor
+// the path throughput is multiplied by. pdf is a solid angle density, and is
+// meaningless for specular events (mirror or refraction). Materials that
+// never scatter leave is_specular set, which also rules out light sampling
+struct scatter_record {
+  vec3 direction;
+  vec3 weight;
+  float pdf = 0.0f;
+  bool is_specular = true;
+};
 
 class Material {
 public:
-  virtual bool scatter(const Ray& r_in, const hit_record& rec, vec3& attenuation, Ray& scattered, unidist& dist) const = 0;
+  Material() : id(next_id++) {}
+
+  // Samples the direction the path continues in
+  virtual bool sample(const Ray& r_in, const hit_record& rec, Sampler& sampler, scatter_record& srec) const {
+    return false;
+  }
+
+  // f * cos for light arriving along wi (unit, pointing away from the surface)
+  virtual vec3 eval(const Ray& r_in, const hit_record& rec, const vec3& wi) const {
+    return vec3(0, 0, 0);
+  }
+
+  // The density sample() has of producing wi
+  virtual float pdf(const Ray& r_in, const hit_record& rec, const vec3& wi) const {
+    return 0.0f;
+  }
+
   virtual vec3 emitted(float u, float v, const vec3& p) const {
     return vec3(0, 0, 0);
   }
+
+  virtual bool is_emissive() const {
+    return false;
+  }
+
+  // Reflectance a denoiser can treat as texture: the fraction of light the
+  // material reflects, ignoring how it is spread out
+  virtual vec3 base_color(const hit_record& rec) const {
+    return vec3(1.0f, 1.0f, 1.0f);
+  }
+
+  // Numbered from 1 in order of creation, so IDs are stable between runs
+  // of the same scene. 0 is left for the background
+  int id;
+  inline static int next_id = 1;
 };
 
+bool is_emissive(const Material* mat) {
+  return mat->is_emissive();
+}
+
+// The normal on the side of the surface the ray came from
+vec3 facing_normal(const Ray& r_in, const hit_record& rec) {
+  return falg::dot(r_in.direction(), rec.normal) < 0 ? rec.normal : -rec.normal;
+}
+
+// Orthonormal basis around n (Duff et al., "Building an Orthonormal Basis, Revisited")
+void build_onb(const vec3& n, vec3& t, vec3& b) {
+  float sign = copysignf(1.0f, n.z());
+  float a = -1.0f / (sign + n.z());
+  float c = n.x() * n.y() * a;
+  t = vec3(1.0f + sign * n.x() * n.x() * a, sign * c, -sign * n.x());
+  b = vec3(c, sign + n.y() * n.y() * a, -n.y());
+}
+
+vec3 local_to_world(const vec3& local, const vec3& n) {
+  vec3 t, b;
+  build_onb(n, t, b);
+  return local.x() * t + local.y() * b + local.z() * n;
+}
+
 
 class Lambertian : public Material {
 public:
   Lambertian(Texture* a) : albedo(a) {}
-  virtual bool scatter(const Ray& r_in, const hit_record& rec, vec3& attenuation, Ray& scattered, unidist& dist) const {
-    vec3 target = rec.p + rec.normal + random_in_unit_sphere(dist);
-    scattered = Ray(rec.p, target - rec.p, r_in.time());
-    attenuation = albedo->value(rec.u, rec.v, rec.p);
-    return true;
+
+  // Cosine-weighted hemisphere, so the weight is just the albedo
+  virtual bool sample(const Ray& r_in, const hit_record& rec, Sampler& sampler, scatter_record& srec) const {
+    vec3 n = facing_normal(r_in, rec);
+    vec3 local = sample_cosine_hemisphere(sampler.get_2d());
+    srec.direction = local_to_world(local, n);
+    srec.pdf = local.z() / F_PI;
+    srec.weight = albedo->value(rec.u, rec.v, rec.p);
+    srec.is_specular = false;
+    return srec.pdf > 0;
+  }
+
+  virtual vec3 eval(const Ray& r_in, const hit_record& rec, const vec3& wi) const {
+    float cosine = falg::dot(wi, facing_normal(r_in, rec));
+    if(cosine <= 0) {
+      return vec3(0, 0, 0);
+    }
+    return (cosine / F_PI) * albedo->value(rec.u, rec.v, rec.p);
+  }
+
+  virtual float pdf(const Ray& r_in, const hit_record& rec, const vec3& wi) const {
+    return std::max(0.0f, falg::dot(wi, facing_normal(r_in, rec))) / F_PI;
+  }
+
+  virtual vec3 base_color(const hit_record& rec) const {
+    return albedo->value(rec.u, rec.v, rec.p);
   }
 
   Texture* albedo;
@@ -33,17 +120,66 @@ vec3 reflect(const vec3& v, const vec3& n) {
   return v - 2 * (v * n) * n;
 }
 
+// Normalized Phong lobe around the mirror direction, with the exponent
+// derived from fuzz. f * cos is the albedo times the lobe density, so
+// sampling the lobe has weight albedo, like the old fuzzed reflection did.
+// A fuzz of zero is a perfect mirror.
 class Metal : public Material {
 public:
-  Metal(const vec3& a, float fuzziness) : albedo(a) { fuzz = std::min(fuzziness, 1.0f);}
-  virtual bool scatter(const Ray& r_in, const hit_record& rec, vec3& attenuation, Ray& scattered, unidist& dist) const {
+  Metal(const vec3& a, float fuzziness) : albedo(a) {
+    fuzz = std::min(fuzziness, 1.0f);
+    exponent = fuzz > 0 ? 2.0f / (fuzz * fuzz) - 2.0f : 0.0f;
+  }
+
+  virtual bool sample(const Ray& r_in, const hit_record& rec, Sampler& sampler, scatter_record& srec) const {
+    vec3 reflected = reflect(r_in.direction().normalized(), rec.normal);
+    srec.weight = albedo;
+
+    if(fuzz <= 0) {
+      srec.direction = reflected;
+      srec.pdf = 0.0f;
+      srec.is_specular = true;
+      return falg::dot(reflected, rec.normal) > 0;
+    }
+
+    falg::Vec2 u = sampler.get_2d();
+    float cos_theta = pow(u[0], 1.0f / (exponent + 1.0f));
+    float sin_theta = sqrt(std::max(0.0f, 1.0f - cos_theta * cos_theta));
+    float phi = 2 * F_PI * u[1];
+    srec.direction = local_to_world(vec3(sin_theta * cos(phi), sin_theta * sin(phi), cos_theta), reflected);
+    srec.pdf = lobe_pdf(cos_theta);
+    srec.is_specular = false;
+
+    // Directions below the surface are absorbed
+    return falg::dot(srec.direction, facing_normal(r_in, rec)) > 0;
+  }
+
+  virtual vec3 eval(const Ray& r_in, const hit_record& rec, const vec3& wi) const {
+    return this->pdf(r_in, rec, wi) * albedo;
+  }
+
+  virtual float pdf(const Ray& r_in, const hit_record& rec, const vec3& wi) const {
+    if(fuzz <= 0 || falg::dot(wi, facing_normal(r_in, rec)) <= 0) {
+      return 0.0f;
+    }
     vec3 reflected = reflect(r_in.direction().normalized(), rec.normal);
-    scattered = Ray(rec.p, reflected + fuzz * random_in_unit_sphere(dist), r_in.time());
-    attenuation = albedo;
-    return falg::dot(scattered.direction(), rec.normal) > 0;
+    return lobe_pdf(falg::dot(wi, reflected));
   }
+
+  float lobe_pdf(float cos_theta) const {
+    if(cos_theta <= 0) {
+      return 0.0f;
+    }
+    return (exponent + 1.0f) / (2 * F_PI) * pow(cos_theta, exponent);
+  }
+
+  virtual vec3 base_color(const hit_record& rec) const {
+    return albedo;
+  }
+
   vec3 albedo;
   float fuzz;
+  float exponent;
 };
 
 bool refract(const vec3& v, const vec3& n, float ni_over_nt, vec3& refracted) {
@@ -69,11 +205,10 @@ float schlick(float cosine, float ref_idx) {
 class Dielectric : public Material {
 public:
   Dielectric(float ri) : ref_idx(ri) {}
-  virtual bool scatter(const Ray& r_in, const hit_record& rec, vec3& attenuation, Ray& scattered, unidist& dist) const {
+  virtual bool sample(const Ray& r_in, const hit_record& rec, Sampler& sampler, scatter_record& srec) const {
     vec3 outward_normal;
     vec3 reflected = reflect(r_in.direction(), rec.normal);
     float ni_over_nt;
-    attenuation = vec3(1.0, 1.0, 1.0);
     vec3 refracted;
     float reflect_prob;
     float cosine;
@@ -94,12 +229,15 @@ public:
       reflect_prob = 1.0;
     }
 
-    if (dist.get() < reflect_prob) {
-      scattered = Ray(rec.p, reflected, r_in.time());
+    if (sampler.get_1d() < reflect_prob) {
+      srec.direction = reflected.normalized();
     } else {
-      scattered = Ray(rec.p, refracted, r_in.time());
+      srec.direction = refracted.normalized();
     }
 
+    srec.weight = vec3(1.0, 1.0, 1.0);
+    srec.pdf = 0.0f;
+    srec.is_specular = true;
     return true;
   }
 
@@ -109,26 +247,40 @@ public:
 class DiffuseLight : public Material {
 public:
   DiffuseLight(Texture* tex) : emit(tex) { }
-  virtual bool scatter(const Ray& r_in, const hit_record& rec, vec3& attenuation, Ray& scattered, unidist& dist) const {
-    return false;
-  }
   virtual vec3 emitted(float u, float v, const vec3& p) const {
     return emit->value(u, v, p);
   }
 
+  virtual bool is_emissive() const {
+    return true;
+  }
+
   Texture* emit;
 };
 
 class Isotropic : public Material {
 public:
   Isotropic(Texture* tex) : albedo(tex) {}
-  virtual bool scatter(const Ray& r, const hit_record& rec,
-		       vec3& attenuation, Ray& scattered, unidist& dist) const {
-    scattered = Ray(rec.p, random_in_unit_sphere(dist), r.time());
-    attenuation = albedo->value(rec.u, rec.v, rec.p);
+  virtual bool sample(const Ray& r, const hit_record& rec, Sampler& sampler, scatter_record& srec) const {
+    srec.direction = sample_on_unit_sphere(sampler.get_2d());
+    srec.weight = albedo->value(rec.u, rec.v, rec.p);
+    srec.pdf = 1.0f / (4 * F_PI);
+    srec.is_specular = false;
     return true;
   }
 
+  virtual vec3 eval(const Ray& r, const hit_record& rec, const vec3& wi) const {
+    return (1.0f / (4 * F_PI)) * albedo->value(rec.u, rec.v, rec.p);
+  }
+
+  virtual float pdf(const Ray& r, const hit_record& rec, const vec3& wi) const {
+    return 1.0f / (4 * F_PI);
+  }
+
+  virtual vec3 base_color(const hit_record& rec) const {
+    return albedo->value(rec.u, rec.v, rec.p);
+  }
+
   Texture *albedo;
 };
 
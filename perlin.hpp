@@ -3,6 +3,7 @@
 
 #include "ray.hpp"
 #include "utils.hpp"
+#include "trace.hpp"
 
 float perlin_interp(vec3 c[2][2][2], float u, float v, float w) {
   float accum = 0;
@@ -61,6 +62,7 @@ class Perlin {
 public:
 
   Perlin(unidist& dist) {
+    TraceSpan span("generate Perlin tables");
     ranvec = perlin_generate(dist);
 
     perm_x = perlin_generate_perm(dist);
@@ -7,23 +7,32 @@
 #include "hitablelist.hpp"
 #include "material.hpp"
 #include "transforms.hpp"
+#include "counters.hpp"
 
 class XYRect : public Hitable {
 public:
   XYRect() {}
   XYRect(float x0, float x1, float y0, float y1, float k, Material* mat) : x0(x0), x1(x1), y0(y0), y1(y1), k(k), mp(mat) { }
-  virtual bool hit(const Ray& r, float t0, float t1, hit_record& rec) const;
+  virtual bool hit(const Ray& r, float t0, float t1, hit_record& rec, Sampler& sampler) const;
   virtual bool bounding_box(float t0, float t1, Aabb& box) const {
     box = Aabb(vec3(x0, y0, k - 0.0001), vec3(x1, y1, k + 0.0001));
     return true;
   }
+  virtual void collect_emitters(std::vector<Hitable*>& emitters) {
+    if(is_emissive(mp)) {
+      emitters.push_back(this);
+    }
+  }
+  virtual bool sample_light(const vec3& origin, float time, Sampler& sampler, light_sample& ls) const;
+  virtual float light_pdf(const Ray& r, float t_max, Sampler& sampler) const;
   
   float x0, x1, y0, y1, k;
   Material* mp;
 
 };
 
-bool XYRect::hit(const Ray& r, float t0, float t1, hit_record& rec) const {
+bool XYRect::hit(const Ray& r, float t0, float t1, hit_record& rec, Sampler& sampler) const {
+  COUNT(COUNT_XY_RECT_HITS);
   float t = (k - r.origin().z()) / r.direction().z();
   if (t < t0 || t > t1) {
     return false;
@@ -38,29 +47,59 @@ bool XYRect::hit(const Ray& r, float t0, float t1, hit_record& rec) const {
   rec.v = (y - y0) / (y1 - y0);
   rec.t = t;
   rec.mat_ptr = mp;
+  rec.hitable = this;
   rec.p = r.point_at_parameter(t);
   rec.normal = vec3(0, 0, 1);
   return true;
 }
 
+bool XYRect::sample_light(const vec3& origin, float time, Sampler& sampler, light_sample& ls) const {
+  falg::Vec2 u = sampler.get_2d();
+  float x = x0 + u[0] * (x1 - x0);
+  float y = y0 + u[1] * (y1 - y0);
+  ls.p = vec3(x, y, k);
+  ls.normal = vec3(0, 0, 1);
+  ls.u = u[0];
+  ls.v = u[1];
+  ls.mat_ptr = mp;
+  ls.pdf = area_to_solid_angle_pdf(1.0f / ((x1 - x0) * (y1 - y0)), origin, ls.p, ls.normal);
+  return ls.pdf > 0;
+}
+
+float XYRect::light_pdf(const Ray& r, float t_max, Sampler& sampler) const {
+  hit_record rec;
+  if(!this->hit(r, 0.001, t_max, rec, sampler)) {
+    return 0.0f;
+  }
+  return area_to_solid_angle_pdf(1.0f / ((x1 - x0) * (y1 - y0)), r.origin(), rec.p, rec.normal);
+}
+
 
 
 class XZRect : public Hitable {
 public:
   XZRect() {}
   XZRect(float x0, float x1, float z0, float z1, float k, Material* mat) : x0(x0), x1(x1), z0(z0), z1(z1), k(k), mp(mat) { }
-  virtual bool hit(const Ray& r, float t0, float t1, hit_record& rec) const;
+  virtual bool hit(const Ray& r, float t0, float t1, hit_record& rec, Sampler& sampler) const;
   virtual bool bounding_box(float t0, float t1, Aabb& box) const {
     box = Aabb(vec3(x0, k - 0.0001, z0), vec3(x1, k + 0.0001, z1));
     return true;
   }
+  virtual void collect_emitters(std::vector<Hitable*>& emitters) {
+    if(is_emissive(mp)) {
+      emitters.push_back(this);
+    }
+  }
+  virtual bool sample_light(const vec3& origin, float time, Sampler& sampler, light_sample& ls) const;
+  virtual float light_pdf(const Ray& r, float t_max, Sampler& sampler) const;
   
   float x0, x1, z0, z1, k;
   Material* mp;
 
 };
 
-bool XZRect::hit(const Ray& r, float t0, float t1, hit_record& rec) const {
+bool XZRect::hit(const Ray& r, float t0, float t1, hit_record& rec, Sampler& sampler) const {
+  COUNT(COUNT_XZ_RECT_HITS);
   float t = (k - r.origin().y()) / r.direction().y();
   if (t < t0 || t > t1) {
     return false;
@@ -75,11 +114,33 @@ bool XZRect::hit(const Ray& r, float t0, float t1, hit_record& rec) const {
   rec.v = (z - z0) / (z1 - z0);
   rec.t = t;
   rec.mat_ptr = mp;
+  rec.hitable = this;
   rec.p = r.point_at_parameter(t);
   rec.normal = vec3(0, 1, 0);
   return true;
 }
 
+bool XZRect::sample_light(const vec3& origin, float time, Sampler& sampler, light_sample& ls) const {
+  falg::Vec2 u = sampler.get_2d();
+  float x = x0 + u[0] * (x1 - x0);
+  float z = z0 + u[1] * (z1 - z0);
+  ls.p = vec3(x, k, z);
+  ls.normal = vec3(0, 1, 0);
+  ls.u = u[0];
+  ls.v = u[1];
+  ls.mat_ptr = mp;
+  ls.pdf = area_to_solid_angle_pdf(1.0f / ((x1 - x0) * (z1 - z0)), origin, ls.p, ls.normal);
+  return ls.pdf > 0;
+}
+
+float XZRect::light_pdf(const Ray& r, float t_max, Sampler& sampler) const {
+  hit_record rec;
+  if(!this->hit(r, 0.001, t_max, rec, sampler)) {
+    return 0.0f;
+  }
+  return area_to_solid_angle_pdf(1.0f / ((x1 - x0) * (z1 - z0)), r.origin(), rec.p, rec.normal);
+}
+
 
 
 
@@ -87,18 +148,26 @@ class YZRect : public Hitable {
 public:
   YZRect() {}
   YZRect(float y0, float y1, float z0, float z1, float k, Material* mat) : y0(y0), y1(y1), z0(z0), z1(z1), k(k), mp(mat) { }
-  virtual bool hit(const Ray& r, float t0, float t1, hit_record& rec) const;
+  virtual bool hit(const Ray& r, float t0, float t1, hit_record& rec, Sampler& sampler) const;
   virtual bool bounding_box(float t0, float t1, Aabb& box) const {
     box = Aabb(vec3(k - 0.0001, y0, z0), vec3(k + 0.0001, y1, z1));
     return true;
   }
+  virtual void collect_emitters(std::vector<Hitable*>& emitters) {
+    if(is_emissive(mp)) {
+      emitters.push_back(this);
+    }
+  }
+  virtual bool sample_light(const vec3& origin, float time, Sampler& sampler, light_sample& ls) const;
+  virtual float light_pdf(const Ray& r, float t_max, Sampler& sampler) const;
   
   float y0, y1, z0, z1, k;
   Material* mp;
 
 };
 
-bool YZRect::hit(const Ray& r, float t0, float t1, hit_record& rec) const {
+bool YZRect::hit(const Ray& r, float t0, float t1, hit_record& rec, Sampler& sampler) const {
+  COUNT(COUNT_YZ_RECT_HITS);
   float t = (k - r.origin().x()) / r.direction().x();
   if (t < t0 || t > t1) {
     return false;
@@ -113,20 +182,45 @@ bool YZRect::hit(const Ray& r, float t0, float t1, hit_record& rec) const {
   rec.v = (z - z0) / (z1 - z0);
   rec.t = t;
   rec.mat_ptr = mp;
+  rec.hitable = this;
   rec.p = r.point_at_parameter(t);
   rec.normal = vec3(1, 0, 0);
   return true;
 }
 
+bool YZRect::sample_light(const vec3& origin, float time, Sampler& sampler, light_sample& ls) const {
+  falg::Vec2 u = sampler.get_2d();
+  float y = y0 + u[0] * (y1 - y0);
+  float z = z0 + u[1] * (z1 - z0);
+  ls.p = vec3(k, y, z);
+  ls.normal = vec3(1, 0, 0);
+  ls.u = u[0];
+  ls.v = u[1];
+  ls.mat_ptr = mp;
+  ls.pdf = area_to_solid_angle_pdf(1.0f / ((y1 - y0) * (z1 - z0)), origin, ls.p, ls.normal);
+  return ls.pdf > 0;
+}
+
+float YZRect::light_pdf(const Ray& r, float t_max, Sampler& sampler) const {
+  hit_record rec;
+  if(!this->hit(r, 0.001, t_max, rec, sampler)) {
+    return 0.0f;
+  }
+  return area_to_solid_angle_pdf(1.0f / ((y1 - y0) * (z1 - z0)), r.origin(), rec.p, rec.normal);
+}
+
 class Box : public Hitable {
 public:
   Box() {}
   Box(const vec3& p0, const vec3& p1, Material *ptr);
-  virtual bool hit(const Ray& r, float t0, float t1, hit_record& rec) const;
+  virtual bool hit(const Ray& r, float t0, float t1, hit_record& rec, Sampler& sampler) const;
   virtual bool bounding_box(float t0, float t1, Aabb& box) const {
     box = Aabb(pmin, pmax);
     return true;
   }
+  virtual void collect_emitters(std::vector<Hitable*>& emitters) {
+    list_ptr->collect_emitters(emitters);
+  }
   vec3 pmin, pmax;
   Hitable *list_ptr;
 };
@@ -145,8 +239,8 @@ Box::Box(const vec3& p0, const vec3& p1, Material *ptr) {
   list_ptr = new HitableList(list, 6);
 }
 
-bool Box::hit(const Ray& r, float t0, float t1, hit_record& rec) const {
-  return list_ptr->hit(r, t0, t1, rec);
+bool Box::hit(const Ray& r, float t0, float t1, hit_record& rec, Sampler& sampler) const {
+  return list_ptr->hit(r, t0, t1, rec, sampler);
 }
 
 #endif // _RECT_HPP
@@ -0,0 +1,376 @@
+#include "sampler.hpp"
+
+#include <cmath>
+#include <algorithm>
+
+static const float ONE_MINUS_EPSILON = 0.99999994f;
+
+static float uint_to_float(uint32_t x) {
+  return std::min(x * (1.0f / 4294967296.0f), ONE_MINUS_EPSILON);
+}
+
+Sampler::Sampler(int samples_per_pixel, uint32_t seed) : samples_per_pixel(samples_per_pixel), seed(seed),
+							 rng(0.0f, 1.0f, seed) {
+  this->start_pixel_sample(0, 0, 0);
+}
+
+void Sampler::start_pixel_sample(int x, int y, int sample_index) {
+  this->px = x;
+  this->py = y;
+  this->sample_index = sample_index;
+  this->pixel_hash = hash_combine(hash_combine(this->seed, x), y);
+
+  this->rng.start_path((uint32_t(y) << 16) ^ uint32_t(x), sample_index);
+  this->start_bounce(0);
+}
+
+void Sampler::start_bounce(int bounce) {
+  this->rng.set_bounce(bounce);
+
+  if(bounce == 0) {
+    this->dimension = 0;
+    this->dimension_end = CAMERA_DIMENSIONS;
+  } else if(bounce <= MAX_BOUNCES) {
+    this->dimension = CAMERA_DIMENSIONS + (bounce - 1) * DIMENSIONS_PER_BOUNCE;
+    this->dimension_end = this->dimension + DIMENSIONS_PER_BOUNCE;
+  } else {
+    this->dimension = this->dimension_end = 0;
+  }
+}
+
+float Sampler::get_1d() {
+  if(this->dimension + 1 <= this->dimension_end) {
+    return this->sample_1d(this->dimension++);
+  }
+  return this->rng.get();
+}
+
+falg::Vec2 Sampler::get_2d() {
+  if(this->dimension + 2 <= this->dimension_end) {
+    falg::Vec2 u = this->sample_2d(this->dimension);
+    this->dimension += 2;
+    return u;
+  }
+  float u0 = this->rng.get();
+  float u1 = this->rng.get();
+  return falg::Vec2(u0, u1);
+}
+
+
+float IndependentSampler::sample_1d(int dim) {
+  return this->rng.get();
+}
+
+falg::Vec2 IndependentSampler::sample_2d(int dim) {
+  float u0 = this->rng.get();
+  float u1 = this->rng.get();
+  return falg::Vec2(u0, u1);
+}
+
+
+// Hash-based permutation of [0, l) (Kensler, "Correlated Multi-Jittered Sampling")
+static uint32_t cmj_permute(uint32_t i, uint32_t l, uint32_t p) {
+  uint32_t w = l - 1;
+  w |= w >> 1;
+  w |= w >> 2;
+  w |= w >> 4;
+  w |= w >> 8;
+  w |= w >> 16;
+  do {
+    i ^= p; i *= 0xe170893d;
+    i ^= p >> 16;
+    i ^= (i & w) >> 4;
+    i ^= p >> 8; i *= 0x0929eb3f;
+    i ^= p >> 23;
+    i ^= (i & w) >> 1; i *= 1 | p >> 27;
+    i *= 0x6935fa69;
+    i ^= (i & w) >> 11; i *= 0x74dcb303;
+    i ^= (i & w) >> 2; i *= 0x9e501cc3;
+    i ^= (i & w) >> 2; i *= 0xc860a3df;
+    i &= w;
+    i ^= i >> 5;
+  } while (i >= l);
+  return (i + p) % l;
+}
+
+static float cmj_randfloat(uint32_t i, uint32_t p) {
+  i ^= p;
+  i ^= i >> 17;
+  i ^= i >> 10; i *= 0xb36534e5;
+  i ^= i >> 12;
+  i ^= i >> 21; i *= 0x93fc4795;
+  i ^= 0xdf6e307f;
+  i ^= i >> 17; i *= 1 | p >> 18;
+  return uint_to_float(i);
+}
+
+float StratifiedSampler::sample_1d(int dim) {
+  uint32_t n = this->samples_per_pixel;
+  // Sample indices past the per-pixel count start a fresh set of strata
+  uint32_t s = this->sample_index % n;
+  uint32_t p = hash_combine(hash_combine(this->pixel_hash, dim), this->sample_index / n);
+
+  uint32_t stratum = cmj_permute(s, n, p * 0x51633e2d);
+  return (stratum + cmj_randfloat(s, p * 0x68bc21eb)) / n;
+}
+
+falg::Vec2 StratifiedSampler::sample_2d(int dim) {
+  uint32_t N = this->samples_per_pixel;
+  uint32_t m = std::max(1, int(std::sqrt(float(N))));
+  uint32_t n = (N + m - 1) / m;
+  uint32_t p = hash_combine(hash_combine(this->pixel_hash, dim), this->sample_index / N);
+
+  uint32_t s = cmj_permute(this->sample_index % N, N, p * 0x51633e2d);
+  uint32_t sx = cmj_permute(s % m, m, p * 0xa511e9b3);
+  uint32_t sy = cmj_permute(s / m, n, p * 0x63d83595);
+  float jx = cmj_randfloat(s, p * 0xa399d265);
+  float jy = cmj_randfloat(s, p * 0x711ad6a5);
+
+  return falg::Vec2(std::min((s % m + (sy + jx) / n) / m, ONE_MINUS_EPSILON),
+		    std::min((s / m + (sx + jy) / m) / n, ONE_MINUS_EPSILON));
+}
+
+
+static uint32_t reverse_bits(uint32_t x) {
+  x = (x << 16) | (x >> 16);
+  x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+  x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+  x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+  x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+  return x;
+}
+
+static uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return x;
+}
+
+static uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+  return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+// Second Sobol dimension; the first is just the bit-reversed index
+static uint32_t sobol_dimension_1(uint32_t index) {
+  uint32_t v = 1u << 31;
+  uint32_t x = 0;
+  for(; index; index >>= 1, v ^= v >> 1) {
+    if(index & 1) {
+      x ^= v;
+    }
+  }
+  return x;
+}
+
+float SobolSampler::sample_1d(int dim) {
+  uint32_t p = hash_combine(this->pixel_hash, dim);
+  uint32_t index = nested_uniform_scramble(this->sample_index, p);
+  return uint_to_float(nested_uniform_scramble(reverse_bits(index), hash_combine(p, 0)));
+}
+
+falg::Vec2 SobolSampler::sample_2d(int dim) {
+  uint32_t p = hash_combine(this->pixel_hash, dim);
+  uint32_t index = nested_uniform_scramble(this->sample_index, p);
+  uint32_t x = nested_uniform_scramble(reverse_bits(index), hash_combine(p, 0));
+  uint32_t y = nested_uniform_scramble(sobol_dimension_1(index), hash_combine(p, 1));
+  return falg::Vec2(uint_to_float(x), uint_to_float(y));
+}
+
+
+static const int BLUE_NOISE_SIZE = 64;
+
+// Void-and-cluster (Ulichney, 1993) on a torus, returning the rank of every
+// texel mapped to (0, 1)
+static std::vector<float> generate_blue_noise_tile() {
+  const int size = BLUE_NOISE_SIZE;
+  const int mask = size - 1;
+  const int num = size * size;
+  const int radius = 6;
+  const float sigma = 1.9f;
+
+  float kernel[2 * radius + 1][2 * radius + 1];
+  for(int dy = -radius; dy <= radius; dy++) {
+    for(int dx = -radius; dx <= radius; dx++) {
+      kernel[dy + radius][dx + radius] = exp(-(dx * dx + dy * dy) / (2 * sigma * sigma));
+    }
+  }
+
+  std::vector<char> pattern(num, 0);
+  std::vector<float> energy(num, 0.0f);
+
+  auto splat = [&](int idx, float sign) {
+    int x = idx % size, y = idx / size;
+    for(int dy = -radius; dy <= radius; dy++) {
+      for(int dx = -radius; dx <= radius; dx++) {
+	energy[((y + dy) & mask) * size + ((x + dx) & mask)] += sign * kernel[dy + radius][dx + radius];
+      }
+    }
+  };
+
+  auto tightest_cluster = [&]() {
+    int best = -1;
+    for(int i = 0; i < num; i++) {
+      if(pattern[i] && (best < 0 || energy[i] > energy[best])) {
+	best = i;
+      }
+    }
+    return best;
+  };
+
+  auto largest_void = [&]() {
+    int best = -1;
+    for(int i = 0; i < num; i++) {
+      if(!pattern[i] && (best < 0 || energy[i] < energy[best])) {
+	best = i;
+      }
+    }
+    return best;
+  };
+
+  unidist dist(0.0f, 1.0f, 0x626c7565);
+  const int num_initial = num / 10;
+  for(int placed = 0; placed < num_initial; ) {
+    int idx = std::min(int(dist.get() * num), num - 1);
+    if(!pattern[idx]) {
+      pattern[idx] = 1;
+      splat(idx, 1.0f);
+      placed++;
+    }
+  }
+
+  // Spread the initial points out until moving one no longer helps
+  for(int iteration = 0; iteration < num; iteration++) {
+    int cluster = tightest_cluster();
+    pattern[cluster] = 0;
+    splat(cluster, -1.0f);
+    int hole = largest_void();
+    pattern[hole] = 1;
+    splat(hole, 1.0f);
+    if(hole == cluster) {
+      break;
+    }
+  }
+
+  std::vector<char> initial_pattern = pattern;
+  std::vector<float> initial_energy = energy;
+  std::vector<int> rank(num);
+
+  for(int r = num_initial - 1; r >= 0; r--) {
+    int cluster = tightest_cluster();
+    pattern[cluster] = 0;
+    splat(cluster, -1.0f);
+    rank[cluster] = r;
+  }
+
+  pattern = initial_pattern;
+  energy = initial_energy;
+  for(int r = num_initial; r < num; r++) {
+    int hole = largest_void();
+    pattern[hole] = 1;
+    splat(hole, 1.0f);
+    rank[hole] = r;
+  }
+
+  std::vector<float> tile(num);
+  for(int i = 0; i < num; i++) {
+    tile[i] = (rank[i] + 0.5f) / num;
+  }
+  return tile;
+}
+
+static const std::vector<float>& blue_noise_tile() {
+  static const std::vector<float> tile = generate_blue_noise_tile();
+  return tile;
+}
+
+BlueNoiseSampler::BlueNoiseSampler(int samples_per_pixel, uint32_t seed) : Sampler(samples_per_pixel, seed),
+									   tile(blue_noise_tile()) { }
+
+// Each dimension looks up the tile at its own toroidal shift, which keeps the
+// per-pixel offsets of different dimensions uncorrelated
+float BlueNoiseSampler::tile_value(int dim) const {
+  uint32_t h = hash_combine(this->seed, dim);
+  int x = (this->px + h) & (BLUE_NOISE_SIZE - 1);
+  int y = (this->py + (h >> 16)) & (BLUE_NOISE_SIZE - 1);
+  return this->tile[y * BLUE_NOISE_SIZE + x];
+}
+
+float BlueNoiseSampler::sample_1d(int dim) {
+  const double golden = 0.6180339887498949;
+  double v = this->tile_value(dim) + this->sample_index * golden;
+  return std::min(float(v - floor(v)), ONE_MINUS_EPSILON);
+}
+
+falg::Vec2 BlueNoiseSampler::sample_2d(int dim) {
+  // R2 sequence (Roberts, 2018), the 2D analogue of the golden ratio sequence
+  const double g = 1.32471795724474602596;
+  double x = this->tile_value(dim) + this->sample_index / g;
+  double y = this->tile_value(dim + 1) + this->sample_index / (g * g);
+  return falg::Vec2(std::min(float(x - floor(x)), ONE_MINUS_EPSILON),
+		    std::min(float(y - floor(y)), ONE_MINUS_EPSILON));
+}
+
+
+Sampler* make_sampler(SamplerType type, int samples_per_pixel, uint32_t seed) {
+  switch(type) {
+  case SamplerType::Independent:
+    return new IndependentSampler(samples_per_pixel, seed);
+  case SamplerType::Stratified:
+    return new StratifiedSampler(samples_per_pixel, seed);
+  case SamplerType::Sobol:
+    return new SobolSampler(samples_per_pixel, seed);
+  case SamplerType::BlueNoise:
+    return new BlueNoiseSampler(samples_per_pixel, seed);
+  }
+  return nullptr;
+}
+
+
+// Concentric mapping (Shirley & Chiu, 1997)
+falg::Vec3 sample_in_unit_disk(const falg::Vec2& u) {
+  float a = 2 * u[0] - 1;
+  float b = 2 * u[1] - 1;
+  if(a == 0 && b == 0) {
+    return falg::Vec3(0, 0, 0);
+  }
+
+  float r, phi;
+  if(std::abs(a) > std::abs(b)) {
+    r = a;
+    phi = (F_PI / 4) * (b / a);
+  } else {
+    r = b;
+    phi = (F_PI / 2) - (F_PI / 4) * (a / b);
+  }
+  return falg::Vec3(r * cos(phi), r * sin(phi), 0);
+}
+
+falg::Vec3 sample_on_unit_sphere(const falg::Vec2& u) {
+  float z = 1 - 2 * u[0];
+  float r = sqrt(std::max(0.0f, 1 - z * z));
+  float phi = 2 * F_PI * u[1];
+  return falg::Vec3(r * cos(phi), r * sin(phi), z);
+}
+
+// Malley's method: project a uniform disk sample up onto the hemisphere
+falg::Vec3 sample_cosine_hemisphere(const falg::Vec2& u) {
+  falg::Vec3 d = sample_in_unit_disk(u);
+  float z = sqrt(std::max(0.0f, 1 - d.x() * d.x() - d.y() * d.y()));
+  return falg::Vec3(d.x(), d.y(), z);
+}
+
+falg::Vec3 sample_in_unit_sphere(const falg::Vec2& u, float r) {
+  return cbrt(r) * sample_on_unit_sphere(u);
+}
+
+falg::Vec3 random_in_unit_disk(Sampler& sampler) {
+  return sample_in_unit_disk(sampler.get_2d());
+}
+
+falg::Vec3 random_in_unit_sphere(Sampler& sampler) {
+  falg::Vec2 u = sampler.get_2d();
+  return sample_in_unit_sphere(u, sampler.get_1d());
+}
@@ -0,0 +1,113 @@
+#ifndef INCLUDE_SAMPLER_HPP
+#define INCLUDE_SAMPLER_HPP
+
+#include <cstdint>
+#include <vector>
+
+#include <FlatAlg.hpp>
+
+#include "utils.hpp"
+
+enum class SamplerType {
+  Independent,
+  Stratified,
+  Sobol,
+  BlueNoise
+};
+
+// Source of the random numbers for one camera path. Dimensions are handed out
+// in the order they are asked for, but each bounce starts at a fixed offset,
+// so the camera always gets dimensions 0-4, the first bounce the next
+// DIMENSIONS_PER_BOUNCE and so on. Draws that overflow a bounce's budget, or
+// go past MAX_BOUNCES, fall back to the independent generator.
+class Sampler {
+public:
+  Sampler(int samples_per_pixel, uint32_t seed);
+  virtual ~Sampler() {}
+
+  void start_pixel_sample(int x, int y, int sample_index);
+  void start_bounce(int bounce);
+
+  float get_1d();
+  falg::Vec2 get_2d();
+
+  static const int CAMERA_DIMENSIONS = 5;
+  static const int DIMENSIONS_PER_BOUNCE = 8;
+  static const int MAX_BOUNCES = 16;
+
+protected:
+  virtual float sample_1d(int dim) = 0;
+  virtual falg::Vec2 sample_2d(int dim) = 0;
+
+  int samples_per_pixel;
+  uint32_t seed;
+
+  int px, py;
+  int sample_index;
+  uint32_t pixel_hash;
+
+  int dimension;
+  int dimension_end;
+
+  unidist rng;
+};
+
+class IndependentSampler : public Sampler {
+public:
+  IndependentSampler(int samples_per_pixel, uint32_t seed) : Sampler(samples_per_pixel, seed) {}
+
+protected:
+  virtual float sample_1d(int dim);
+  virtual falg::Vec2 sample_2d(int dim);
+};
+
+// Correlated multi-jittered sampling (Kensler, 2013): stratified in 2D and in
+// each 1D projection, for any number of samples per pixel
+class StratifiedSampler : public Sampler {
+public:
+  StratifiedSampler(int samples_per_pixel, uint32_t seed) : Sampler(samples_per_pixel, seed) {}
+
+protected:
+  virtual float sample_1d(int dim);
+  virtual falg::Vec2 sample_2d(int dim);
+};
+
+// First two Sobol dimensions with hash-based Owen scrambling (Burley, 2020).
+// Higher dimensions are padded by shuffling the sample index per dimension pair
+class SobolSampler : public Sampler {
+public:
+  SobolSampler(int samples_per_pixel, uint32_t seed) : Sampler(samples_per_pixel, seed) {}
+
+protected:
+  virtual float sample_1d(int dim);
+  virtual falg::Vec2 sample_2d(int dim);
+};
+
+// Golden ratio / R2 sequences over the sample index, offset per pixel by a
+// void-and-cluster blue noise tile, so error at low sample counts is blue noise
+class BlueNoiseSampler : public Sampler {
+public:
+  BlueNoiseSampler(int samples_per_pixel, uint32_t seed);
+
+protected:
+  virtual float sample_1d(int dim);
+  virtual falg::Vec2 sample_2d(int dim);
+
+  float tile_value(int dim) const;
+
+  const std::vector<float>& tile;
+};
+
+Sampler* make_sampler(SamplerType type, int samples_per_pixel, uint32_t seed);
+
+// Closed-form warps from uniform numbers, replacing rejection sampling
+falg::Vec3 sample_in_unit_disk(const falg::Vec2& u);
+falg::Vec3 sample_in_unit_sphere(const falg::Vec2& u, float r);
+falg::Vec3 sample_on_unit_sphere(const falg::Vec2& u);
+// Around +z, with density cos(theta) / pi
+falg::Vec3 sample_cosine_hemisphere(const falg::Vec2& u);
+
+falg::Vec3 random_in_unit_disk(Sampler& sampler);
+falg::Vec3 random_in_unit_sphere(Sampler& sampler);
+
+#endif // INCLUDE_SAMPLER_HPP
@@ -0,0 +1,120 @@
+#ifndef INCLUDE_SCENEBUILDER_HPP
+#define INCLUDE_SCENEBUILDER_HPP
+
+#include <vector>
+
+#include "hitable.hpp"
+#include "sphere.hpp"
+#include "rect.hpp"
+#include "hitablelist.hpp"
+#include "material.hpp"
+#include "texture.hpp"
+#include "transforms.hpp"
+#include "volume.hpp"
+#include "triangles.hpp"
+#include "scenefile.hpp"
+
+// Creates the objects of a scene description and returns its world. Noise
+// textures and BVHs draw from dist, as in the scenes written in code
+Hitable* build_scene(const SceneDescription& scene, unidist& dist) {
+  // Items only refer back, so one pass in order finds everything built
+  std::vector<Texture*> textures(scene.items.size(), nullptr);
+  std::vector<Material*> materials(scene.items.size(), nullptr);
+  std::vector<Hitable*> shapes(scene.items.size(), nullptr);
+
+  for(unsigned int i = 0; i < scene.items.size(); i++) {
+    const SceneItem& item = scene.items[i];
+    const float* p = item.params;
+    Texture* tex = item.refs[0] >= 0 ? textures[item.refs[0]] : nullptr;
+    Material* mat = item.refs[0] >= 0 ? materials[item.refs[0]] : nullptr;
+    Hitable* shape = item.refs[0] >= 0 ? shapes[item.refs[0]] : nullptr;
+
+    switch(item.type) {
+    case SceneItemType::ConstantTexture:
+      textures[i] = new ConstantTexture(vec3(p[0], p[1], p[2]));
+      break;
+    case SceneItemType::CheckerTexture:
+      textures[i] = new CheckerTexture(tex, textures[item.refs[1]]);
+      break;
+    case SceneItemType::NoiseTexture:
+      textures[i] = new NoiseTexture(dist, p[0]);
+      break;
+    case SceneItemType::ImageTexture:
+      textures[i] = new ImageTexture(scene.string(item));
+      break;
+
+    case SceneItemType::Lambertian:
+      materials[i] = new Lambertian(tex);
+      break;
+    case SceneItemType::Metal:
+      materials[i] = new Metal(vec3(p[0], p[1], p[2]), p[3]);
+      break;
+    case SceneItemType::Dielectric:
+      materials[i] = new Dielectric(p[0]);
+      break;
+    case SceneItemType::DiffuseLight:
+      materials[i] = new DiffuseLight(tex);
+      break;
+    case SceneItemType::Isotropic:
+      materials[i] = new Isotropic(tex);
+      break;
+
+    case SceneItemType::Sphere:
+      shapes[i] = new Sphere(vec3(p[0], p[1], p[2]), p[3], mat);
+      break;
+    case SceneItemType::MovingSphere:
+      shapes[i] = new MovingSphere(vec3(p[0], p[1], p[2]), vec3(p[3], p[4], p[5]), p[6], p[7], p[8], mat);
+      break;
+    case SceneItemType::XYRect:
+      shapes[i] = new XYRect(p[0], p[1], p[2], p[3], p[4], mat);
+      break;
+    case SceneItemType::XZRect:
+      shapes[i] = new XZRect(p[0], p[1], p[2], p[3], p[4], mat);
+      break;
+    case SceneItemType::YZRect:
+      shapes[i] = new YZRect(p[0], p[1], p[2], p[3], p[4], mat);
+      break;
+    case SceneItemType::Box:
+      shapes[i] = new Box(vec3(p[0], p[1], p[2]), vec3(p[3], p[4], p[5]), mat);
+      break;
+    case SceneItemType::Mesh:
+      if(item.mesh >= 0) {
+	shapes[i] = new TriangleHitable(scene.meshes[item.mesh], mat);
+      } else {
+	shapes[i] = new TriangleHitable(scene.string(item), mat);
+      }
+      break;
+
+    case SceneItemType::FlipNormals:
+      shapes[i] = new FlipNormals(shape);
+      break;
+    case SceneItemType::Translate:
+      shapes[i] = new Translate(shape, vec3(p[0], p[1], p[2]));
+      break;
+    case SceneItemType::Rotate:
+      shapes[i] = new Rotate(shape, vec3(p[0], p[1], p[2]));
+      break;
+    case SceneItemType::Medium:
+      shapes[i] = new ConstantMedium(shape, p[0], textures[item.refs[1]]);
+      break;
+    case SceneItemType::List:
+    case SceneItemType::BVH: {
+      // Both keep the array, and BVHNode reorders it
+      Hitable** list = new Hitable*[item.num_children];
+      for(unsigned int c = 0; c < item.num_children; c++) {
+	list[c] = shapes[scene.children[item.first_child + c]];
+      }
+      if(item.type == SceneItemType::List) {
+	shapes[i] = new HitableList(list, item.num_children);
+      } else {
+	shapes[i] = new BVHNode(list, item.num_children, 0.0f, 1.0f, dist);
+      }
+      break;
+    }
+    }
+  }
+
+  return shapes[scene.world];
+}
+
+#endif // INCLUDE_SCENEBUILDER_HPP
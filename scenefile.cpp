@@ -0,0 +1,505 @@
+#include "scenefile.hpp"
+#include "trace.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+
+const char SCENE_MAGIC[4] = {'W', 'R', 'S', 'C'};
+const uint32_t SCENE_VERSION = 1;
+
+struct CompiledSceneHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t num_items, num_children, strings_size, num_meshes;
+  int32_t world;
+  uint32_t has_camera;
+  float camera[12];
+};
+
+struct CompiledMeshHeader {
+  uint32_t num_vertices, num_indices, num_nodes, num_leaf_inds;
+};
+
+enum class ItemKind {
+  Texture, Material, Shape
+};
+
+// Arguments after the type: f a number, t a texture, m a material, s a
+// shape, S a file name and * any number of shapes
+struct ItemSyntax {
+  const char* keyword;
+  ItemKind kind;
+  SceneItemType type;
+  const char* arguments;
+};
+
+static const ItemSyntax ITEM_SYNTAX[] = {
+  {"constant", ItemKind::Texture, SceneItemType::ConstantTexture, "fff"},
+  {"checker", ItemKind::Texture, SceneItemType::CheckerTexture, "tt"},
+  {"noise", ItemKind::Texture, SceneItemType::NoiseTexture, "f"},
+  {"image", ItemKind::Texture, SceneItemType::ImageTexture, "S"},
+  {"lambertian", ItemKind::Material, SceneItemType::Lambertian, "t"},
+  {"metal", ItemKind::Material, SceneItemType::Metal, "ffff"},
+  {"dielectric", ItemKind::Material, SceneItemType::Dielectric, "f"},
+  {"diffuse_light", ItemKind::Material, SceneItemType::DiffuseLight, "t"},
+  {"isotropic", ItemKind::Material, SceneItemType::Isotropic, "t"},
+  {"sphere", ItemKind::Shape, SceneItemType::Sphere, "ffffm"},
+  {"moving_sphere", ItemKind::Shape, SceneItemType::MovingSphere, "fffffffffm"},
+  {"xy_rect", ItemKind::Shape, SceneItemType::XYRect, "fffffm"},
+  {"xz_rect", ItemKind::Shape, SceneItemType::XZRect, "fffffm"},
+  {"yz_rect", ItemKind::Shape, SceneItemType::YZRect, "fffffm"},
+  {"box", ItemKind::Shape, SceneItemType::Box, "ffffffm"},
+  {"mesh", ItemKind::Shape, SceneItemType::Mesh, "Sm"},
+  {"flip_normals", ItemKind::Shape, SceneItemType::FlipNormals, "s"},
+  {"translate", ItemKind::Shape, SceneItemType::Translate, "sfff"},
+  {"rotate", ItemKind::Shape, SceneItemType::Rotate, "sfff"},
+  {"medium", ItemKind::Shape, SceneItemType::Medium, "sft"},
+  {"list", ItemKind::Shape, SceneItemType::List, "*"},
+  {"bvh", ItemKind::Shape, SceneItemType::BVH, "*"},
+};
+
+static const char* KIND_NAMES[] = {"texture", "material", "shape"};
+
+class SceneParser {
+public:
+  SceneParser(const std::string& file_name, SceneDescription& scene) : file_name(file_name), scene(scene) { }
+
+  void parse_line(const std::string& line, int line_number);
+
+private:
+  void fail(const std::string& message) const {
+    std::cerr << this->file_name << ":" << this->line_number << ": " << message << std::endl;
+    exit(-1);
+  }
+
+  std::string next_token(std::istringstream& in, const char* what) const {
+    std::string token;
+    if(!(in >> token)) {
+      this->fail(std::string("expected ") + what);
+    }
+    return token;
+  }
+
+  float next_float(std::istringstream& in) const {
+    std::string token = this->next_token(in, "a number");
+    char* end;
+    float v = strtof(token.c_str(), &end);
+    if(*end) {
+      this->fail("expected a number, got " + token);
+    }
+    return v;
+  }
+
+  int32_t lookup(const std::string& name, ItemKind kind) const {
+    std::map<std::string, int32_t>::const_iterator it = this->names[int(kind)].find(name);
+    if(it == this->names[int(kind)].end()) {
+      this->fail(std::string("no ") + KIND_NAMES[int(kind)] + " called " + name);
+    }
+    return it->second;
+  }
+
+  void parse_camera(std::istringstream& in);
+  void parse_item(std::istringstream& in, ItemKind kind);
+
+  std::string file_name;
+  SceneDescription& scene;
+  int line_number = 0;
+  std::map<std::string, int32_t> names[3];
+};
+
+void SceneParser::parse_line(const std::string& line, int line_number) {
+  this->line_number = line_number;
+  std::istringstream in(line.substr(0, line.find('#')));
+  std::string statement;
+  if(!(in >> statement)) {
+    return;
+  }
+
+  if(statement == "camera") {
+    this->parse_camera(in);
+  } else if(statement == "texture") {
+    this->parse_item(in, ItemKind::Texture);
+  } else if(statement == "material") {
+    this->parse_item(in, ItemKind::Material);
+  } else if(statement == "shape") {
+    this->parse_item(in, ItemKind::Shape);
+  } else if(statement == "world") {
+    this->scene.world = this->lookup(this->next_token(in, "a shape"), ItemKind::Shape);
+  } else {
+    this->fail("unknown statement " + statement);
+  }
+
+  std::string extra;
+  if(in >> extra) {
+    this->fail("unexpected " + extra);
+  }
+}
+
+void SceneParser::parse_camera(std::istringstream& in) {
+  SceneCamera& camera = this->scene.camera;
+  camera.set = true;
+  bool has_lookfrom = false, has_lookat = false;
+  std::string key;
+  while(in >> key) {
+    if(key == "lookfrom" || key == "lookat" || key == "vup") {
+      float* v = key == "lookfrom" ? camera.lookfrom : key == "lookat" ? camera.lookat : camera.vup;
+      for(int i = 0; i < 3; i++) {
+	v[i] = this->next_float(in);
+      }
+      has_lookfrom |= key == "lookfrom";
+      has_lookat |= key == "lookat";
+    } else if(key == "vfov") {
+      camera.vfov = this->next_float(in);
+    } else if(key == "aperture") {
+      camera.aperture = this->next_float(in);
+    } else if(key == "focus_dist") {
+      camera.focus_dist = this->next_float(in);
+    } else {
+      this->fail("unknown camera setting " + key);
+    }
+  }
+
+  if(!has_lookfrom || !has_lookat) {
+    this->fail("camera needs lookfrom and lookat");
+  }
+}
+
+void SceneParser::parse_item(std::istringstream& in, ItemKind kind) {
+  std::string name = this->next_token(in, "a name");
+  std::string keyword = this->next_token(in, "a type");
+
+  const ItemSyntax* syntax = nullptr;
+  for(const ItemSyntax& s : ITEM_SYNTAX) {
+    if(s.kind == kind && keyword == s.keyword) {
+      syntax = &s;
+    }
+  }
+  if(!syntax) {
+    this->fail(std::string("unknown ") + KIND_NAMES[int(kind)] + " type " + keyword);
+  }
+
+  SceneItem item;
+  memset(&item, 0, sizeof(item));
+  item.type = syntax->type;
+  item.refs[0] = item.refs[1] = -1;
+  item.string = item.mesh = -1;
+
+  int num_params = 0, num_refs = 0;
+  for(const char* a = syntax->arguments; *a; a++) {
+    switch(*a) {
+    case 'f':
+      item.params[num_params++] = this->next_float(in);
+      break;
+    case 't':
+      item.refs[num_refs++] = this->lookup(this->next_token(in, "a texture"), ItemKind::Texture);
+      break;
+    case 'm':
+      item.refs[num_refs++] = this->lookup(this->next_token(in, "a material"), ItemKind::Material);
+      break;
+    case 's':
+      item.refs[num_refs++] = this->lookup(this->next_token(in, "a shape"), ItemKind::Shape);
+      break;
+    case 'S': {
+      std::string file = this->next_token(in, "a file name");
+      item.string = this->scene.strings.size();
+      this->scene.strings.insert(this->scene.strings.end(), file.begin(), file.end());
+      this->scene.strings.push_back('\0');
+      break;
+    }
+    case '*': {
+      item.first_child = this->scene.children.size();
+      std::string child;
+      while(in >> child) {
+	this->scene.children.push_back(this->lookup(child, ItemKind::Shape));
+      }
+      item.num_children = this->scene.children.size() - item.first_child;
+      if(item.num_children == 0) {
+	this->fail(keyword + " needs at least one shape");
+      }
+      break;
+    }
+    }
+  }
+
+  this->names[int(kind)][name] = this->scene.items.size();
+  this->scene.items.push_back(item);
+}
+
+void parse_scene(const std::string& file_name, SceneDescription& scene) {
+  TraceSpan span("parse scene file");
+  std::ifstream file(file_name);
+  if(!file) {
+    std::cerr << "Cannot open scene file " << file_name << std::endl;
+    exit(-1);
+  }
+
+  scene = SceneDescription();
+  SceneParser parser(file_name, scene);
+  std::string line;
+  for(int line_number = 1; std::getline(file, line); line_number++) {
+    parser.parse_line(line, line_number);
+  }
+
+  if(scene.world < 0) {
+    std::cerr << file_name << ": no world given" << std::endl;
+    exit(-1);
+  }
+}
+
+void load_meshes(SceneDescription& scene) {
+  scene.meshes.clear();
+  for(SceneItem& item : scene.items) {
+    if(item.type == SceneItemType::Mesh) {
+      TriangleHitable mesh(scene.string(item), nullptr);
+      item.mesh = scene.meshes.size();
+      scene.meshes.push_back(MeshData());
+      mesh.export_mesh(scene.meshes.back());
+    }
+  }
+}
+
+bool is_compiled_scene(const std::string& file_name) {
+  std::ifstream file(file_name, std::ios::binary);
+  char magic[4];
+  return file.read(magic, 4) && memcmp(magic, SCENE_MAGIC, 4) == 0;
+}
+
+template<typename T>
+static void write_array(std::ofstream& file, const std::vector<T>& v) {
+  file.write((const char*)v.data(), v.size() * sizeof(T));
+}
+
+static void compiled_scene_error(const std::string& file_name, const std::string& message) {
+  std::cerr << file_name << ": " << message << std::endl;
+  exit(-1);
+}
+
+// Checks the count against what is left of the file before allocating, so a
+// corrupt count cannot ask for more memory than the file could hold
+template<typename T>
+static void read_array(std::ifstream& file, const std::string& file_name, uint64_t file_size,
+		       std::vector<T>& v, uint64_t n) {
+  if(!file || n * sizeof(T) > file_size - uint64_t(file.tellg())) {
+    compiled_scene_error(file_name, "file is truncated");
+  }
+  v.resize(n);
+  file.read((char*)v.data(), n * sizeof(T));
+}
+
+void write_compiled_scene(const std::string& file_name, const SceneDescription& scene) {
+  std::ofstream file(file_name, std::ios::binary);
+  if(!file) {
+    std::cerr << "Cannot open " << file_name << " for writing" << std::endl;
+    exit(-1);
+  }
+
+  CompiledSceneHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SCENE_MAGIC, 4);
+  header.version = SCENE_VERSION;
+  header.num_items = scene.items.size();
+  header.num_children = scene.children.size();
+  header.strings_size = scene.strings.size();
+  header.num_meshes = scene.meshes.size();
+  header.world = scene.world;
+  header.has_camera = scene.camera.set;
+  memcpy(header.camera + 0, scene.camera.lookfrom, 3 * sizeof(float));
+  memcpy(header.camera + 3, scene.camera.lookat, 3 * sizeof(float));
+  memcpy(header.camera + 6, scene.camera.vup, 3 * sizeof(float));
+  header.camera[9] = scene.camera.vfov;
+  header.camera[10] = scene.camera.aperture;
+  header.camera[11] = scene.camera.focus_dist;
+  file.write((const char*)&header, sizeof(header));
+
+  write_array(file, scene.items);
+  write_array(file, scene.children);
+  write_array(file, scene.strings);
+  for(const MeshData& mesh : scene.meshes) {
+    CompiledMeshHeader mesh_header;
+    mesh_header.num_vertices = mesh.vertices.size() / 3;
+    mesh_header.num_indices = mesh.indices.size();
+    mesh_header.num_nodes = mesh.nodes.size();
+    mesh_header.num_leaf_inds = mesh.leaf_inds.size();
+    file.write((const char*)&mesh_header, sizeof(mesh_header));
+
+    write_array(file, mesh.vertices);
+    write_array(file, mesh.normals);
+    write_array(file, mesh.uvs);
+    write_array(file, mesh.indices);
+    write_array(file, mesh.nodes);
+    write_array(file, mesh.leaf_inds);
+  }
+
+  if(!file) {
+    std::cerr << "Could not write " << file_name << std::endl;
+    exit(-1);
+  }
+}
+
+static const ItemSyntax* find_syntax(SceneItemType type) {
+  for(const ItemSyntax& s : ITEM_SYNTAX) {
+    if(s.type == type) {
+      return &s;
+    }
+  }
+  return nullptr;
+}
+
+// True if ref is an item of the given kind that comes before item, as
+// build_scene builds the items in order
+static bool refers_to(const SceneDescription& scene, int32_t ref, unsigned int item, ItemKind kind) {
+  return ref >= 0 && uint32_t(ref) < item && find_syntax(scene.items[ref].type)->kind == kind;
+}
+
+static void validate_mesh(const std::string& file_name, const MeshData& mesh, unsigned int index) {
+  std::string what = "mesh " + std::to_string(index);
+  int64_t num_vertices = mesh.vertices.size() / 3;
+  if(mesh.indices.size() % 3) {
+    compiled_scene_error(file_name, what + " has a partial triangle");
+  }
+  for(int32_t v : mesh.indices) {
+    if(v < 0 || v >= num_vertices) {
+      compiled_scene_error(file_name, what + " has a triangle with a missing vertex");
+    }
+  }
+
+  int64_t num_triangles = mesh.indices.size() / 3;
+  if(mesh.nodes.empty()) {
+    compiled_scene_error(file_name, what + " has no BVH");
+  }
+  for(unsigned int i = 0; i < mesh.nodes.size(); i++) {
+    // Nodes are written before their children, so pointing forward rules out cycles
+    const FlatBVHNode& node = mesh.nodes[i];
+    for(int32_t child : {node.left, node.right}) {
+      if(child != -1 && (child <= int64_t(i) || child >= int64_t(mesh.nodes.size()))) {
+	compiled_scene_error(file_name, what + " has a BVH node with a missing child");
+      }
+    }
+    if(node.first_ind < 0 || node.num_inds < 0 ||
+       int64_t(node.first_ind) + node.num_inds > int64_t(mesh.leaf_inds.size())) {
+      compiled_scene_error(file_name, what + " has a BVH leaf outside its triangle list");
+    }
+  }
+  for(int32_t t : mesh.leaf_inds) {
+    if(t < 0 || t >= num_triangles) {
+      compiled_scene_error(file_name, what + " has a BVH leaf with a missing triangle");
+    }
+  }
+}
+
+// Checks everything build_scene and TriangleHitable index by, so a corrupt file
+// is refused instead of crashing the build
+static void validate_compiled_scene(const std::string& file_name, const SceneDescription& scene) {
+  for(unsigned int i = 0; i < scene.items.size(); i++) {
+    const SceneItem& item = scene.items[i];
+    std::string what = "item " + std::to_string(i);
+    const ItemSyntax* syntax = find_syntax(item.type);
+    if(!syntax) {
+      compiled_scene_error(file_name, what + " has an unknown type");
+    }
+
+    int num_refs = 0;
+    bool needs_string = false, has_children = false;
+    for(const char* a = syntax->arguments; *a; a++) {
+      ItemKind kind = *a == 't' ? ItemKind::Texture : *a == 'm' ? ItemKind::Material : ItemKind::Shape;
+      if(*a == 't' || *a == 'm' || *a == 's') {
+	if(!refers_to(scene, item.refs[num_refs], i, kind)) {
+	  compiled_scene_error(file_name, what + " needs an earlier " + KIND_NAMES[int(kind)]);
+	}
+	num_refs++;
+      }
+      needs_string |= *a == 'S';
+      has_children |= *a == '*';
+    }
+    // build_scene looks up the first ref of every item, used or not
+    for(int r = num_refs; r < 2; r++) {
+      if(item.refs[r] != -1) {
+	compiled_scene_error(file_name, what + " has a ref it does not take");
+      }
+    }
+
+    if(has_children) {
+      if(item.num_children == 0 || uint64_t(item.first_child) + item.num_children > scene.children.size()) {
+	compiled_scene_error(file_name, what + " has children outside the child list");
+      }
+      for(unsigned int c = 0; c < item.num_children; c++) {
+	if(!refers_to(scene, scene.children[item.first_child + c], i, ItemKind::Shape)) {
+	  compiled_scene_error(file_name, what + " has a child that is not an earlier shape");
+	}
+      }
+    }
+
+    if(item.string != -1 &&
+       (item.string < 0 || uint32_t(item.string) >= scene.strings.size() ||
+	!memchr(&scene.strings[item.string], '\0', scene.strings.size() - item.string))) {
+      compiled_scene_error(file_name, what + " has a name outside the string table");
+    }
+    if(item.mesh != -1 &&
+       (item.type != SceneItemType::Mesh || item.mesh < 0 || uint32_t(item.mesh) >= scene.meshes.size())) {
+      compiled_scene_error(file_name, what + " refers to a missing mesh");
+    }
+    if(needs_string && item.string == -1 && item.mesh == -1) {
+      compiled_scene_error(file_name, what + " needs a file name");
+    }
+  }
+
+  if(!refers_to(scene, scene.world, scene.items.size(), ItemKind::Shape)) {
+    compiled_scene_error(file_name, "the world is not a shape");
+  }
+  for(unsigned int i = 0; i < scene.meshes.size(); i++) {
+    validate_mesh(file_name, scene.meshes[i], i);
+  }
+}
+
+void read_compiled_scene(const std::string& file_name, SceneDescription& scene) {
+  TraceSpan span("read compiled scene");
+  std::ifstream file(file_name, std::ios::binary);
+  CompiledSceneHeader header;
+  if(!file.read((char*)&header, sizeof(header)) || memcmp(header.magic, SCENE_MAGIC, 4) ||
+     header.version != SCENE_VERSION) {
+    std::cerr << file_name << " is not a compiled scene of this version" << std::endl;
+    exit(-1);
+  }
+
+  scene = SceneDescription();
+  scene.world = header.world;
+  scene.camera.set = header.has_camera;
+  memcpy(scene.camera.lookfrom, header.camera + 0, 3 * sizeof(float));
+  memcpy(scene.camera.lookat, header.camera + 3, 3 * sizeof(float));
+  memcpy(scene.camera.vup, header.camera + 6, 3 * sizeof(float));
+  scene.camera.vfov = header.camera[9];
+  scene.camera.aperture = header.camera[10];
+  scene.camera.focus_dist = header.camera[11];
+
+  file.seekg(0, std::ios::end);
+  uint64_t file_size = file.tellg();
+  file.seekg(sizeof(header));
+
+  read_array(file, file_name, file_size, scene.items, header.num_items);
+  read_array(file, file_name, file_size, scene.children, header.num_children);
+  read_array(file, file_name, file_size, scene.strings, header.strings_size);
+  // Each mesh takes at least its header
+  if(!file || uint64_t(header.num_meshes) * sizeof(CompiledMeshHeader) > file_size - uint64_t(file.tellg())) {
+    compiled_scene_error(file_name, "file is truncated");
+  }
+  scene.meshes.resize(header.num_meshes);
+  for(MeshData& mesh : scene.meshes) {
+    CompiledMeshHeader mesh_header;
+    file.read((char*)&mesh_header, sizeof(mesh_header));
+    read_array(file, file_name, file_size, mesh.vertices, 3 * uint64_t(mesh_header.num_vertices));
+    read_array(file, file_name, file_size, mesh.normals, 3 * uint64_t(mesh_header.num_vertices));
+    read_array(file, file_name, file_size, mesh.uvs, 2 * uint64_t(mesh_header.num_vertices));
+    read_array(file, file_name, file_size, mesh.indices, mesh_header.num_indices);
+    read_array(file, file_name, file_size, mesh.nodes, mesh_header.num_nodes);
+    read_array(file, file_name, file_size, mesh.leaf_inds, mesh_header.num_leaf_inds);
+  }
+
+  if(!file) {
+    compiled_scene_error(file_name, "file is truncated");
+  }
+  validate_compiled_scene(file_name, scene);
+}
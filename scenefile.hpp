@@ -0,0 +1,87 @@
+#ifndef INCLUDE_SCENEFILE_HPP
+#define INCLUDE_SCENEFILE_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "triangles.hpp"
+
+// Scene files describe textures, materials and shapes, one per line, each
+// given a name that later lines refer to. Text after # is ignored.
+//
+//   camera lookfrom X Y Z lookat X Y Z [vup X Y Z] vfov DEG [aperture D] [focus_dist D]
+//   texture NAME constant R G B | checker EVEN ODD | noise SCALE | image FILE
+//   material NAME lambertian TEX | metal R G B FUZZ | dielectric IOR
+//                 | diffuse_light TEX | isotropic TEX
+//   shape NAME sphere X Y Z RADIUS MAT
+//              | moving_sphere X0 Y0 Z0 X1 Y1 Z1 T0 T1 RADIUS MAT
+//              | xy_rect X0 X1 Y0 Y1 Z MAT | xz_rect X0 X1 Z0 Z1 Y MAT
+//              | yz_rect Y0 Y1 Z0 Z1 X MAT | box X0 Y0 Z0 X1 Y1 Z1 MAT
+//              | mesh OBJ_FILE MAT | flip_normals SHAPE
+//              | translate SHAPE DX DY DZ | rotate SHAPE AX AY AZ
+//              | medium SHAPE DENSITY TEX | list SHAPE... | bvh SHAPE...
+//   world SHAPE
+//
+// A scene can be compiled into a binary file holding the same items, with
+// meshes already loaded and their BVHs built, so loading it is a handful of
+// reads.
+
+enum class SceneItemType : uint32_t {
+  ConstantTexture, CheckerTexture, NoiseTexture, ImageTexture,
+  Lambertian, Metal, Dielectric, DiffuseLight, Isotropic,
+  Sphere, MovingSphere, XYRect, XZRect, YZRect, Box, Mesh,
+  FlipNormals, Translate, Rotate, Medium, List, BVH
+};
+
+const int SCENE_ITEM_PARAMS = 10;
+
+// One line of a scene file. Items only refer to items before them
+struct SceneItem {
+  SceneItemType type;
+  // Textures, materials and shapes used, in the order they are written
+  int32_t refs[2];
+  // Children of lists and BVHs, a range of SceneDescription::children
+  uint32_t first_child, num_children;
+  // Offset of the file name in SceneDescription::strings, -1 if there is none
+  int32_t string;
+  // Index into SceneDescription::meshes, -1 if not a mesh
+  int32_t mesh;
+  float params[SCENE_ITEM_PARAMS];
+};
+
+struct SceneCamera {
+  bool set = false;
+  float lookfrom[3], lookat[3], vup[3] = {0.0f, 1.0f, 0.0f};
+  float vfov = 40.0f, aperture = 0.0f;
+  // 0 focuses on lookat
+  float focus_dist = 0.0f;
+};
+
+struct SceneDescription {
+  std::vector<SceneItem> items;
+  std::vector<int32_t> children;
+  std::vector<char> strings;
+  // Filled for compiled scenes, and by load_meshes()
+  std::vector<MeshData> meshes;
+  int32_t world = -1;
+  SceneCamera camera;
+
+  const char* string(const SceneItem& item) const {
+    return &this->strings[item.string];
+  }
+};
+
+// True if file_name starts like a compiled scene
+bool is_compiled_scene(const std::string& file_name);
+
+// Both exit with a message if the file cannot be read or is not valid
+void parse_scene(const std::string& file_name, SceneDescription& scene);
+void read_compiled_scene(const std::string& file_name, SceneDescription& scene);
+
+// Loads the mesh items of a parsed scene and builds their BVHs, so the scene can be compiled
+void load_meshes(SceneDescription& scene);
+
+void write_compiled_scene(const std::string& file_name, const SceneDescription& scene);
+
+#endif // INCLUDE_SCENEFILE_HPP
@@ -0,0 +1,123 @@
+#include "scheduler.hpp"
+
+#include <algorithm>
+
+// Position of the d-th point of the Hilbert curve filling an n x n grid, n a power of two
+static void hilbert_point(int n, int d, int& x, int& y) {
+  x = y = 0;
+  for(int s = 1; s < n; s *= 2) {
+    int rx = 1 & (d / 2);
+    int ry = 1 & (d ^ rx);
+    if(ry == 0) {
+      if(rx == 1) {
+	x = s - 1 - x;
+	y = s - 1 - y;
+      }
+      std::swap(x, y);
+    }
+    x += s * rx;
+    y += s * ry;
+    d /= 4;
+  }
+}
+
+std::vector<Tile> make_tiles(int width, int height, int tile_size) {
+  int tiles_x = (width + tile_size - 1) / tile_size;
+  int tiles_y = (height + tile_size - 1) / tile_size;
+
+  int n = 1;
+  while(n < tiles_x || n < tiles_y) {
+    n *= 2;
+  }
+
+  // Walk the curve over the enclosing power-of-two grid, skipping points outside the image
+  std::vector<Tile> tiles;
+  for(int d = 0; d < n * n; d++) {
+    int tx, ty;
+    hilbert_point(n, d, tx, ty);
+    if(tx >= tiles_x || ty >= tiles_y) {
+      continue;
+    }
+
+    Tile tile;
+    tile.x0 = tx * tile_size;
+    tile.y0 = ty * tile_size;
+    tile.x1 = std::min(width, tile.x0 + tile_size);
+    tile.y1 = std::min(height, tile.y0 + tile_size);
+    tiles.push_back(tile);
+  }
+  return tiles;
+}
+
+TileScheduler::TileScheduler(int num_threads) : queues(num_threads), total(0) {
+  for(Queue& q : this->queues) {
+    pthread_mutex_init(&q.lock, NULL);
+  }
+}
+
+TileScheduler::~TileScheduler() {
+  for(Queue& q : this->queues) {
+    pthread_mutex_destroy(&q.lock);
+  }
+}
+
+void TileScheduler::reset(const std::vector<Tile>& tiles, bool interleave) {
+  int num_threads = this->queues.size();
+  this->total = tiles.size();
+  if(interleave) {
+    for(Queue& q : this->queues) {
+      q.tiles.clear();
+    }
+    for(unsigned int i = 0; i < tiles.size(); i++) {
+      this->queues[i % num_threads].tiles.push_back(tiles[i]);
+    }
+    return;
+  }
+
+  for(int i = 0; i < num_threads; i++) {
+    int begin = long(tiles.size()) * i / num_threads;
+    int end = long(tiles.size()) * (i + 1) / num_threads;
+    this->queues[i].tiles.assign(tiles.begin() + begin, tiles.begin() + end);
+  }
+}
+
+bool TileScheduler::pop_front(int thread, Tile& tile) {
+  Queue& q = this->queues[thread];
+  pthread_mutex_lock(&q.lock);
+  bool found = !q.tiles.empty();
+  if(found) {
+    tile = q.tiles.front();
+    q.tiles.pop_front();
+  }
+  pthread_mutex_unlock(&q.lock);
+  return found;
+}
+
+bool TileScheduler::pop_back(int thread, Tile& tile) {
+  Queue& q = this->queues[thread];
+  pthread_mutex_lock(&q.lock);
+  bool found = !q.tiles.empty();
+  if(found) {
+    tile = q.tiles.back();
+    q.tiles.pop_back();
+  }
+  pthread_mutex_unlock(&q.lock);
+  return found;
+}
+
+bool TileScheduler::next(int thread, Tile& tile, bool& stolen) {
+  stolen = false;
+  if(this->pop_front(thread, tile)) {
+    return true;
+  }
+
+  // Tiles are never added during a pass, so one sweep that finds every deque empty means we are done
+  int num_threads = this->queues.size();
+  for(int i = 1; i < num_threads; i++) {
+    if(this->pop_back((thread + i) % num_threads, tile)) {
+      stolen = true;
+      return true;
+    }
+  }
+  return false;
+}
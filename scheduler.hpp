@@ -0,0 +1,51 @@
+#ifndef INCLUDE_SCHEDULER_HPP
+#define INCLUDE_SCHEDULER_HPP
+
+#include <deque>
+#include <vector>
+
+#include <pthread.h>
+
+// Pixels [x0, x1) x [y0, y1)
+struct Tile {
+  int x0, y0, x1, y1;
+};
+
+// Square tiles of tile_size pixels covering the image, in the order of a
+// Hilbert curve over the tile grid, so consecutive tiles are neighbours
+std::vector<Tile> make_tiles(int width, int height, int tile_size);
+
+// Hands out tiles to a fixed set of threads. Each thread gets its own deque,
+// filled with a contiguous run of the tiles it is given, and takes tiles
+// from the front of it. A thread that runs dry steals from the back of the
+// other deques, taking the tiles furthest from where their owner is working.
+// With interleave, the tiles are dealt out in turn instead, so the threads
+// move through the list together
+class TileScheduler {
+public:
+  TileScheduler(int num_threads);
+  ~TileScheduler();
+
+  void reset(const std::vector<Tile>& tiles, bool interleave = false);
+
+  // Returns false when no thread has tiles left
+  bool next(int thread, Tile& tile, bool& stolen);
+
+  int num_tiles() const {
+    return this->total;
+  }
+
+private:
+  struct Queue {
+    pthread_mutex_t lock;
+    std::deque<Tile> tiles;
+  };
+
+  bool pop_front(int thread, Tile& tile);
+  bool pop_back(int thread, Tile& tile);
+
+  std::vector<Queue> queues;
+  int total;
+};
+
+#endif // INCLUDE_SCHEDULER_HPP
@@ -4,13 +4,66 @@
 #include "hitable.hpp"
 #include "material.hpp"
 #include "aabb.hpp"
+#include "counters.hpp"
+
+// Samples the cone of directions the sphere subtends from origin, or its
+// whole surface if origin is inside it
+bool sample_sphere_light(const vec3& center, float radius, Material* mat,
+			 const vec3& origin, Sampler& sampler, light_sample& ls) {
+  vec3 d = center - origin;
+  float dist2 = d.sqNorm();
+  falg::Vec2 u = sampler.get_2d();
+
+  if(dist2 <= radius * radius) {
+    ls.normal = sample_on_unit_sphere(u);
+    ls.p = center + radius * ls.normal;
+    ls.pdf = area_to_solid_angle_pdf(1.0f / (4 * F_PI * radius * radius), origin, ls.p, ls.normal);
+  } else {
+    // 1 - cos(theta_max), written to keep precision for small, distant spheres
+    float sin2_max = radius * radius / dist2;
+    float one_minus_cos_max = sin2_max / (1 + sqrt(1 - sin2_max));
+
+    float cos_theta = 1 - u[0] * one_minus_cos_max;
+    float sin_theta = sqrt(std::max(0.0f, 1 - cos_theta * cos_theta));
+    float phi = 2 * F_PI * u[1];
+    float dist = sqrt(dist2);
+    vec3 dir = local_to_world(vec3(sin_theta * cos(phi), sin_theta * sin(phi), cos_theta), d / dist);
+
+    float b = falg::dot(dir, d);
+    float t = b - sqrt(std::max(0.0f, b * b - (dist2 - radius * radius)));
+    ls.p = origin + t * dir;
+    ls.normal = (ls.p - center) / radius;
+    ls.pdf = 1.0f / (2 * F_PI * one_minus_cos_max);
+  }
+
+  get_sphere_uv(ls.normal, &ls.u, &ls.v);
+  ls.mat_ptr = mat;
+  return ls.pdf > 0;
+}
+
+float sphere_light_pdf(const vec3& center, float radius, const Ray& r, const hit_record& rec) {
+  float dist2 = (center - r.origin()).sqNorm();
+  if(dist2 <= radius * radius) {
+    return area_to_solid_angle_pdf(1.0f / (4 * F_PI * radius * radius), r.origin(), rec.p, rec.normal);
+  }
+  float sin2_max = radius * radius / dist2;
+  float one_minus_cos_max = sin2_max / (1 + sqrt(1 - sin2_max));
+  return 1.0f / (2 * F_PI * one_minus_cos_max);
+}
 
 class Sphere : public Hitable {
 public:
   Sphere() {}
   Sphere(const vec3& cen, float r, Material* mat) : center(cen), radius(r), mat_ptr(mat) {}
-  virtual bool hit(const Ray& r, float tmin, float tmax, hit_record& rec) const;
+  virtual bool hit(const Ray& r, float tmin, float tmax, hit_record& rec, Sampler& sampler) const;
   virtual bool bounding_box(float t0, float t1, Aabb& box) const;
+  virtual void collect_emitters(std::vector<Hitable*>& emitters) {
+    if(is_emissive(mat_ptr)) {
+      emitters.push_back(this);
+    }
+  }
+  virtual bool sample_light(const vec3& origin, float time, Sampler& sampler, light_sample& ls) const;
+  virtual float light_pdf(const Ray& r, float t_max, Sampler& sampler) const;
   vec3 center;
   float radius;
   Material *mat_ptr;
@@ -21,7 +74,8 @@ bool Sphere::bounding_box(float t0, float t1, Aabb& box) const {
   return true;
 }
 
-bool Sphere::hit(const Ray& r, float tmin, float tmax, hit_record& rec) const {
+bool Sphere::hit(const Ray& r, float tmin, float tmax, hit_record& rec, Sampler& sampler) const {
+  COUNT(COUNT_SPHERE_HITS);
   vec3 oc = r.origin() - center;
   float a = falg::dot(r.direction(), r.direction());
   float b = falg::dot(oc, r.direction());
@@ -34,6 +88,7 @@ bool Sphere::hit(const Ray& r, float tmin, float tmax, hit_record& rec) const {
       rec.p = r.point_at_parameter(rec.t);
       rec.normal = (rec.p - center) / radius;
       rec.mat_ptr = this->mat_ptr;
+      rec.hitable = this;
       get_sphere_uv((rec.p - center)/radius, &rec.u, &rec.v);
       return true;
     }
@@ -43,6 +98,7 @@ bool Sphere::hit(const Ray& r, float tmin, float tmax, hit_record& rec) const {
       rec.p = r.point_at_parameter(rec.t);
       rec.normal = (rec.p - center) / radius;
       rec.mat_ptr = this->mat_ptr;
+      rec.hitable = this;
       get_sphere_uv((rec.p - center)/radius, &rec.u, &rec.v);
       return true;
     }
@@ -50,6 +106,18 @@ bool Sphere::hit(const Ray& r, float tmin, float tmax, hit_record& rec) const {
   return false;
 }
 
+bool Sphere::sample_light(const vec3& origin, float time, Sampler& sampler, light_sample& ls) const {
+  return sample_sphere_light(center, radius, mat_ptr, origin, sampler, ls);
+}
+
+float Sphere::light_pdf(const Ray& r, float t_max, Sampler& sampler) const {
+  hit_record rec;
+  if(!this->hit(r, 0.001, t_max, rec, sampler)) {
+    return 0.0f;
+  }
+  return sphere_light_pdf(center, radius, r, rec);
+}
+
 
 class MovingSphere: public Hitable {
 public:
@@ -57,8 +125,15 @@ public:
   MovingSphere(const vec3& cen0, const vec3& cen1, float t0, float t1, float r, Material* mat) :
     center0(cen0), center1(cen1), time0(t0), time1(t1), radius(r), mat_ptr(mat) { }
 
-  virtual bool hit(const Ray& r, float tmin, float tmax, hit_record& rec) const;
+  virtual bool hit(const Ray& r, float tmin, float tmax, hit_record& rec, Sampler& sampler) const;
   virtual bool bounding_box(float t0, float t1, Aabb& box) const;
+  virtual void collect_emitters(std::vector<Hitable*>& emitters) {
+    if(is_emissive(mat_ptr)) {
+      emitters.push_back(this);
+    }
+  }
+  virtual bool sample_light(const vec3& origin, float time, Sampler& sampler, light_sample& ls) const;
+  virtual float light_pdf(const Ray& r, float t_max, Sampler& sampler) const;
   vec3 center(float time) const;
   vec3 center0, center1;
   float time0, time1;
@@ -71,7 +146,8 @@ vec3 MovingSphere::center(float time) const {
   return this->center0 + (time - time0) / (time1 - time0) * (center1 - center0);
 }
 
-bool MovingSphere::hit(const Ray& r, float tmin, float tmax, hit_record& rec) const {
+bool MovingSphere::hit(const Ray& r, float tmin, float tmax, hit_record& rec, Sampler& sampler) const {
+  COUNT(COUNT_MOVING_SPHERE_HITS);
   vec3 curcen = this->center(r.time());
   vec3 oc = r.origin() - curcen;
   float a = falg::dot(r.direction(), r.direction());
@@ -85,6 +161,7 @@ bool MovingSphere::hit(const Ray& r, float tmin, float tmax, hit_record& rec) co
       rec.p = r.point_at_parameter(rec.t);
       rec.normal = (rec.p - curcen) / radius;
       rec.mat_ptr = this->mat_ptr;
+      rec.hitable = this;
       return true;
     }
     temp = (-b + sqrt(b * b - a * c)) / a;
@@ -93,6 +170,7 @@ bool MovingSphere::hit(const Ray& r, float tmin, float tmax, hit_record& rec) co
       rec.p = r.point_at_parameter(rec.t);
       rec.normal = (rec.p - curcen) / radius;
       rec.mat_ptr = this->mat_ptr;
+      rec.hitable = this;
       return true;
     }
   }
@@ -109,4 +187,16 @@ bool MovingSphere::bounding_box(float t0, float t1, Aabb& box) const {
   return true;
 }
 
+bool MovingSphere::sample_light(const vec3& origin, float time, Sampler& sampler, light_sample& ls) const {
+  return sample_sphere_light(this->center(time), radius, mat_ptr, origin, sampler, ls);
+}
+
+float MovingSphere::light_pdf(const Ray& r, float t_max, Sampler& sampler) const {
+  hit_record rec;
+  if(!this->hit(r, 0.001, t_max, rec, sampler)) {
+    return 0.0f;
+  }
+  return sphere_light_pdf(this->center(r.time()), radius, r, rec);
+}
+
 #endif // ndef INCLUDE_SPHERE_HPP
@@ -3,6 +3,7 @@
 
 #include "ray.hpp"
 #include "perlin.hpp"
+#include "trace.hpp"
 
 #include "OpenImageIO/imageio.h"
 
@@ -67,6 +68,7 @@ public:
   ImageTexture() {}
   ImageTexture(float *pixels, int a, int b) : data(pixels), nx(a), ny(b), nchannels(3) {}
   ImageTexture(const std::string& image_file) {
+    TraceSpan span("load image texture");
     std::unique_ptr<OpenImageIO::ImageInput> imin = OpenImageIO::ImageInput::open(image_file);
     if(!imin) {
       std::cerr << "Could not open image file " << image_file << ", exiting" << std::endl;
@@ -0,0 +1,259 @@
+#include "threadpool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+
+#include <dirent.h>
+#include <sched.h>
+#include <unistd.h>
+
+static thread_local int current_index = 0;
+static thread_local bool in_job = false;
+static thread_local bool serial_only = false;
+
+struct CpuTopology {
+  int cpu;
+  int package;
+  int core;
+  int node;
+  // 0 for the first logical CPU of a physical core, 1 for its SMT sibling, ...
+  int smt_rank;
+};
+
+static int read_int(const std::string& path, int fallback) {
+  std::ifstream file(path);
+  int value;
+  if(file >> value) {
+    return value;
+  }
+  return fallback;
+}
+
+// Linux lists a CPU's NUMA node as a nodeN entry in its sysfs directory
+static int cpu_node(int cpu) {
+  DIR* dir = opendir(("/sys/devices/system/cpu/cpu" + std::to_string(cpu)).c_str());
+  if(!dir) {
+    return 0;
+  }
+
+  int node = 0;
+  while(dirent* entry = readdir(dir)) {
+    if(strncmp(entry->d_name, "node", 4) == 0 && isdigit(entry->d_name[4])) {
+      node = atoi(entry->d_name + 4);
+      break;
+    }
+  }
+  closedir(dir);
+  return node;
+}
+
+// The logical CPUs the process may run on, in the order threads are pinned
+static std::vector<CpuTopology> usable_cpus() {
+  std::vector<int> ids;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if(sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for(int c = 0; c < CPU_SETSIZE; c++) {
+      if(CPU_ISSET(c, &set)) {
+	ids.push_back(c);
+      }
+    }
+  }
+  if(ids.empty()) {
+    for(int c = 0; c < std::max(1L, sysconf(_SC_NPROCESSORS_ONLN)); c++) {
+      ids.push_back(c);
+    }
+  }
+
+  std::vector<CpuTopology> cpus;
+  std::map<std::pair<int, int>, int> seen_cores;
+  for(int id : ids) {
+    std::string topology = "/sys/devices/system/cpu/cpu" + std::to_string(id) + "/topology/";
+    CpuTopology cpu;
+    cpu.cpu = id;
+    cpu.package = read_int(topology + "physical_package_id", 0);
+    cpu.core = read_int(topology + "core_id", id);
+    cpu.node = cpu_node(id);
+    cpu.smt_rank = seen_cores[std::make_pair(cpu.package, cpu.core)]++;
+    cpus.push_back(cpu);
+  }
+
+  std::stable_sort(cpus.begin(), cpus.end(), [](const CpuTopology& a, const CpuTopology& b) {
+      if(a.smt_rank != b.smt_rank) {
+	return a.smt_rank < b.smt_rank;
+      }
+      return a.node < b.node;
+    });
+  return cpus;
+}
+
+struct WorkerStart {
+  ThreadPool *pool;
+  int index;
+};
+
+ThreadPool::ThreadPool(int num_threads, bool pin_threads) : node_count(1), pinned(pin_threads),
+							    job(nullptr), generation(0), running(0),
+							    stopping(false) {
+  std::vector<CpuTopology> cpus = usable_cpus();
+  this->num_threads = num_threads > 0 ? num_threads : cpus.size();
+
+  // Node numbers can have gaps, threads get them renumbered from 0
+  std::map<int, int> node_numbers;
+  for(int i = 0; i < this->num_threads; i++) {
+    const CpuTopology& cpu = cpus[i % cpus.size()];
+    int node = 0;
+    if(pin_threads) {
+      if(!node_numbers.count(cpu.node)) {
+	int number = node_numbers.size();
+	node_numbers[cpu.node] = number;
+      }
+      node = node_numbers[cpu.node];
+    }
+    this->thread_cpus.push_back(cpu.cpu);
+    this->thread_nodes.push_back(node);
+  }
+  this->node_count = std::max(1, int(node_numbers.size()));
+
+  pthread_mutex_init(&this->lock, NULL);
+  pthread_cond_init(&this->wake, NULL);
+  pthread_cond_init(&this->finished, NULL);
+
+  if(this->pinned) {
+    this->pin(0);
+  }
+
+  this->threads.resize(this->num_threads);
+  for(int i = 1; i < this->num_threads; i++) {
+    WorkerStart *start = new WorkerStart;
+    start->pool = this;
+    start->index = i;
+    if(pthread_create(&this->threads[i], NULL, worker_main, start)) {
+      std::cerr << "Could not create thread for some reason" << std::endl;
+      exit(-1);
+    }
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  pthread_mutex_lock(&this->lock);
+  this->stopping = true;
+  pthread_cond_broadcast(&this->wake);
+  pthread_mutex_unlock(&this->lock);
+
+  for(int i = 1; i < this->num_threads; i++) {
+    pthread_join(this->threads[i], NULL);
+  }
+
+  pthread_mutex_destroy(&this->lock);
+  pthread_cond_destroy(&this->wake);
+  pthread_cond_destroy(&this->finished);
+}
+
+void ThreadPool::pin(int thread) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(this->thread_cpus[thread], &set);
+  if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+    std::cerr << "Could not pin thread " << thread << " to CPU " << this->thread_cpus[thread] << std::endl;
+  }
+}
+
+void* ThreadPool::worker_main(void* data) {
+  WorkerStart start = *(WorkerStart*)data;
+  delete (WorkerStart*)data;
+  ThreadPool *pool = start.pool;
+
+  current_index = start.index;
+  if(pool->pinned) {
+    pool->pin(start.index);
+  }
+
+  long seen = 0;
+  while(true) {
+    pthread_mutex_lock(&pool->lock);
+    while(pool->generation == seen && !pool->stopping) {
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    }
+    if(pool->stopping) {
+      pthread_mutex_unlock(&pool->lock);
+      break;
+    }
+    seen = pool->generation;
+    const std::function<void(int)>* job = pool->job;
+    pthread_mutex_unlock(&pool->lock);
+
+    in_job = true;
+    (*job)(start.index);
+    in_job = false;
+
+    pthread_mutex_lock(&pool->lock);
+    if(--pool->running == 0) {
+      pthread_cond_signal(&pool->finished);
+    }
+    pthread_mutex_unlock(&pool->lock);
+  }
+
+  return NULL;
+}
+
+void ThreadPool::run(const std::function<void(int)>& fn) {
+  if(in_job) {
+    std::cerr << "ThreadPool::run called from inside a pool job" << std::endl;
+    exit(-1);
+  }
+
+  pthread_mutex_lock(&this->lock);
+  this->job = &fn;
+  this->running = this->num_threads - 1;
+  this->generation++;
+  pthread_cond_broadcast(&this->wake);
+  pthread_mutex_unlock(&this->lock);
+
+  in_job = true;
+  fn(0);
+  in_job = false;
+
+  pthread_mutex_lock(&this->lock);
+  while(this->running > 0) {
+    pthread_cond_wait(&this->finished, &this->lock);
+  }
+  this->job = nullptr;
+  pthread_mutex_unlock(&this->lock);
+}
+
+void ThreadPool::parallel_for(int n, const std::function<void(int, int)>& fn) {
+  if(in_job || serial_only || this->num_threads == 1) {
+    for(int i = 0; i < n; i++) {
+      fn(i, current_index);
+    }
+    return;
+  }
+
+  std::atomic_int next(0);
+  this->run([&](int thread) {
+      for(int i = next.fetch_add(1); i < n; i = next.fetch_add(1)) {
+	fn(i, thread);
+      }
+    });
+}
+
+int ThreadPool::current_thread() {
+  return current_index;
+}
+
+void ThreadPool::set_serial(bool serial) {
+  serial_only = serial;
+}
+
+ThreadPool& thread_pool(int num_threads, bool pin_threads) {
+  static ThreadPool pool(num_threads, pin_threads);
+  return pool;
+}
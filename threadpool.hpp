@@ -0,0 +1,74 @@
+#ifndef INCLUDE_THREADPOOL_HPP
+#define INCLUDE_THREADPOOL_HPP
+
+#include <functional>
+#include <vector>
+
+#include <pthread.h>
+
+// Fixed set of worker threads, created once and shared by everything that
+// runs in parallel. The thread calling run() or parallel_for() takes part as
+// thread 0, so a pool of size n starts n - 1 threads.
+//
+// With pinning, thread i is bound to one logical CPU. Physical cores are
+// used before their SMT siblings, so pools smaller than the machine get one
+// thread per core. Cores are grouped by NUMA node, and node_of() tells which
+// node's memory a thread is close to.
+class ThreadPool {
+public:
+  // num_threads = 0 uses every CPU the process may run on
+  ThreadPool(int num_threads, bool pin_threads);
+  ~ThreadPool();
+
+  int size() const {
+    return this->num_threads;
+  }
+
+  int num_nodes() const {
+    return this->node_count;
+  }
+
+  // The NUMA node thread runs on, always 0 without pinning
+  int node_of(int thread) const {
+    return this->thread_nodes[thread];
+  }
+
+  // Calls fn(thread) once on every thread and waits for all to return
+  void run(const std::function<void(int thread)>& fn);
+
+  // Calls fn(i, thread) for i in [0, n), items handed out dynamically.
+  // Called from inside a pool job, the items run on the calling thread
+  void parallel_for(int n, const std::function<void(int i, int thread)>& fn);
+
+  // Index of the calling thread in the pool it is running a job for, 0 otherwise
+  static int current_thread();
+
+  // Makes parallel_for() on the calling thread run serially, for threads
+  // outside the pool that work while the pool runs something else
+  static void set_serial(bool serial);
+
+private:
+  static void* worker_main(void* data);
+  void pin(int thread);
+
+  int num_threads;
+  int node_count;
+  bool pinned;
+  std::vector<int> thread_cpus;
+  std::vector<int> thread_nodes;
+  std::vector<pthread_t> threads;
+
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t finished;
+  const std::function<void(int)>* job;
+  long generation;
+  int running;
+  bool stopping;
+};
+
+// The pool shared by scene building, rendering and post-processing. The
+// first call creates it; later calls ignore their arguments
+ThreadPool& thread_pool(int num_threads = 0, bool pin_threads = false);
+
+#endif // INCLUDE_THREADPOOL_HPP
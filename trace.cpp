@@ -0,0 +1,92 @@
+#include "trace.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include <pthread.h>
+
+struct TraceEvent {
+  const char* name;
+  double start, duration;
+  int x, y;
+};
+
+struct ThreadTrace {
+  int id;
+  std::vector<TraceEvent> events;
+};
+
+static std::atomic_bool trace_enabled(false);
+static std::chrono::steady_clock::time_point trace_start;
+
+// Never freed, as threads may end before the trace is written
+static pthread_mutex_t traces_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<ThreadTrace*> thread_traces;
+static thread_local ThreadTrace *thread_trace = NULL;
+
+// Microseconds since start_trace(), the unit of the trace format
+static double trace_now() {
+  return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - trace_start).count();
+}
+
+void start_trace() {
+  trace_start = std::chrono::steady_clock::now();
+  trace_enabled = true;
+}
+
+TraceSpan::TraceSpan(const char* name, int x, int y) : name(trace_enabled ? name : NULL), start(0.0), x(x), y(y) {
+  if(this->name) {
+    this->start = trace_now();
+  }
+}
+
+TraceSpan::~TraceSpan() {
+  if(!this->name) {
+    return;
+  }
+
+  double end = trace_now();
+  if(!thread_trace) {
+    thread_trace = new ThreadTrace;
+    pthread_mutex_lock(&traces_lock);
+    thread_trace->id = thread_traces.size();
+    thread_traces.push_back(thread_trace);
+    pthread_mutex_unlock(&traces_lock);
+  }
+  thread_trace->events.push_back({this->name, this->start, end - this->start, this->x, this->y});
+}
+
+bool write_trace(const std::string& file_name) {
+  std::ofstream out(file_name);
+  out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+  out << "  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 0, \"args\": {\"name\": \"weekend-raytracer\"}}";
+
+  pthread_mutex_lock(&traces_lock);
+  long num_events = 0;
+  for(const ThreadTrace *trace : thread_traces) {
+    // Threads are numbered by when they first recorded, so the main thread is usually 0
+    out << ",\n  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": " << trace->id
+	<< ", \"args\": {\"name\": \"thread " << trace->id << "\"}}";
+    for(const TraceEvent& event : trace->events) {
+      out << ",\n  {\"name\": \"" << event.name << "\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << trace->id
+	  << ", \"ts\": " << std::fixed << event.start << ", \"dur\": " << event.duration << std::defaultfloat;
+      if(event.x != -1 || event.y != -1) {
+	out << ", \"args\": {\"x\": " << event.x << ", \"y\": " << event.y << "}";
+      }
+      out << "}";
+    }
+    num_events += trace->events.size();
+  }
+  pthread_mutex_unlock(&traces_lock);
+  out << "\n]}\n";
+
+  if(!out) {
+    std::cerr << "Could not write trace " << file_name << std::endl;
+    return false;
+  }
+  std::cout << "Wrote " << num_events << " trace spans to " << file_name << std::endl;
+  return true;
+}
@@ -0,0 +1,30 @@
+#ifndef INCLUDE_TRACE_HPP
+#define INCLUDE_TRACE_HPP
+
+#include <string>
+
+// Spans of wall-clock time on each thread, written as a Chrome trace that
+// chrome://tracing and ui.perfetto.dev open. Nothing is recorded before
+// start_trace(). Each thread keeps its own spans, so recording takes no
+// lock after a thread's first span; write_trace() must wait until the
+// threads are done with theirs
+
+void start_trace();
+
+// Returns false, with a message, if the file could not be written
+bool write_trace(const std::string& file_name);
+
+// Records the time from construction to destruction on the calling thread,
+// unless name is NULL. x and y, if not -1, are shown with the span
+class TraceSpan {
+public:
+  TraceSpan(const char* name, int x = -1, int y = -1);
+  ~TraceSpan();
+
+private:
+  const char* name;
+  double start;
+  int x, y;
+};
+
+#endif // INCLUDE_TRACE_HPP
@@ -7,8 +7,8 @@
 class FlipNormals : public Hitable {
 public:
   FlipNormals(Hitable *p) : ptr(p) {}
-  virtual bool hit(const Ray& r, float t_min, float t_max, hit_record& rec) const {
-    if(ptr->hit(r, t_min, t_max, rec)) {
+  virtual bool hit(const Ray& r, float t_min, float t_max, hit_record& rec, Sampler& sampler) const {
+    if(ptr->hit(r, t_min, t_max, rec, sampler)) {
       rec.normal = -rec.normal;
       return true;
     }
@@ -20,21 +20,32 @@ public:
     return ptr->bounding_box(t0, t1, box);
   }
 
+  // Lights are two-sided, so flipping the normal changes nothing for sampling
+  virtual void collect_emitters(std::vector<Hitable*>& emitters) {
+    ptr->collect_emitters(emitters);
+  }
+
   Hitable *ptr;
 };
 
 class Translate : public Hitable {
 public:
   Translate(Hitable *p, const vec3& displacement) : ptr(p), offset(displacement) {}
-  virtual bool hit(const Ray& r, float t_min, float t_max, hit_record& rec) const;
+  virtual bool hit(const Ray& r, float t_min, float t_max, hit_record& rec, Sampler& sampler) const;
   virtual bool bounding_box(float t0, float t1, Aabb& box) const;
+  virtual void collect_emitters(std::vector<Hitable*>& emitters);
+  virtual bool sample_light(const vec3& origin, float time, Sampler& sampler, light_sample& ls) const;
+  virtual float light_pdf(const Ray& r, float t_max, Sampler& sampler) const;
+  virtual const Hitable* emitter_primitive() const {
+    return ptr->emitter_primitive();
+  }
   Hitable *ptr;
   vec3 offset;
 };
 
-bool Translate::hit(const Ray& r, float t_min, float t_max, hit_record& rec) const {
+bool Translate::hit(const Ray& r, float t_min, float t_max, hit_record& rec, Sampler& sampler) const {
   Ray moved_r(r.origin() - this->offset, r.direction(), r.time());
-  if (ptr->hit(moved_r, t_min, t_max, rec)) {
+  if (ptr->hit(moved_r, t_min, t_max, rec, sampler)) {
     rec.p += offset;
     return true;
   } else {
@@ -51,16 +62,45 @@ bool Translate::bounding_box(float t0, float t1, Aabb& box) const {
   }
 }
 
+// Emitters below a transform are collected wrapped in the same transform
+void Translate::collect_emitters(std::vector<Hitable*>& emitters) {
+  std::vector<Hitable*> inner;
+  ptr->collect_emitters(inner);
+  for(Hitable* e : inner) {
+    emitters.push_back(new Translate(e, offset));
+  }
+}
+
+bool Translate::sample_light(const vec3& origin, float time, Sampler& sampler, light_sample& ls) const {
+  if(!ptr->sample_light(origin - offset, time, sampler, ls)) {
+    return false;
+  }
+  ls.p += offset;
+  return true;
+}
+
+float Translate::light_pdf(const Ray& r, float t_max, Sampler& sampler) const {
+  Ray moved_r(r.origin() - this->offset, r.direction(), r.time());
+  return ptr->light_pdf(moved_r, t_max, sampler);
+}
+
 class Rotate : public Hitable {
 public:
   Rotate(Hitable *p, const vec3& angles);
-  virtual bool hit(const Ray& r, float t_min, float t_max, hit_record& rec) const;
+  virtual bool hit(const Ray& r, float t_min, float t_max, hit_record& rec, Sampler& sampler) const;
   virtual bool bounding_box(float t0, float t1, Aabb& box) const {
     box = bbox;
     return hasbox;
   };
+  virtual void collect_emitters(std::vector<Hitable*>& emitters);
+  virtual bool sample_light(const vec3& origin, float time, Sampler& sampler, light_sample& ls) const;
+  virtual float light_pdf(const Ray& r, float t_max, Sampler& sampler) const;
+  virtual const Hitable* emitter_primitive() const {
+    return ptr->emitter_primitive();
+  }
 
   Hitable *ptr;
+  vec3 angles;
   vec3 cos_rotation;
   vec3 sin_rotation;
   bool hasbox;
@@ -106,7 +146,7 @@ vec3 rotate_axes_inv(const vec3& point, const vec3& cosrot, const vec3& sinrot)
   return p;
 }
 
-Rotate::Rotate(Hitable* p, const vec3& angles) : ptr(p) {
+Rotate::Rotate(Hitable* p, const vec3& angles) : ptr(p), angles(angles) {
   vec3 radians =  (F_PI / 180.0) * angles;
   cos_rotation = vec3(cos(radians[0]), cos(radians[1]), cos(radians[2]));
   sin_rotation = vec3(sin(radians[0]), sin(radians[1]), sin(radians[2]));
@@ -138,7 +178,7 @@ Rotate::Rotate(Hitable* p, const vec3& angles) : ptr(p) {
   bbox = Aabb(min, max);
 }
 
-bool Rotate::hit(const Ray& r, float t_min, float t_max, hit_record& rec) const {
+bool Rotate::hit(const Ray& r, float t_min, float t_max, hit_record& rec, Sampler& sampler) const {
   vec3 origin = r.origin();
   vec3 direction = r.direction();
 
@@ -148,7 +188,7 @@ bool Rotate::hit(const Ray& r, float t_min, float t_max, hit_record& rec) const
   Ray rotated(origin, direction, r.time());
 
 
-  if(ptr->hit(rotated, t_min, t_max, rec)) {
+  if(ptr->hit(rotated, t_min, t_max, rec, sampler)) {
     vec3 p = rec.p;
     vec3 normal = rec.normal;
     p = rotate_axes(p, cos_rotation, sin_rotation);
@@ -162,4 +202,29 @@ bool Rotate::hit(const Ray& r, float t_min, float t_max, hit_record& rec) const
   }
 }
 
+void Rotate::collect_emitters(std::vector<Hitable*>& emitters) {
+  std::vector<Hitable*> inner;
+  ptr->collect_emitters(inner);
+  for(Hitable* e : inner) {
+    emitters.push_back(new Rotate(e, angles));
+  }
+}
+
+bool Rotate::sample_light(const vec3& origin, float time, Sampler& sampler, light_sample& ls) const {
+  vec3 local_origin = rotate_axes_inv(origin, cos_rotation, sin_rotation);
+  if(!ptr->sample_light(local_origin, time, sampler, ls)) {
+    return false;
+  }
+  ls.p = rotate_axes(ls.p, cos_rotation, sin_rotation);
+  ls.normal = rotate_axes(ls.normal, cos_rotation, sin_rotation);
+  return true;
+}
+
+float Rotate::light_pdf(const Ray& r, float t_max, Sampler& sampler) const {
+  Ray rotated(rotate_axes_inv(r.origin(), cos_rotation, sin_rotation),
+	      rotate_axes_inv(r.direction(), cos_rotation, sin_rotation),
+	      r.time());
+  return ptr->light_pdf(rotated, t_max, sampler);
+}
+
 #endif // _TRANSFORMS_HPP
@@ -4,10 +4,15 @@
 #include "tinyobjloader.hpp"
 
 #include "aabb.hpp"
+#include "sampler.hpp"
+#include "threadpool.hpp"
+#include "counters.hpp"
+#include "trace.hpp"
 
 #include <vector>
 #include <iostream>
 #include <iomanip>
+#include <algorithm>
 
 void TriangleHitable::print_bvh(TriangleBVH* bvh, int depth = 0) {
   if(bvh->num_inds) {
@@ -30,6 +35,8 @@ TriangleHitable::TriangleHitable() { }
 TriangleHitable::TriangleHitable(const std::string& file_name,
 				 Material* mat_ptr) : mat_ptr(mat_ptr) {
 
+  // Parsing, then the BVH build inside it
+  TraceSpan span("load OBJ");
   tinyobj::attrib_t attrib;
   std::vector<tinyobj::shape_t> shapes;
   std::vector<tinyobj::material_t> materials;
@@ -107,14 +114,101 @@ TriangleHitable::TriangleHitable(const std::string& file_name,
   std::cout << "[TriangleHitable()] Inds: " << indices_range.size() << " elems, first = " << indices_range[0] << ", last: " << (*(indices_range.end() - 1)) << std::endl;
 
   std::cout << "Constructing BVH tree for " << file_name << std::endl;
-  this->bvh_root = this->construct_bvh_tree(indices_range);
+  {
+    TraceSpan bvh_span("build mesh BVH");
+    this->bvh_root = this->construct_bvh_tree(indices_range);
+  }
   std::cout << "Finished constructing BVH" << std::endl;
 
   // print_bvh(this->bvh_root);
 }
 
+TriangleHitable::TriangleHitable(const MeshData& mesh, Material* mat_ptr) : mat_ptr(mat_ptr) {
+  int num_vertices = mesh.vertices.size() / 3;
+  this->vertices.resize(num_vertices);
+  this->normals.resize(num_vertices);
+  this->uvs.resize(num_vertices);
+  for(int i = 0; i < num_vertices; i++) {
+    this->vertices[i] = falg::Vec3(mesh.vertices[3 * i + 0], mesh.vertices[3 * i + 1], mesh.vertices[3 * i + 2]);
+    this->normals[i] = falg::Vec3(mesh.normals[3 * i + 0], mesh.normals[3 * i + 1], mesh.normals[3 * i + 2]);
+    this->uvs[i] = falg::Vec2(mesh.uvs[2 * i + 0], mesh.uvs[2 * i + 1]);
+  }
+  this->indices.assign(mesh.indices.begin(), mesh.indices.end());
+  this->num_triangles = this->indices.size() / 3;
+
+  this->bvh_nodes = new TriangleBVH[mesh.nodes.size()];
+  this->bvh_inds = new int[mesh.leaf_inds.size()];
+  std::copy(mesh.leaf_inds.begin(), mesh.leaf_inds.end(), this->bvh_inds);
+  for(unsigned int i = 0; i < mesh.nodes.size(); i++) {
+    const FlatBVHNode& flat = mesh.nodes[i];
+    TriangleBVH& node = this->bvh_nodes[i];
+    node.box = Aabb(falg::Vec3(flat.min[0], flat.min[1], flat.min[2]),
+		    falg::Vec3(flat.max[0], flat.max[1], flat.max[2]));
+    node.l = flat.left >= 0 ? &this->bvh_nodes[flat.left] : nullptr;
+    node.r = flat.right >= 0 ? &this->bvh_nodes[flat.right] : nullptr;
+    node.num_inds = flat.num_inds;
+    node.inds = flat.num_inds ? this->bvh_inds + flat.first_ind : nullptr;
+  }
+  this->bvh_root = this->bvh_nodes;
+}
+
 TriangleHitable::~TriangleHitable() {
-  TriangleHitable::deconstruct_bvh_tree(this->bvh_root);
+  if(this->bvh_nodes) {
+    delete[] this->bvh_nodes;
+    delete[] this->bvh_inds;
+  } else {
+    TriangleHitable::deconstruct_bvh_tree(this->bvh_root);
+  }
+}
+
+void TriangleHitable::export_mesh(MeshData& mesh) const {
+  mesh.vertices.clear();
+  mesh.normals.clear();
+  mesh.uvs.clear();
+  for(unsigned int i = 0; i < this->vertices.size(); i++) {
+    for(int c = 0; c < 3; c++) {
+      mesh.vertices.push_back(this->vertices[i][c]);
+      mesh.normals.push_back(this->normals[i][c]);
+    }
+    mesh.uvs.push_back(this->uvs[i][0]);
+    mesh.uvs.push_back(this->uvs[i][1]);
+  }
+  mesh.indices.assign(this->indices.begin(), this->indices.end());
+
+  // Nodes get their indices in the order they are reached, and the children of a node are filled in when they are
+  mesh.nodes.clear();
+  mesh.leaf_inds.clear();
+  std::vector<std::pair<const TriangleBVH*, int> > stack;
+  stack.push_back(std::make_pair(this->bvh_root, -1));
+  while(stack.size()) {
+    const TriangleBVH* node = stack.back().first;
+    int parent_slot = stack.back().second;
+    stack.pop_back();
+
+    int index = mesh.nodes.size();
+    if(parent_slot >= 0) {
+      FlatBVHNode& parent = mesh.nodes[parent_slot / 2];
+      (parent_slot % 2 ? parent.right : parent.left) = index;
+    }
+
+    FlatBVHNode flat;
+    for(int c = 0; c < 3; c++) {
+      flat.min[c] = node->box.min()[c];
+      flat.max[c] = node->box.max()[c];
+    }
+    flat.left = flat.right = -1;
+    flat.first_ind = mesh.leaf_inds.size();
+    flat.num_inds = node->num_inds;
+    mesh.leaf_inds.insert(mesh.leaf_inds.end(), node->inds, node->inds + node->num_inds);
+    mesh.nodes.push_back(flat);
+
+    if(node->r) {
+      stack.push_back(std::make_pair(node->r, 2 * index + 1));
+    }
+    if(node->l) {
+      stack.push_back(std::make_pair(node->l, 2 * index));
+    }
+  }
 }
 
 void TriangleHitable::deconstruct_bvh_tree(TriangleBVH* node) {
@@ -146,23 +240,49 @@ void TriangleHitable::fill_triangle_min_coord(std::vector<std::pair<float, int>
   }
 }
 
+// Builds the tree one level at a time, splitting all nodes of a level in parallel
 TriangleBVH* TriangleHitable::construct_bvh_tree(const std::vector<int>& inds) {
+  TriangleBVH* root = new TriangleBVH;
 
+  std::vector<std::pair<TriangleBVH*, std::vector<int> > > level;
+  level.push_back(std::make_pair(root, inds));
 
-  std::cout << "[construct] Inds: " << inds.size() << " elems, first = " << inds[0] << ", last: " << (*(inds.end() - 1)) << std::endl;
+  while(level.size()) {
+    std::vector<std::vector<int> > halves(2 * level.size());
 
-  TriangleBVH* bvh = new TriangleBVH;
+    thread_pool().parallel_for(level.size(), [&](int i, int) {
+	this->split_bvh_node(level[i].first, level[i].second, halves[2 * i], halves[2 * i + 1]);
+      });
+
+    std::vector<std::pair<TriangleBVH*, std::vector<int> > > next_level;
+    for(unsigned int i = 0; i < level.size(); i++) {
+      TriangleBVH* bvh = level[i].first;
+      if(bvh->num_inds) {
+	continue;
+      }
+
+      bvh->l = new TriangleBVH;
+      bvh->r = new TriangleBVH;
+      next_level.push_back(std::make_pair(bvh->l, std::move(halves[2 * i])));
+      next_level.push_back(std::make_pair(bvh->r, std::move(halves[2 * i + 1])));
+    }
+    level = std::move(next_level);
+  }
 
+  return root;
+}
+
+// Fills in the box of bvh and either makes it a leaf or divides inds into the triangles of its two children
+void TriangleHitable::split_bvh_node(TriangleBVH* bvh, const std::vector<int>& inds,
+				     std::vector<int>& vec0, std::vector<int>& vec1) {
   bvh->box = this->compute_aabb(inds);
-  std::cout << "Computed bounding box bvh " << bvh->box.min().str() << ", " << bvh->box.max().str() << std::endl;
 
   if(inds.size() <= 2) {
     bvh->inds = new int[inds.size()];
     bvh->num_inds = inds.size();
-    std::cout << "Num inds in computing bvh: " << inds.size() << std::endl;
 
     memcpy(bvh->inds, inds.data(), bvh->num_inds * sizeof(int));
-    return bvh;
+    return;
   }
 
   std::vector<std::pair<float, int> > x_scores(inds.size());
@@ -197,13 +317,10 @@ TriangleBVH* TriangleHitable::construct_bvh_tree(const std::vector<int>& inds) {
 
   if(max_score == x_score) {
     vecref = &x_scores;
-    std::cout << "Dividing by x-axis" << std::endl;
   } else if (max_score == y_score) {
     vecref = &y_scores;
-    std::cout << "Dividing by y-axis" << std::endl;
   } else if (max_score == z_score) {
     vecref = &z_scores;
-    std::cout << "Dividing by z-axis" << std::endl;
   } else {
     std::cerr << "WHaT yOu NeveR pLAy TuBEr SiMULaToR? Also, numeric precision works differently, I guess" << std::endl;
     exit(-1);
@@ -212,8 +329,8 @@ TriangleBVH* TriangleHitable::construct_bvh_tree(const std::vector<int>& inds) {
 
   unsigned int halfway = inds.size() / 2;
 
-  std::vector<int> vec0(halfway);
-  std::vector<int> vec1(inds.size() - halfway);
+  vec0.resize(halfway);
+  vec1.resize(inds.size() - halfway);
 
   for(unsigned int i = 0; i < inds.size(); i++) {
     if(i < halfway) {
@@ -222,11 +339,6 @@ TriangleBVH* TriangleHitable::construct_bvh_tree(const std::vector<int>& inds) {
       vec1[i - halfway] = (*vecref)[i].second;
     }
   }
-
-  bvh->l = construct_bvh_tree(vec0);
-  bvh->r = construct_bvh_tree(vec1);
-
-  return bvh;
 }
 
 void TriangleHitable::compute_separating_boxes(const std::vector<std::pair<float, int> >& vals,
@@ -272,6 +384,7 @@ float TriangleHitable::separation_score(const Aabb& b0, const Aabb& b1) {
 }
 
 bool TriangleHitable::hit_triangle(const Ray& r, float tmin, float tmax, hit_record& rec, int ind) const {
+  COUNT(COUNT_TRIANGLE_TESTS);
   // The Moller-Trumbore algorithm
 
   using namespace falg;
@@ -311,6 +424,7 @@ bool TriangleHitable::hit_triangle(const Ray& r, float tmin, float tmax, hit_rec
 		this->normals[this->indices[3 * ind + 2]] * v).normalized();
 
   rec.mat_ptr = this->mat_ptr;
+  rec.hitable = this;
   rec.u = u;
   rec.v = v;
   return true;
@@ -318,7 +432,8 @@ bool TriangleHitable::hit_triangle(const Ray& r, float tmin, float tmax, hit_rec
 
 bool TriangleHitable::hit_triangle_bvh(TriangleBVH* node, const Ray& r,
 				       float tmin, float tmax, hit_record& rec,
-				       int depth) const {
+				       int depth, int* hit_index) const {
+  COUNT(COUNT_BVH_NODES);
 
   if (node->box.hit(r, tmin, tmax)) {
 
@@ -329,35 +444,43 @@ bool TriangleHitable::hit_triangle_bvh(TriangleBVH* node, const Ray& r,
 	if(this->hit_triangle(r, tmin, tmax, rec, node->inds[i])) {
 	  tmax = rec.t;
 	  bb = true;
+	  if(hit_index) {
+	    *hit_index = node->inds[i];
+	  }
 	}
       }
     }
 
     if(node->l || node->r) {
       hit_record rl, rr;
+      int il = -1, ir = -1;
 
       // Ensure rl.t is set
       rl.t = tmax;
 
-      bool hl = node->l ? hit_triangle_bvh(node->l, r, tmin, tmax, rl, depth + 1) : false;
+      bool hl = node->l ? hit_triangle_bvh(node->l, r, tmin, tmax, rl, depth + 1, hit_index ? &il : nullptr) : false;
 
       // Update tmax, so we may skip hr if we're lucky
       tmax = rl.t;
 
-      bool hr = node->r ? hit_triangle_bvh(node->r, r, tmin, tmax, rr, depth + 1) : false;
+      bool hr = node->r ? hit_triangle_bvh(node->r, r, tmin, tmax, rr, depth + 1, hit_index ? &ir : nullptr) : false;
 
       if(hl && hr) {
 	if(rl.t < rr.t) {
 	  rec = rl;
+	  if(hit_index) *hit_index = il;
 	} else {
 	  rec = rr;
+	  if(hit_index) *hit_index = ir;
 	}
 	return true;
       } else if (hl) {
 	rec = rl;
+	if(hit_index) *hit_index = il;
 	return true;
       } else if (hr) {
 	rec = rr;
+	if(hit_index) *hit_index = ir;
 	return true;
       } else {
 	return bb;
@@ -371,7 +494,8 @@ bool TriangleHitable::hit_triangle_bvh(TriangleBVH* node, const Ray& r,
   return false;
 }
 
-bool TriangleHitable::hit(const Ray& r, float tmin, float tmax, hit_record& rec) const {
+bool TriangleHitable::hit(const Ray& r, float tmin, float tmax, hit_record& rec, Sampler& sampler) const {
+  COUNT(COUNT_MESH_HITS);
   // Naive intersection implementation
   /* bool hit_anything = false;
   for(int i = 0; i < this->num_triangles; i++) {
@@ -386,6 +510,67 @@ bool TriangleHitable::hit(const Ray& r, float tmin, float tmax, hit_record& rec)
   return this->hit_triangle_bvh(bvh_root, r, tmin, tmax, rec, 0);
 }
 
+falg::Vec3 TriangleHitable::triangle_cross(int ind) const {
+  falg::Vec3 v0 = this->vertices[this->indices[3 * ind + 0]];
+  falg::Vec3 v1 = this->vertices[this->indices[3 * ind + 1]];
+  falg::Vec3 v2 = this->vertices[this->indices[3 * ind + 2]];
+  return cross(v1 - v0, v2 - v0);
+}
+
+void TriangleHitable::collect_emitters(std::vector<Hitable*>& emitters) {
+  if(!is_emissive(this->mat_ptr)) {
+    return;
+  }
+
+  // Triangles are picked in proportion to their area
+  this->area_cdf.resize(this->num_triangles);
+  float total = 0.0f;
+  for(int i = 0; i < this->num_triangles; i++) {
+    total += 0.5f * this->triangle_cross(i).norm();
+    this->area_cdf[i] = total;
+  }
+  this->total_area = total;
+
+  emitters.push_back(this);
+}
+
+bool TriangleHitable::sample_light(const falg::Vec3& origin, float time, Sampler& sampler, light_sample& ls) const {
+  if(this->total_area <= 0) {
+    return false;
+  }
+
+  float pick = sampler.get_1d() * this->total_area;
+  int ind = std::upper_bound(this->area_cdf.begin(), this->area_cdf.end(), pick) - this->area_cdf.begin();
+  ind = std::min(ind, this->num_triangles - 1);
+
+  // Uniform point on the triangle from the square root warp
+  falg::Vec2 u = sampler.get_2d();
+  float su = sqrt(u[0]);
+  float b1 = 1 - su;
+  float b2 = u[1] * su;
+
+  falg::Vec3 v0 = this->vertices[this->indices[3 * ind + 0]];
+  falg::Vec3 v1 = this->vertices[this->indices[3 * ind + 1]];
+  falg::Vec3 v2 = this->vertices[this->indices[3 * ind + 2]];
+  ls.p = v0 + b1 * (v1 - v0) + b2 * (v2 - v0);
+  ls.normal = this->triangle_cross(ind).normalized();
+  ls.u = b1;
+  ls.v = b2;
+  ls.mat_ptr = this->mat_ptr;
+  ls.pdf = area_to_solid_angle_pdf(1.0f / this->total_area, origin, ls.p, ls.normal);
+  return ls.pdf > 0;
+}
+
+float TriangleHitable::light_pdf(const Ray& r, float t_max, Sampler& sampler) const {
+  hit_record rec;
+  int ind = -1;
+  if(this->total_area <= 0 || !this->hit_triangle_bvh(bvh_root, r, 0.001, t_max, rec, 0, &ind)) {
+    return 0.0f;
+  }
+  // The geometric normal, as in sample_light(), not the interpolated one
+  return area_to_solid_angle_pdf(1.0f / this->total_area, r.origin(), rec.p, this->triangle_cross(ind).normalized());
+}
+
 bool TriangleHitable::bounding_box(float t0, float t1, Aabb& box) const {
 
   std::vector<int> inds(this->num_triangles);
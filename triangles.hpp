@@ -5,10 +5,32 @@
 #include "hitable.hpp"
 #include "aabb.hpp"
 
+#include <cstdint>
+#include <string>
 #include <vector>
 
 class TriangleHitable;
 
+// A BVH node in a flattened tree. Children are indices into the node array,
+// -1 where there is none, and leaves own num_inds entries of the leaf index
+// array starting at first_ind
+struct FlatBVHNode {
+  float min[3], max[3];
+  int32_t left, right;
+  int32_t first_ind, num_inds;
+};
+
+// A triangle mesh with its BVH, in plain arrays that can be written to and
+// read from a file as they are
+struct MeshData {
+  std::vector<float> vertices; // xyz per vertex
+  std::vector<float> normals;  // xyz per vertex
+  std::vector<float> uvs;      // uv per vertex
+  std::vector<int32_t> indices; // three vertices per triangle
+  std::vector<FlatBVHNode> nodes; // the root first
+  std::vector<int32_t> leaf_inds;
+};
+
 class TriangleBVH {
   TriangleBVH *l = nullptr, *r = nullptr;
   Aabb box;
@@ -31,18 +53,32 @@ class TriangleHitable : public Hitable {
   
   Material *mat_ptr;
   TriangleBVH * bvh_root;
+
+  // Set when the tree was read from MeshData, all nodes and leaf indices in one allocation each
+  TriangleBVH *bvh_nodes = nullptr;
+  int *bvh_inds = nullptr;
+
+  // Running sum of triangle areas, only built when the mesh is emissive
+  std::vector<float> area_cdf;
+  float total_area = 0.0f;
   
 public:
   TriangleHitable();
   TriangleHitable(const std::string& file_name, Material *mat_ptr);
+  // Takes the geometry and tree from mesh, without building anything
+  TriangleHitable(const MeshData& mesh, Material *mat_ptr);
 
   ~TriangleHitable();
 
   void print_bvh(TriangleBVH* tri, int depth);
   
   TriangleBVH* construct_bvh_tree(const std::vector<int>& inds);
+  void split_bvh_node(TriangleBVH* bvh, const std::vector<int>& inds,
+		      std::vector<int>& vec0, std::vector<int>& vec1);
   static void deconstruct_bvh_tree(TriangleBVH* node);
 
+  void export_mesh(MeshData& mesh) const;
+
   void fill_triangle_min_coord(std::vector<std::pair<float, int> >& min_coords,
 			       const std::vector<int>& inds,
 			       int coord);
@@ -57,10 +93,15 @@ public:
   
   
   bool hit_triangle_bvh(TriangleBVH* node, const Ray& r,
-			float tmin, float tmax, hit_record& rec, int depth) const;
+			float tmin, float tmax, hit_record& rec, int depth, int* hit_index = nullptr) const;
   bool hit_triangle(const Ray& r, float tmin, float tmax, hit_record& rec, int ind) const;
-  virtual bool hit(const Ray& r, float tmin, float tmax, hit_record& rec) const;
+  virtual bool hit(const Ray& r, float tmin, float tmax, hit_record& rec, Sampler& sampler) const;
   virtual bool bounding_box(float t0, float t1, Aabb& box) const;
+
+  falg::Vec3 triangle_cross(int ind) const;
+  virtual void collect_emitters(std::vector<Hitable*>& emitters);
+  virtual bool sample_light(const falg::Vec3& origin, float time, Sampler& sampler, light_sample& ls) const;
+  virtual float light_pdf(const Ray& r, float t_max, Sampler& sampler) const;
 };
 
 #endif // INCLUDE_TRIANGLES_HPP
@@ -1,15 +1,39 @@
 #include "utils.hpp"
 
-unidist::unidist(float a, float b) : gen(), dist(a, b) {}
+unidist::unidist(float a, float b, uint32_t seed) : seed(seed), low(a), range(b - a) {
+  this->start_path(0, 0);
+}
+
+void unidist::refill() {
+  uint32_t v[4] = { this->pixel ^ (this->seed * 0x9e3779b9u), this->sample, this->bounce, this->counter++ };
+  pcg4d(v);
 
-float unidist::get() {
-  return (this->dist)(this->gen);
+  for(int i = 0; i < 4; i++) {
+    this->cache[i] = this->low + this->range * uint_to_unit_float(v[i]);
+  }
+  this->cache_pos = 0;
 }
 
-falg::Vec3 random_in_unit_sphere(unidist& dist) {
-  falg::Vec3 p;
-  do {
-    p = 2.0 * falg::Vec3(dist.get(), dist.get(), dist.get()) - falg::Vec3(1, 1, 1);
-  } while (p.sqNorm() >= 1.0);
-  return p;
+void unidist::get(float* out, int n) {
+  int i = 0;
+  while(i < n && this->cache_pos < 4) {
+    out[i++] = this->cache[this->cache_pos++];
+  }
+
+  // Whole blocks of four go straight to the output, independently of each other
+  int num_blocks = (n - i) / 4;
+  uint32_t key = this->pixel ^ (this->seed * 0x9e3779b9u);
+  for(int b = 0; b < num_blocks; b++) {
+    uint32_t v[4] = { key, this->sample, this->bounce, this->counter + b };
+    pcg4d(v);
+    for(int k = 0; k < 4; k++) {
+      out[i + 4 * b + k] = this->low + this->range * uint_to_unit_float(v[k]);
+    }
+  }
+  this->counter += num_blocks;
+  i += 4 * num_blocks;
+
+  while(i < n) {
+    out[i++] = this->get();
+  }
 }
@@ -1,21 +1,89 @@
 #ifndef INCLUDE_UTILS_HPP
 #define INCLUDE_UTILS_HPP
 
-#include <random>
+#include <cstdint>
 #include <FlatAlg.hpp>
 
+// pcg4d hash (Jarzynski & Olano, "Hash Functions for GPU Rendering", 2020).
+// Only integer multiply, add, xor and shift, so loops over it vectorize
+inline void pcg4d(uint32_t v[4]) {
+  for(int i = 0; i < 4; i++) {
+    v[i] = v[i] * 1664525u + 1013904223u;
+  }
+
+  v[0] += v[1] * v[3];
+  v[1] += v[2] * v[0];
+  v[2] += v[0] * v[1];
+  v[3] += v[1] * v[2];
+
+  for(int i = 0; i < 4; i++) {
+    v[i] ^= v[i] >> 16;
+  }
+
+  v[0] += v[1] * v[3];
+  v[1] += v[2] * v[0];
+  v[2] += v[0] * v[1];
+  v[3] += v[1] * v[2];
+}
+
+// Single-word PCG hash, for seeding and combining keys
+inline uint32_t pcg_hash(uint32_t v) {
+  uint32_t state = v * 747796405u + 2891336453u;
+  uint32_t word = ((state >> ((state >> 28) + 4)) ^ state) * 277803737u;
+  return (word >> 22) ^ word;
+}
+
+inline uint32_t hash_combine(uint32_t seed, uint32_t v) {
+  return pcg_hash(seed ^ (v + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+}
+
+// Maps the top 24 bits of a hash to [0, 1)
+inline float uint_to_unit_float(uint32_t x) {
+  return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+// Counter-based generator. Every number is a hash of (seed, pixel, sample,
+// bounce, counter), so a render is identical regardless of thread count or
+// the order in which rows are handed out.
 struct unidist {
-  
-  unidist(float a = 0.0, float b = 1.0);
-
-  float get();
-  
-  std::default_random_engine gen;
-  std::uniform_real_distribution<float> dist;
-  
-};
 
-falg::Vec3 random_in_unit_sphere(unidist& dist);
+  unidist(float a = 0.0, float b = 1.0, uint32_t seed = 0);
 
+  // Restart the stream for a given camera path
+  void start_path(uint32_t pixel, uint32_t sample) {
+    this->pixel = pixel;
+    this->sample = sample;
+    this->set_bounce(0);
+  }
+
+  // Each bounce gets its own stream, so the draws at one bounce never
+  // depend on how many numbers earlier bounces consumed
+  void set_bounce(uint32_t bounce) {
+    this->bounce = bounce;
+    this->counter = 0;
+    this->cache_pos = 4;
+  }
+
+  float get() {
+    if(this->cache_pos == 4) {
+      this->refill();
+    }
+    return this->cache[this->cache_pos++];
+  }
+
+  // Batched generation: writes the next n numbers of the stream to out,
+  // exactly as n calls to get() would
+  void get(float* out, int n);
+
+  void refill();
+
+  uint32_t seed;
+  uint32_t pixel, sample, bounce, counter;
+
+  float low, range;
+
+  float cache[4];
+  int cache_pos;
+};
 
 #endif // INCLUDE_UTILS_HPP